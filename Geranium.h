@@ -11,17 +11,354 @@
 #define GERANIUM_TWEAK_VERSION 38
 
 #define GERANIUM_CONCURRENT_FRAMES 2
+#define GERANIUM_MINIMUM_RENDER_SCALE 0.5f
+#define GERANIUM_READBACK_SLOTS 3
+#define GERANIUM_MAX_TEXTURES 1024
+#define GERANIUM_INVALID_TEXTURE UINT32_MAX
+#define GERANIUM_STAGING_SIZE (16u << 20)
+#define GERANIUM_STAGING_BATCHES 4
+#define GERANIUM_MAX_BUFFERS 256
+#define GERANIUM_INVALID_BUFFER UINT32_MAX
+#define GERANIUM_MAX_PIPELINES 64
+#define GERANIUM_MAX_SPECIALIZATION 16
+#define GERANIUM_MAX_SHADER_NAME 64
+#define GERANIUM_INVALID_PIPELINE UINT32_MAX
+#define GERANIUM_ARENA_SIZE (256u << 10)
+#define GERANIUM_MAX_PASSES 16
+#define GERANIUM_MAX_RESOURCES 32
+#define GERANIUM_MAX_PASS_ACCESSES 8
+#define GERANIUM_INVALID_RESOURCE UINT32_MAX
+#define GERANIUM_INVALID_PASS UINT32_MAX
+#define GERANIUM_MAX_CULL_OBJECTS 65536
+// The pass geranium_render itself draws the frame in.
+#define GERANIUM_MAIN_PASS 0
+
+// Shaders see every texture and buffer through set 0, indexed by handle:
+//   layout(set = 0, binding = 0) uniform sampler2D textures[];
+//   layout(set = 0, binding = 1) buffer Buffer { ... } buffers[];
+#define GERANIUM_TEXTURE_BINDING 0
+#define GERANIUM_BUFFER_BINDING 1
+#define GERANIUM_PUSH_CONSTANT_SIZE 128
+
+typedef struct geranium_frame
+{
+    const void *pixels;
+    uint32_t width;
+    uint32_t height;
+    // The swapchain's VkFormat. Rows are tightly packed.
+    uint32_t format;
+} geranium_frame_t;
+
+typedef void (*geranium_readback_t)(const geranium_frame_t *frame,
+                                    void *data);
+
+typedef struct geranium_texture_info
+{
+    uint32_t width;
+    uint32_t height;
+    // How many mip levels the source holds, finest first and tightly packed
+    // as RGBA8. The rest of the chain is generated on the GPU.
+    uint32_t levels;
+} geranium_texture_info_t;
+
+// Everything that tells one pipeline variant apart from another. Two infos
+// that compare equal field by field always get the same pipeline back.
+typedef struct geranium_pipeline_info
+{
+    // Shader names as handed to geranium_compileShaders, like "default.vert".
+    const char *vertex;
+    const char *fragment;
+    // A VkPrimitiveTopology, VkCullModeFlags and VkFrontFace respectively.
+    uint32_t topology;
+    uint32_t cullMode;
+    uint32_t frontFace;
+    // Premultiplied alpha blending.
+    bool blend;
+    // Tests against the pass's depth attachment, writing it unless the pass
+    // only reads it. Ignored in passes without one.
+    bool depthTest;
+    // The graph pass the pipeline draws in.
+    uint32_t pass;
+    // Specialization constants, with constant_id 0 onwards in both stages.
+    const uint32_t *constants;
+    uint32_t constantCount;
+} geranium_pipeline_info_t;
+
+// Driver host allocations are counted against whichever of these was
+// current when they were made.
+typedef enum geranium_phase
+{
+    GERANIUM_PHASE_CREATE,
+    GERANIUM_PHASE_FRAME,
+    GERANIUM_PHASE_RESIZE,
+    GERANIUM_PHASE_DESTROY,
+    // Shader reloads and pipeline links, which run off the frame loop.
+    GERANIUM_PHASE_BACKGROUND,
+    GERANIUM_PHASE_COUNT
+} geranium_phase_t;
+
+typedef enum geranium_shader_optimization
+{
+    // Exactly what glslang produces.
+    GERANIUM_SHADER_UNOPTIMIZED,
+    // Inlined, constant folded and dead code eliminated, with debug info kept
+    // for captures.
+    GERANIUM_SHADER_OPTIMIZED,
+    // As above, then stripped of debug info.
+    GERANIUM_SHADER_RELEASE,
+} geranium_shader_optimization_t;
+
+typedef struct geranium_memory_stats
+{
+    // Made during the phase.
+    uint64_t allocations;
+    uint64_t allocatedBytes;
+    uint64_t frees;
+    // Across every phase, what the driver holds now and the most it ever has.
+    uint64_t liveBytes;
+    uint64_t peakBytes;
+    // Geranium's own storage.
+    size_t arenaUsed;
+    size_t arenaPeak;
+    size_t arenaSize;
+} geranium_memory_stats_t;
+
+typedef struct geranium_heap_budget
+{
+    // How much the driver would like this process to stay under, which
+    // shrinks as other processes take their share.
+    uint64_t budget;
+    // This process's use, including what the driver allocates on its own.
+    uint64_t usage;
+    uint64_t size;
+    bool deviceLocal;
+} geranium_heap_budget_t;
+
+typedef void (*geranium_pressure_t)(uint32_t heap,
+                                    const geranium_heap_budget_t *budget,
+                                    void *data);
+
+// How a pass uses a graph resource. The barriers between passes are worked
+// out from these, so they have to be complete. Images are attached or
+// sampled, buffers read and written from shaders or drawn indirectly from.
+typedef enum geranium_access
+{
+    GERANIUM_ACCESS_COLOR_WRITE,
+    GERANIUM_ACCESS_DEPTH_WRITE,
+    // Depth testing against an attachment without writing it.
+    GERANIUM_ACCESS_DEPTH_READ,
+    GERANIUM_ACCESS_SAMPLED,
+    GERANIUM_ACCESS_STORAGE_READ,
+    GERANIUM_ACCESS_STORAGE_WRITE,
+    GERANIUM_ACCESS_INDIRECT_READ,
+    GERANIUM_ACCESS_COUNT
+} geranium_access_t;
+
+typedef struct geranium_resource_access
+{
+    uint32_t resource;
+    geranium_access_t access;
+} geranium_resource_access_t;
+
+// Graph images only live for a frame; nothing written to one is kept past
+// the last pass that reads it, which lets images with disjoint lifetimes
+// share memory.
+typedef struct geranium_image_info
+{
+    // A VkFormat.
+    uint32_t format;
+    // Relative to the swapchain extent, zero meaning the same size.
+    float scale;
+} geranium_image_info_t;
+
+// Called with the VkCommandBuffer, inside the pass's renderpass if it has
+// any attachments.
+typedef void (*geranium_record_t)(void *commandBuffer, void *data);
+
+typedef struct geranium_pass_info
+{
+    // Labels the pass in captures if not null. Kept, not copied.
+    const char *name;
+    geranium_record_t record;
+    void *data;
+    // Each resource at most once per pass.
+    const geranium_resource_access_t *accesses;
+    uint32_t accessCount;
+} geranium_pass_info_t;
+
+// One per object in the buffer handed to geranium_setCullObjects, laid out
+// as std430. Everything after the bounding sphere is copied into the draw
+// of each object that survives, firstInstance being the usual place to
+// smuggle the object's index through to the shaders.
+typedef struct geranium_cull_object
+{
+    float center[3];
+    float radius;
+    uint32_t indexCount;
+    uint32_t instanceCount;
+    uint32_t firstIndex;
+    int32_t vertexOffset;
+    uint32_t firstInstance;
+    uint32_t padding[3];
+} geranium_cull_object_t;
 
 bool geranium_getExtensions(char **storage);
 
 bool geranium_create(const char *name, uint32_t version);
 void geranium_destroy(void);
 
+// The stage is taken from the extension: vert, frag, comp, geom, tesc or
+// tese.
 bool geranium_compileShaders(const char **names, size_t count);
+// Applies to every compile from now on, hot reloads included.
+void geranium_setShaderOptimization(geranium_shader_optimization_t level);
 
 bool geranium_render(uint32_t framebufferWidth,
                                  uint32_t framebufferHeight);
 
 bool geranium_sync(void);
 
+// Must be called before geranium_create to enable the scaled render target;
+// afterwards it only changes the target. Zero renders at full resolution.
+// Only the main pass and its upscale are timed and scaled: graph passes,
+// culling and the depth pyramid always run at the swapchain's size, so the
+// target should leave room for them.
+void geranium_setDynamicResolution(float targetMilliseconds);
+float geranium_getRenderScale(void);
+
+// Zero removes the limit.
+void geranium_setFrameLimit(uint32_t framesPerSecond);
+// While enabled, geranium_render only draws a frame if geranium_markDirty was
+// called since the last one. Skipped frames still wait out any frame limit,
+// but without one they return at once, so the caller should block on its
+// events rather than poll.
+void geranium_setDirtyRendering(bool enabled);
+void geranium_markDirty(void);
+
+// Must be called before geranium_create. Requested frames are handed to the
+// callback a few frames later, from within geranium_render or geranium_sync,
+// and the pixels are only valid for the duration of the call.
+void geranium_enableReadback(bool enabled);
+bool geranium_requestReadback(geranium_readback_t callback, void *data);
+
+// Must be called before geranium_create. Turns on the validation layer and
+// debug utils where installed, sending their messages to the log and naming
+// everything Geranium creates for profilers and captures.
+void geranium_enableDebugging(bool enabled);
+
+// Must be called before geranium_create. Remembers the chosen device and its
+// queue families in the file, so later launches only check them instead of
+// scoring every device. Not copied.
+void geranium_setDeviceCache(const char *path);
+
+// Must be called before geranium_create. The most samples the main pass is
+// drawn with, resolving within the pass; the device may allow fewer. One, the
+// default, turns multisampling off.
+void geranium_setMultisampling(uint32_t samples);
+
+// Textures stream in over the following frames, coarsest level first. Memory
+// sources must stay valid until the texture is fully resident.
+uint32_t geranium_createTexture(const geranium_texture_info_t *info,
+                                const void *pixels);
+uint32_t geranium_loadTexture(const geranium_texture_info_t *info,
+                              const char *path);
+// The finest mip level that can be sampled, or UINT32_MAX while none can.
+uint32_t geranium_getTextureLevel(uint32_t texture);
+void geranium_destroyTexture(uint32_t texture);
+
+// Buffers stay mapped for their whole life. Writing to one a frame in flight
+// is still reading is up to the caller to avoid.
+uint32_t geranium_createBuffer(size_t size, void **mapped);
+void geranium_destroyBuffer(uint32_t buffer);
+// Pushed once at the start of every frame, typically to hand shaders the
+// handles they should read.
+bool geranium_setConstants(const void *data, size_t size);
+
+void geranium_getMemoryStats(geranium_phase_t phase,
+                             geranium_memory_stats_t *stats);
+// Returns how many heaps were written, none if the driver can't tell us its
+// budget. Updated on every geranium_render call.
+uint32_t geranium_getMemoryBudget(geranium_heap_budget_t *heaps,
+                                  uint32_t capacity);
+// Called from within geranium_render when a heap's usage reaches the
+// watermark, a fraction of its budget, and again only once it has dropped
+// back well under it. A null callback stops them; otherwise the watermark
+// has to be above zero.
+bool geranium_setMemoryPressure(float watermark, geranium_pressure_t callback,
+                                void *data);
+
+// Returns the cached variant if there is one and builds it otherwise, so
+// this is cheap to call every frame once a variant exists.
+uint32_t geranium_getPipeline(const geranium_pipeline_info_t *info);
+// Used by every frame recorded from now on.
+void geranium_usePipeline(uint32_t pipeline);
+
+// For use inside pass callbacks.
+void geranium_bindPipeline(void *commandBuffer, uint32_t pipeline);
+
+// Passes run every frame in the order they were added, all before the main
+// pass. Changing the graph stalls the next frame while it's rebuilt.
+uint32_t geranium_addImage(const geranium_image_info_t *info);
+uint32_t geranium_addBuffer(uint32_t buffer);
+uint32_t geranium_addPass(const geranium_pass_info_t *info);
+// The graph resources the main pass reads.
+bool geranium_setMainAccesses(const geranium_resource_access_t *accesses,
+                              uint32_t count);
+// The texture handle shaders sample the image through. It never changes, but
+// only holds the image from the first frame recorded after it was added.
+uint32_t geranium_getImageTexture(uint32_t image);
+
+// Must be called before geranium_create, and needs indirect count draws.
+// Each frame, before the graph, a compute pass tests every object against
+// the view's frustum and last frame's depth, writing draws for the rest.
+// Ships cull.comp and pyramid.comp, which go alongside the other shaders.
+void geranium_enableCulling(bool enabled);
+// Object bounds are in the space the view transforms from. The buffer is
+// read by every frame in flight.
+bool geranium_setCullObjects(uint32_t buffer, uint32_t count);
+// Column-major, into Vulkan's clip space, and the view the depth image is
+// drawn with. Used from the next frame on.
+void geranium_setCullView(const float viewProjection[16]);
+// A depth graph image, cleared to one and tested less, that the main pass
+// samples. Skipped while there's none, leaving only the frustum test.
+void geranium_setCullDepth(uint32_t image);
+// For use inside pass callbacks. Draws what survived with 32-bit indices
+// from the buffer.
+void geranium_drawCulled(void *commandBuffer, uint32_t indexBuffer);
+
+// Building with GERANIUM_TRACE defined records scoped CPU events, one ring
+// per thread, along with GPU timestamps placed on the same timeline. Names
+// must outlive the trace, string literals being the usual choice. Without it,
+// scopes compile to nothing and writing a trace fails.
+#ifdef GERANIUM_TRACE
+typedef struct geranium_trace_scope
+{
+    const char *name;
+    uint64_t start;
+} geranium_trace_scope_t;
+
+uint64_t geranium_traceNow(void);
+void geranium_traceEnd(geranium_trace_scope_t *scope);
+
+#define GERANIUM_TRACE_JOIN(a, b) a##b
+#define GERANIUM_TRACE_NAME(line) GERANIUM_TRACE_JOIN(geranium_trace_, line)
+// Lasts until the end of the enclosing block.
+#define GERANIUM_TRACE_SCOPE(name)                                             \
+    [[gnu::cleanup(geranium_traceEnd)]] geranium_trace_scope_t                 \
+    GERANIUM_TRACE_NAME(__LINE__) = {(name), geranium_traceNow()}
+
+// Writes everything still in the rings as Chrome trace JSON, which Perfetto
+// opens too.
+bool geranium_writeTrace(const char *path);
+#else
+#define GERANIUM_TRACE_SCOPE(name)
+#define geranium_writeTrace(path) ((void)(path), false)
+#endif
+
+// The directory is the one shaders are compiled from. Edited sources are
+// recompiled and every cached pipeline rebuilt in the background, to be
+// swapped in at the start of the next frame.
+bool geranium_watchShaders(const char *directory);
+void geranium_unwatchShaders(void);
+
 #endif // GERANIUM_MAIN_H
@@ -0,0 +1,214 @@
+#include <Geranium.h>
+#include <Primrose.h>
+#include <vulkan/vulkan.h>
+
+// Contained in Memory.c.
+extern const VkAllocationCallbacks *gAllocator;
+
+// Contained in Geranium.c.
+extern bool allocateImage(const VkImageCreateInfo *const info,
+                          VkMemoryPropertyFlags required,
+                          VkMemoryPropertyFlags preferred, VkImage *image,
+                          VkDeviceMemory *memory);
+
+// Contained in Debug.c.
+extern void nameObject(VkObjectType type, uint64_t handle, const char *format,
+                       ...);
+
+// The main pass draws into these, then resolves into the swapchain image or
+// the scaled target. Neither outlives the pass, so on tile-based GPUs they
+// need never leave tile memory, and memory is only committed on demand.
+typedef struct attachment
+{
+    VkImage image;
+    VkDeviceMemory memory;
+    VkImageView view;
+} attachment_t;
+
+static uint32_t pRequestedSamples = 1;
+
+static VkDevice pDevice = nullptr;
+static VkFormat pColorFormat = VK_FORMAT_UNDEFINED;
+static VkFormat pDepthFormat = VK_FORMAT_UNDEFINED;
+static VkSampleCountFlagBits pSamples = VK_SAMPLE_COUNT_1_BIT;
+
+static attachment_t pColor = {0};
+static attachment_t pDepth = {0};
+
+void geranium_setMultisampling(uint32_t samples)
+{
+    pRequestedSamples = samples == 0 ? 1 : samples;
+}
+
+VkSampleCountFlagBits getSampleCount(void) { return pSamples; }
+
+VkFormat getDepthFormat(void) { return pDepthFormat; }
+
+bool multisampled(void) { return pSamples != VK_SAMPLE_COUNT_1_BIT; }
+
+static VkFormat chooseDepthFormat(VkPhysicalDevice physicalDevice)
+{
+    // Stencil is never used, so the formats without it come first.
+    static const VkFormat candidates[] = {
+        VK_FORMAT_D32_SFLOAT,
+        VK_FORMAT_D32_SFLOAT_S8_UINT,
+        VK_FORMAT_D24_UNORM_S8_UINT,
+    };
+    for (size_t i = 0; i < sizeof(candidates) / sizeof(candidates[0]); i++)
+    {
+        VkFormatProperties properties;
+        vkGetPhysicalDeviceFormatProperties(physicalDevice, candidates[i],
+                                            &properties);
+        if (properties.optimalTilingFeatures &
+            VK_FORMAT_FEATURE_DEPTH_STENCIL_ATTACHMENT_BIT)
+            return candidates[i];
+    }
+    return VK_FORMAT_UNDEFINED;
+}
+
+// The most samples both color and depth support, up to what was asked for.
+static VkSampleCountFlagBits chooseSamples(VkPhysicalDevice physicalDevice)
+{
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+    VkSampleCountFlags supported =
+        properties.limits.framebufferColorSampleCounts &
+        properties.limits.framebufferDepthSampleCounts;
+
+    uint32_t samples = VK_SAMPLE_COUNT_64_BIT;
+    while (samples > VK_SAMPLE_COUNT_1_BIT &&
+           (samples > pRequestedSamples || !(supported & samples)))
+        samples >>= 1;
+    return (VkSampleCountFlagBits)samples;
+}
+
+static void destroyAttachment(attachment_t *attachment)
+{
+    vkDestroyImageView(pDevice, attachment->view, gAllocator);
+    vkDestroyImage(pDevice, attachment->image, gAllocator);
+    vkFreeMemory(pDevice, attachment->memory, gAllocator);
+    *attachment = (attachment_t){0};
+}
+
+static bool createAttachment(const VkExtent2D *const extent, VkFormat format,
+                             VkImageUsageFlags usage,
+                             VkImageAspectFlags aspect, const char *name,
+                             attachment_t *attachment)
+{
+    VkImageCreateInfo imageInfo = {0};
+    imageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+    imageInfo.imageType = VK_IMAGE_TYPE_2D;
+    imageInfo.format = format;
+    imageInfo.extent.width = extent->width;
+    imageInfo.extent.height = extent->height;
+    imageInfo.extent.depth = 1;
+    imageInfo.mipLevels = 1;
+    imageInfo.arrayLayers = 1;
+    imageInfo.samples = pSamples;
+    imageInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
+    imageInfo.usage = usage | VK_IMAGE_USAGE_TRANSIENT_ATTACHMENT_BIT;
+    imageInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    imageInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+
+    if (!allocateImage(&imageInfo, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                       VK_MEMORY_PROPERTY_LAZILY_ALLOCATED_BIT,
+                       &attachment->image, &attachment->memory))
+        return false;
+
+    VkImageViewCreateInfo viewInfo = {0};
+    viewInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+    viewInfo.image = attachment->image;
+    viewInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
+    viewInfo.format = format;
+    viewInfo.subresourceRange.aspectMask = aspect;
+    viewInfo.subresourceRange.levelCount = 1;
+    viewInfo.subresourceRange.layerCount = 1;
+
+    VkResult result =
+        vkCreateImageView(pDevice, &viewInfo, gAllocator, &attachment->view);
+    if (result != VK_SUCCESS)
+    {
+        primrose_log(ERROR, "Failed to create %s view. Code: %d.", name,
+                     result);
+        return false;
+    }
+
+    nameObject(VK_OBJECT_TYPE_IMAGE, (uint64_t)attachment->image, "%s", name);
+    nameObject(VK_OBJECT_TYPE_DEVICE_MEMORY, (uint64_t)attachment->memory,
+               "%s memory", name);
+    nameObject(VK_OBJECT_TYPE_IMAGE_VIEW, (uint64_t)attachment->view,
+               "%s view", name);
+    return true;
+}
+
+// Always the full swapchain size, like the scaled target they're shared
+// with.
+bool resizeAttachments(const VkExtent2D *const extent)
+{
+    destroyAttachment(&pDepth);
+    destroyAttachment(&pColor);
+
+    if (!createAttachment(extent, pDepthFormat,
+                          VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT,
+                          VK_IMAGE_ASPECT_DEPTH_BIT, "depth attachment",
+                          &pDepth))
+        return false;
+    if (multisampled() &&
+        !createAttachment(extent, pColorFormat,
+                          VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT,
+                          VK_IMAGE_ASPECT_COLOR_BIT, "multisampled attachment",
+                          &pColor))
+        return false;
+    return true;
+}
+
+// Picks the formats and sample count the main renderpasses are built with,
+// so this has to come before them.
+bool createAttachments(VkPhysicalDevice physicalDevice, VkDevice device,
+                       const VkExtent2D *const extent, VkFormat format)
+{
+    GERANIUM_TRACE_SCOPE(__func__);
+
+    pDevice = device;
+    pColorFormat = format;
+    pDepthFormat = chooseDepthFormat(physicalDevice);
+    if (pDepthFormat == VK_FORMAT_UNDEFINED)
+    {
+        primrose_log(ERROR, "Failed to find a depth format.");
+        return false;
+    }
+    pSamples = chooseSamples(physicalDevice);
+    if (pSamples < pRequestedSamples)
+        primrose_log(VERBOSE, "Multisampling limited to %u samples.",
+                     pSamples);
+
+    if (!resizeAttachments(extent)) return false;
+    primrose_log(VERBOSE_OK, "Created depth attachment with %u samples.",
+                 pSamples);
+    return true;
+}
+
+void destroyAttachments(void)
+{
+    if (pDevice == nullptr) return;
+
+    destroyAttachment(&pDepth);
+    destroyAttachment(&pColor);
+    pDevice = nullptr;
+}
+
+// What a main pass framebuffer around the target is made of, in renderpass
+// order. Returns how many there are.
+uint32_t getMainAttachments(VkImageView target, VkImageView *views)
+{
+    if (!multisampled())
+    {
+        views[0] = target;
+        views[1] = pDepth.view;
+        return 2;
+    }
+    views[0] = pColor.view;
+    views[1] = pDepth.view;
+    views[2] = target;
+    return 3;
+}
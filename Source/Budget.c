@@ -0,0 +1,124 @@
+#include <Geranium.h>
+#include <Primrose.h>
+#include <vulkan/vulkan.h>
+
+// How far under the watermark a heap has to fall before crossing it again
+// fires again, as a fraction of its budget. Keeps a heap hovering right at
+// the line from calling every frame.
+#define GERANIUM_PRESSURE_HYSTERESIS 0.05f
+
+static VkPhysicalDevice pPhysicalDevice = nullptr;
+static bool pEnabled = false;
+
+static geranium_heap_budget_t pHeaps[VK_MAX_MEMORY_HEAPS];
+static uint32_t pHeapCount = 0;
+// Heaps that have crossed the watermark and not yet come back down.
+static uint32_t pPressured = 0;
+
+static float pWatermark = 0.0f;
+static geranium_pressure_t pCallback = nullptr;
+static void *pCallbackData = nullptr;
+
+bool geranium_setMemoryPressure(float watermark, geranium_pressure_t callback,
+                                void *data)
+{
+    // Every heap would be under pressure all the time.
+    if (callback != nullptr && watermark <= 0.0f)
+    {
+        primrose_log(ERROR, "Memory pressure watermark must be above zero.");
+        return false;
+    }
+
+    pWatermark = watermark;
+    pCallback = callback;
+    pCallbackData = data;
+    pPressured = 0;
+    return true;
+}
+
+uint32_t geranium_getMemoryBudget(geranium_heap_budget_t *heaps,
+                                  uint32_t capacity)
+{
+    if (!pEnabled) return 0;
+
+    uint32_t count = pHeapCount < capacity ? pHeapCount : capacity;
+    for (uint32_t i = 0; i < count; i++) heaps[i] = pHeaps[i];
+    return count;
+}
+
+static void refreshBudget(void)
+{
+    VkPhysicalDeviceMemoryBudgetPropertiesEXT budget = {0};
+    budget.sType =
+        VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MEMORY_BUDGET_PROPERTIES_EXT;
+    VkPhysicalDeviceMemoryProperties2 properties = {0};
+    properties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MEMORY_PROPERTIES_2;
+    properties.pNext = &budget;
+    vkGetPhysicalDeviceMemoryProperties2(pPhysicalDevice, &properties);
+
+    pHeapCount = properties.memoryProperties.memoryHeapCount;
+    for (uint32_t i = 0; i < pHeapCount; i++)
+    {
+        VkMemoryHeap heap = properties.memoryProperties.memoryHeaps[i];
+        pHeaps[i] = (geranium_heap_budget_t){
+            .budget = budget.heapBudget[i],
+            .usage = budget.heapUsage[i],
+            .size = heap.size,
+            .deviceLocal = heap.flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT,
+        };
+    }
+}
+
+// The driver refreshes its numbers at least every present, so this only
+// needs to run once a render call, skipped frames included.
+void updateBudget(void)
+{
+    if (!pEnabled) return;
+
+    refreshBudget();
+    if (pCallback == nullptr) return;
+    for (uint32_t i = 0; i < pHeapCount; i++)
+    {
+        const geranium_heap_budget_t *heap = &pHeaps[i];
+        float used = heap->budget == 0
+                         ? 1.0f
+                         : (float)heap->usage / (float)heap->budget;
+        uint32_t bit = 1u << i;
+        if (pPressured & bit)
+        {
+            if (used < pWatermark - GERANIUM_PRESSURE_HYSTERESIS)
+                pPressured &= ~bit;
+            continue;
+        }
+        if (used < pWatermark) continue;
+
+        pPressured |= bit;
+        primrose_log(VERBOSE, "Heap %u at %.0f%% of its budget.", i,
+                     used * 100.0f);
+        pCallback(i, heap, pCallbackData);
+    }
+}
+
+void createBudget(VkPhysicalDevice physicalDevice, bool supported)
+{
+    pPhysicalDevice = physicalDevice;
+    pEnabled = supported;
+    pPressured = 0;
+    if (!supported)
+    {
+        primrose_log(VERBOSE, "Memory budget not supported; no pressure "
+                              "callbacks.");
+        return;
+    }
+
+    // Callbacks only ever come from geranium_render.
+    refreshBudget();
+    primrose_log(VERBOSE_OK, "Tracking memory budget.");
+}
+
+void destroyBudget(void)
+{
+    pEnabled = false;
+    pHeapCount = 0;
+    pPhysicalDevice = nullptr;
+}
@@ -0,0 +1,132 @@
+#include <Geranium.h>
+#include <Primrose.h>
+#include <vulkan/vulkan.h>
+
+// Contained in Memory.c.
+extern const VkAllocationCallbacks *gAllocator;
+
+// Contained in Geranium.c.
+extern bool allocateBuffer(VkDeviceSize size, VkBufferUsageFlags usage,
+                           VkMemoryPropertyFlags required,
+                           VkMemoryPropertyFlags preferred, VkBuffer *buffer,
+                           VkDeviceMemory *memory);
+
+// Contained in Descriptors.c.
+extern uint32_t acquireSlot(uint32_t binding);
+extern void releaseSlot(uint32_t binding, uint32_t slot);
+extern void writeBufferSlot(uint32_t slot, VkBuffer buffer);
+
+// Contained in Retire.c.
+extern bool retireObject(void (*release)(uint64_t object), uint64_t object);
+
+// Contained in Debug.c.
+extern void nameObject(VkObjectType type, uint64_t handle, const char *format,
+                       ...);
+
+typedef struct buffer
+{
+    bool used;
+    bool retiring;
+    VkBuffer buffer;
+    VkDeviceMemory memory;
+    void *mapped;
+} buffer_t;
+
+static VkDevice pDevice = nullptr;
+static buffer_t pBuffers[GERANIUM_MAX_BUFFERS];
+
+void createBuffers(VkDevice device) { pDevice = device; }
+
+static void releaseBuffer(uint64_t index)
+{
+    buffer_t *buffer = &pBuffers[index];
+    vkUnmapMemory(pDevice, buffer->memory);
+    vkDestroyBuffer(pDevice, buffer->buffer, gAllocator);
+    vkFreeMemory(pDevice, buffer->memory, gAllocator);
+    *buffer = (buffer_t){0};
+    releaseSlot(GERANIUM_BUFFER_BINDING, (uint32_t)index);
+}
+
+void destroyBuffers(void)
+{
+    if (pDevice == nullptr) return;
+
+    for (size_t i = 0; i < GERANIUM_MAX_BUFFERS; i++)
+        if (pBuffers[i].used && !pBuffers[i].retiring) releaseBuffer(i);
+    pDevice = nullptr;
+}
+
+uint32_t geranium_createBuffer(size_t size, void **mapped)
+{
+    if (pDevice == nullptr || size == 0) return GERANIUM_INVALID_BUFFER;
+
+    uint32_t slot = acquireSlot(GERANIUM_BUFFER_BINDING);
+    if (slot == UINT32_MAX)
+    {
+        primrose_log(ERROR, "Ran out of buffer slots.");
+        return GERANIUM_INVALID_BUFFER;
+    }
+
+    // Host-visible device-local memory, where there is any, saves shaders
+    // reading the buffer a trip over the bus. Indices for culled draws come
+    // from these too.
+    buffer_t *buffer = &pBuffers[slot];
+    if (!allocateBuffer(size,
+                        VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+                            VK_BUFFER_USAGE_INDEX_BUFFER_BIT,
+                        VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                            VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                        VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &buffer->buffer,
+                        &buffer->memory))
+    {
+        releaseSlot(GERANIUM_BUFFER_BINDING, slot);
+        return GERANIUM_INVALID_BUFFER;
+    }
+
+    VkResult result = vkMapMemory(pDevice, buffer->memory, 0, VK_WHOLE_SIZE,
+                                  0, &buffer->mapped);
+    if (result != VK_SUCCESS)
+    {
+        primrose_log(ERROR, "Failed to map buffer. Code: %d.", result);
+        vkDestroyBuffer(pDevice, buffer->buffer, gAllocator);
+        vkFreeMemory(pDevice, buffer->memory, gAllocator);
+        releaseSlot(GERANIUM_BUFFER_BINDING, slot);
+        return GERANIUM_INVALID_BUFFER;
+    }
+
+    writeBufferSlot(slot, buffer->buffer);
+    nameObject(VK_OBJECT_TYPE_BUFFER, (uint64_t)buffer->buffer, "buffer %u",
+               slot);
+    nameObject(VK_OBJECT_TYPE_DEVICE_MEMORY, (uint64_t)buffer->memory,
+               "buffer %u memory", slot);
+    buffer->used = true;
+    *mapped = buffer->mapped;
+    return slot;
+}
+
+VkBuffer getBuffer(uint32_t buffer)
+{
+    if (buffer >= GERANIUM_MAX_BUFFERS || !pBuffers[buffer].used ||
+        pBuffers[buffer].retiring)
+        return nullptr;
+    return pBuffers[buffer].buffer;
+}
+
+void geranium_destroyBuffer(uint32_t buffer)
+{
+    if (buffer >= GERANIUM_MAX_BUFFERS || !pBuffers[buffer].used ||
+        pBuffers[buffer].retiring)
+        return;
+
+    if (retireObject(releaseBuffer, buffer))
+    {
+        pBuffers[buffer].retiring = true;
+        return;
+    }
+
+    // Nothing in flight can still be reading it once the device is idle.
+    primrose_log(ERROR, "Retire queue full; stalling to destroy buffer %u.",
+                 buffer);
+    vkDeviceWaitIdle(pDevice);
+    releaseBuffer(buffer);
+}
@@ -0,0 +1,259 @@
+#include <Geranium.h>
+#include <Primrose.h>
+#include <pthread.h>
+#include <string.h>
+#include <vulkan/vulkan.h>
+
+// Contained in Pipeline.c.
+extern bool buildPipeline(const geranium_pipeline_info_t *info,
+                          VkPipeline *pipeline);
+extern void discardPipeline(VkPipeline pipeline);
+extern void retirePipeline(VkPipeline pipeline);
+
+// Contained in Graph.c.
+extern VkRenderPass getGraphRenderpass(uint32_t pass);
+
+// Contained in Libraries.c.
+extern bool createVariant(const geranium_pipeline_info_t *info,
+                          uint32_t index, VkPipeline *pipeline);
+extern void invalidateLibraries(void);
+extern uint32_t getLibraryGeneration(void);
+
+// Twice the number of pipelines keeps probe chains short.
+#define GERANIUM_PIPELINE_BUCKETS (GERANIUM_MAX_PIPELINES * 2)
+
+// A flattened copy of the info with no pointers and no padding, so variants
+// can be hashed and compared as plain bytes.
+typedef struct pipeline_key
+{
+    char vertex[GERANIUM_MAX_SHADER_NAME];
+    char fragment[GERANIUM_MAX_SHADER_NAME];
+    uint32_t topology;
+    uint32_t cullMode;
+    uint32_t frontFace;
+    uint32_t blend;
+    uint32_t depthTest;
+    uint32_t pass;
+    uint32_t constantCount;
+    uint32_t constants[GERANIUM_MAX_SPECIALIZATION];
+} pipeline_key_t;
+
+typedef struct pipeline_entry
+{
+    pipeline_key_t key;
+    uint64_t hash;
+    VkPipeline pipeline;
+    // A rebuilt or optimized pipeline waiting for the next frame boundary.
+    VkPipeline pending;
+} pipeline_entry_t;
+
+// Keys never change once an entry is counted, which is what lets the reload
+// thread read them without holding the lock.
+static pipeline_entry_t pEntries[GERANIUM_MAX_PIPELINES];
+static uint32_t pEntryCount = 0;
+// Entry index plus one, zero being empty.
+static uint32_t pBuckets[GERANIUM_PIPELINE_BUCKETS];
+static uint32_t pActive = GERANIUM_INVALID_PIPELINE;
+
+static pthread_mutex_t pLock = PTHREAD_MUTEX_INITIALIZER;
+
+// FNV-1a.
+static uint64_t hashKey(const pipeline_key_t *key)
+{
+    const uint8_t *bytes = (const uint8_t *)key;
+    uint64_t hash = 0xCBF29CE484222325;
+    for (size_t i = 0; i < sizeof(pipeline_key_t); i++)
+    {
+        hash ^= bytes[i];
+        hash *= 0x100000001B3;
+    }
+    return hash;
+}
+
+static bool createKey(const geranium_pipeline_info_t *info,
+                      pipeline_key_t *key)
+{
+    if (info->vertex == nullptr || info->fragment == nullptr ||
+        strlen(info->vertex) >= GERANIUM_MAX_SHADER_NAME ||
+        strlen(info->fragment) >= GERANIUM_MAX_SHADER_NAME)
+    {
+        primrose_log(ERROR, "Pipeline shader names must be under %d bytes.",
+                     GERANIUM_MAX_SHADER_NAME);
+        return false;
+    }
+    if (info->constantCount > GERANIUM_MAX_SPECIALIZATION)
+    {
+        primrose_log(ERROR, "Pipelines take at most %d constants.",
+                     GERANIUM_MAX_SPECIALIZATION);
+        return false;
+    }
+    if (info->constantCount > 0 && info->constants == nullptr)
+    {
+        primrose_log(ERROR, "Pipeline has %u constants but no values.",
+                     info->constantCount);
+        return false;
+    }
+    if (getGraphRenderpass(info->pass) == nullptr)
+    {
+        primrose_log(ERROR, "Pipeline pass %u doesn't exist.", info->pass);
+        return false;
+    }
+
+    // Zeroing first makes the unused tails of the names and constants part
+    // of the key too.
+    memset(key, 0, sizeof(pipeline_key_t));
+    strcpy(key->vertex, info->vertex);
+    strcpy(key->fragment, info->fragment);
+    key->topology = info->topology;
+    key->cullMode = info->cullMode;
+    key->frontFace = info->frontFace;
+    key->blend = info->blend;
+    key->depthTest = info->depthTest;
+    key->pass = info->pass;
+    key->constantCount = info->constantCount;
+    if (info->constantCount > 0)
+        memcpy(key->constants, info->constants,
+               info->constantCount * sizeof(uint32_t));
+    return true;
+}
+
+static geranium_pipeline_info_t getInfo(const pipeline_key_t *key)
+{
+    return (geranium_pipeline_info_t){
+        .vertex = key->vertex,
+        .fragment = key->fragment,
+        .topology = key->topology,
+        .cullMode = key->cullMode,
+        .frontFace = key->frontFace,
+        .blend = key->blend,
+        .depthTest = key->depthTest,
+        .pass = key->pass,
+        .constants = key->constants,
+        .constantCount = key->constantCount,
+    };
+}
+
+uint32_t geranium_getPipeline(const geranium_pipeline_info_t *info)
+{
+    pipeline_key_t key;
+    if (!createKey(info, &key)) return GERANIUM_INVALID_PIPELINE;
+    uint64_t hash = hashKey(&key);
+
+    uint32_t bucket = hash % GERANIUM_PIPELINE_BUCKETS;
+    while (pBuckets[bucket] != 0)
+    {
+        const pipeline_entry_t *entry = &pEntries[pBuckets[bucket] - 1];
+        if (entry->hash == hash &&
+            memcmp(&entry->key, &key, sizeof(pipeline_key_t)) == 0)
+            return pBuckets[bucket] - 1;
+        bucket = (bucket + 1) % GERANIUM_PIPELINE_BUCKETS;
+    }
+
+    if (pEntryCount == GERANIUM_MAX_PIPELINES)
+    {
+        primrose_log(ERROR, "Ran out of pipeline variants.");
+        return GERANIUM_INVALID_PIPELINE;
+    }
+
+    pipeline_entry_t *entry = &pEntries[pEntryCount];
+    entry->key = key;
+    entry->hash = hash;
+    entry->pending = nullptr;
+    geranium_pipeline_info_t variant = getInfo(&entry->key);
+    if (!createVariant(&variant, pEntryCount, &entry->pipeline))
+        return GERANIUM_INVALID_PIPELINE;
+
+    pthread_mutex_lock(&pLock);
+    uint32_t index = pEntryCount++;
+    pthread_mutex_unlock(&pLock);
+
+    pBuckets[bucket] = index + 1;
+    primrose_log(VERBOSE_OK, "Created pipeline variant %u (%s, %s).", index,
+                 key.vertex, key.fragment);
+    return index;
+}
+
+void geranium_usePipeline(uint32_t pipeline)
+{
+    if (pipeline >= pEntryCount) return;
+    pActive = pipeline;
+}
+
+VkPipeline getActivePipeline(void) { return pEntries[pActive].pipeline; }
+
+void geranium_bindPipeline(void *commandBuffer, uint32_t pipeline)
+{
+    if (pipeline >= pEntryCount) return;
+    vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+                      pEntries[pipeline].pipeline);
+}
+
+// Called from the link and reload threads once a replacement is ready.
+// Anything built before the latest reload is dropped, so a slow optimized
+// link can't undo the rebuild.
+void deliverPipeline(uint32_t index, VkPipeline pipeline, uint32_t generation)
+{
+    pthread_mutex_lock(&pLock);
+    if (generation != getLibraryGeneration())
+    {
+        pthread_mutex_unlock(&pLock);
+        discardPipeline(pipeline);
+        return;
+    }
+    // Nothing ever bound a pipeline that's still pending, so it can go
+    // right away.
+    if (pEntries[index].pending != nullptr)
+        discardPipeline(pEntries[index].pending);
+    pEntries[index].pending = pipeline;
+    pthread_mutex_unlock(&pLock);
+}
+
+// Called from the reload thread. Variants that fail to build keep their
+// current pipeline.
+void rebuildPipelines(void)
+{
+    invalidateLibraries();
+    uint32_t generation = getLibraryGeneration();
+
+    pthread_mutex_lock(&pLock);
+    uint32_t count = pEntryCount;
+    pthread_mutex_unlock(&pLock);
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        geranium_pipeline_info_t info = getInfo(&pEntries[i].key);
+        VkPipeline pipeline;
+        if (buildPipeline(&info, &pipeline))
+            deliverPipeline(i, pipeline, generation);
+    }
+}
+
+// Called at the start of every recorded frame.
+void swapPipelines(void)
+{
+    pthread_mutex_lock(&pLock);
+    for (uint32_t i = 0; i < pEntryCount; i++)
+    {
+        if (pEntries[i].pending == nullptr) continue;
+
+        retirePipeline(pEntries[i].pipeline);
+        pEntries[i].pipeline = pEntries[i].pending;
+        pEntries[i].pending = nullptr;
+        primrose_log(VERBOSE_OK, "Replaced pipeline variant %u.", i);
+    }
+    pthread_mutex_unlock(&pLock);
+}
+
+// The device has to be idle and the link thread stopped.
+void destroyPipelines(void)
+{
+    for (uint32_t i = 0; i < pEntryCount; i++)
+    {
+        discardPipeline(pEntries[i].pipeline);
+        if (pEntries[i].pending != nullptr)
+            discardPipeline(pEntries[i].pending);
+    }
+    memset(pBuckets, 0, sizeof(pBuckets));
+    pEntryCount = 0;
+    pActive = GERANIUM_INVALID_PIPELINE;
+}
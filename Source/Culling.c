@@ -0,0 +1,439 @@
+#include <Geranium.h>
+#include <Primrose.h>
+#include <math.h>
+#include <string.h>
+#include <vulkan/vulkan.h>
+
+// Contained in Memory.c.
+extern const VkAllocationCallbacks *gAllocator;
+extern void setPhase(geranium_phase_t phase);
+
+// Contained in Geranium.c.
+extern bool allocateBuffer(VkDeviceSize size, VkBufferUsageFlags usage,
+                           VkMemoryPropertyFlags required,
+                           VkMemoryPropertyFlags preferred, VkBuffer *buffer,
+                           VkDeviceMemory *memory);
+
+// Contained in Descriptors.c.
+extern uint32_t acquireSlot(uint32_t binding);
+extern void releaseSlot(uint32_t binding, uint32_t slot);
+extern void writeBufferSlot(uint32_t slot, VkBuffer buffer);
+
+// Contained in Pipeline.c.
+extern bool buildComputePipeline(const char *shader, VkPipeline *pipeline);
+extern void bindComputeDescriptors(VkCommandBuffer buffer);
+extern void pushComputeConstants(VkCommandBuffer buffer, const void *data,
+                                 uint32_t size);
+
+// Contained in Graph.c.
+extern bool getMainDepth(uint32_t image, VkExtent2D *extent);
+
+// Contained in Buffers.c.
+extern VkBuffer getBuffer(uint32_t buffer);
+
+// Contained in Debug.c.
+extern void nameObject(VkObjectType type, uint64_t handle, const char *format,
+                       ...);
+
+// Both match the local sizes in the shaders.
+#define GERANIUM_CULL_GROUP 64
+#define GERANIUM_PYRAMID_GROUP 8
+// Enough halvings for any extent Vulkan allows.
+#define GERANIUM_PYRAMID_LEVELS 16
+
+// The rest are laid out as std430 for the shaders too; see Shaders/*.comp.
+typedef struct pyramid_level
+{
+    uint32_t width;
+    uint32_t height;
+    uint32_t offset;
+    uint32_t padding;
+} pyramid_level_t;
+
+typedef struct cull_view
+{
+    // The view the pyramid's depth was drawn from, which projections into
+    // it have to use. The planes are the current view's.
+    float depthViewProjection[16];
+    float planes[6][4];
+    // The size of the depth image the pyramid was built from.
+    float extent[2];
+    // Zero while there's no pyramid to test against.
+    uint32_t levelCount;
+    uint32_t padding;
+    pyramid_level_t levels[GERANIUM_PYRAMID_LEVELS];
+} cull_view_t;
+
+typedef struct cull_constants
+{
+    uint32_t objects;
+    uint32_t objectCount;
+    uint32_t commands;
+    uint32_t count;
+    uint32_t view;
+    uint32_t frame;
+    uint32_t pyramid;
+} cull_constants_t;
+
+typedef struct pyramid_constants
+{
+    uint32_t depth;
+    uint32_t pyramid;
+    uint32_t sourceWidth;
+    uint32_t sourceHeight;
+    uint32_t sourceOffset;
+    uint32_t width;
+    uint32_t height;
+    uint32_t offset;
+    // Whether the source is the depth image rather than the level before.
+    uint32_t first;
+} pyramid_constants_t;
+
+// A buffer only our shaders see, through a slot in the heap.
+typedef struct storage
+{
+    VkBuffer buffer;
+    VkDeviceMemory memory;
+    uint32_t slot;
+} storage_t;
+
+static bool pRequested = false;
+static bool pEnabled = false;
+
+static VkDevice pDevice = nullptr;
+static VkPipeline pCullPipeline = nullptr;
+static VkPipeline pPyramidPipeline = nullptr;
+
+static storage_t pCommands = {0};
+static storage_t pCount = {0};
+// One per frame in flight, written just before the frame is recorded.
+static storage_t pViews = {0};
+static cull_view_t *pMappedViews = nullptr;
+static storage_t pPyramid = {0};
+static VkDeviceSize pPyramidSize = 0;
+
+static uint32_t pObjects = GERANIUM_INVALID_BUFFER;
+static uint32_t pObjectCount = 0;
+static uint32_t pDepth = GERANIUM_INVALID_RESOURCE;
+// What the next frame culls with, pyramid included.
+static cull_view_t pNextView = {0};
+// The current view, which becomes the pyramid's once its depth is drawn.
+static float pViewProjection[16] = {0};
+
+void geranium_enableCulling(bool enabled) { pRequested = enabled; }
+
+bool cullingRequested(void) { return pRequested; }
+
+bool geranium_setCullObjects(uint32_t buffer, uint32_t count)
+{
+    if (count > GERANIUM_MAX_CULL_OBJECTS ||
+        (count > 0 && getBuffer(buffer) == nullptr))
+        return false;
+    pObjects = buffer;
+    pObjectCount = count;
+    return true;
+}
+
+// Gribb and Hartmann's extraction, for a column-major matrix and Vulkan's
+// zero to one depth range. Normalized so the distances work for spheres.
+void geranium_setCullView(const float viewProjection[16])
+{
+    memcpy(pViewProjection, viewProjection, sizeof(pViewProjection));
+
+    float rows[4][4];
+    for (uint32_t i = 0; i < 4; i++)
+        for (uint32_t j = 0; j < 4; j++) rows[i][j] = viewProjection[j * 4 + i];
+
+    for (uint32_t i = 0; i < 4; i++)
+    {
+        pNextView.planes[0][i] = rows[3][i] + rows[0][i];
+        pNextView.planes[1][i] = rows[3][i] - rows[0][i];
+        pNextView.planes[2][i] = rows[3][i] + rows[1][i];
+        pNextView.planes[3][i] = rows[3][i] - rows[1][i];
+        pNextView.planes[4][i] = rows[2][i];
+        pNextView.planes[5][i] = rows[3][i] - rows[2][i];
+    }
+    for (uint32_t i = 0; i < 6; i++)
+    {
+        float *plane = pNextView.planes[i];
+        float length = sqrtf(plane[0] * plane[0] + plane[1] * plane[1] +
+                             plane[2] * plane[2]);
+        if (length == 0.0f) continue;
+        for (uint32_t j = 0; j < 4; j++) plane[j] /= length;
+    }
+}
+
+void geranium_setCullDepth(uint32_t image) { pDepth = image; }
+
+void geranium_drawCulled(void *commandBuffer, uint32_t indexBuffer)
+{
+    VkBuffer indices = getBuffer(indexBuffer);
+    if (!pEnabled || indices == nullptr) return;
+
+    VkCommandBuffer buffer = commandBuffer;
+    vkCmdBindIndexBuffer(buffer, indices, 0, VK_INDEX_TYPE_UINT32);
+    vkCmdDrawIndexedIndirectCount(buffer, pCommands.buffer, 0, pCount.buffer,
+                                  0, GERANIUM_MAX_CULL_OBJECTS,
+                                  sizeof(VkDrawIndexedIndirectCommand));
+}
+
+static bool createStorage(VkDeviceSize size, VkBufferUsageFlags usage,
+                          VkMemoryPropertyFlags required, const char *name,
+                          storage_t *storage)
+{
+    if (!allocateBuffer(size, usage | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                        required, 0, &storage->buffer, &storage->memory))
+        return false;
+
+    storage->slot = acquireSlot(GERANIUM_BUFFER_BINDING);
+    if (storage->slot == UINT32_MAX)
+    {
+        primrose_log(ERROR, "Ran out of buffer slots for the %s.", name);
+        return false;
+    }
+    writeBufferSlot(storage->slot, storage->buffer);
+    nameObject(VK_OBJECT_TYPE_BUFFER, (uint64_t)storage->buffer, "%s", name);
+    nameObject(VK_OBJECT_TYPE_DEVICE_MEMORY, (uint64_t)storage->memory,
+               "%s memory", name);
+    return true;
+}
+
+static void destroyStorage(storage_t *storage)
+{
+    if (storage->buffer == nullptr) return;
+
+    vkDestroyBuffer(pDevice, storage->buffer, gAllocator);
+    vkFreeMemory(pDevice, storage->memory, gAllocator);
+    if (storage->slot != UINT32_MAX)
+        releaseSlot(GERANIUM_BUFFER_BINDING, storage->slot);
+    *storage = (storage_t){0};
+}
+
+bool createCulling(VkDevice device, bool supported)
+{
+    GERANIUM_TRACE_SCOPE(__func__);
+
+    if (!pRequested) return true;
+    if (!supported)
+    {
+        primrose_log(ERROR, "Culling needs indirect count draws; culled "
+                            "draws will draw nothing.");
+        return true;
+    }
+    pDevice = device;
+
+    if (!buildComputePipeline("cull.comp", &pCullPipeline) ||
+        !buildComputePipeline("pyramid.comp", &pPyramidPipeline))
+        return false;
+    if (!createStorage(sizeof(VkDrawIndexedIndirectCommand) *
+                           GERANIUM_MAX_CULL_OBJECTS,
+                       VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT,
+                       VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, "culled commands",
+                       &pCommands) ||
+        !createStorage(sizeof(uint32_t),
+                       VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT |
+                           VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                       VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, "culled count",
+                       &pCount) ||
+        !createStorage(sizeof(cull_view_t) * GERANIUM_CONCURRENT_FRAMES, 0,
+                       VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                           VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                       "cull views", &pViews))
+        return false;
+
+    VkResult result = vkMapMemory(device, pViews.memory, 0, VK_WHOLE_SIZE, 0,
+                                  (void **)&pMappedViews);
+    if (result != VK_SUCCESS)
+    {
+        primrose_log(ERROR, "Failed to map cull views. Code: %d.", result);
+        return false;
+    }
+
+    pEnabled = true;
+    primrose_log(VERBOSE_OK, "Created culling pass.");
+    return true;
+}
+
+void destroyCulling(void)
+{
+    if (pDevice == nullptr) return;
+
+    if (pMappedViews != nullptr) vkUnmapMemory(pDevice, pViews.memory);
+    pMappedViews = nullptr;
+    destroyStorage(&pPyramid);
+    destroyStorage(&pViews);
+    destroyStorage(&pCount);
+    destroyStorage(&pCommands);
+    pPyramidSize = 0;
+    vkDestroyPipeline(pDevice, pPyramidPipeline, gAllocator);
+    vkDestroyPipeline(pDevice, pCullPipeline, gAllocator);
+    pPyramidPipeline = nullptr;
+    pCullPipeline = nullptr;
+    pNextView.levelCount = 0;
+    pEnabled = false;
+    pDevice = nullptr;
+}
+
+static void barrier(VkCommandBuffer buffer, VkPipelineStageFlags source,
+                    VkAccessFlags sourceAccess,
+                    VkPipelineStageFlags destination,
+                    VkAccessFlags destinationAccess)
+{
+    VkMemoryBarrier memoryBarrier = {0};
+    memoryBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    memoryBarrier.srcAccessMask = sourceAccess;
+    memoryBarrier.dstAccessMask = destinationAccess;
+    vkCmdPipelineBarrier(buffer, source, destination, 0, 1, &memoryBarrier, 0,
+                         nullptr, 0, nullptr);
+}
+
+// Recorded before the graph, so any pass in it can draw the results.
+// Objects are tested against this frame's frustum but last frame's depth,
+// seen from last frame's view, which is what spares drawing the scene twice;
+// anything uncovered in between pops in a frame late.
+void recordCulling(VkCommandBuffer buffer, uint32_t frame)
+{
+    if (!pEnabled) return;
+
+    pMappedViews[frame] = pNextView;
+
+    // Last frame's draws read the old results, which its culling wrote and
+    // these overwrite, and its pyramid pass wrote the pyramid about to be
+    // read.
+    barrier(buffer,
+            VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT |
+                VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+            VK_ACCESS_SHADER_WRITE_BIT,
+            VK_PIPELINE_STAGE_TRANSFER_BIT |
+                VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+            VK_ACCESS_TRANSFER_WRITE_BIT | VK_ACCESS_SHADER_READ_BIT |
+                VK_ACCESS_SHADER_WRITE_BIT);
+    vkCmdFillBuffer(buffer, pCount.buffer, 0, sizeof(uint32_t), 0);
+    barrier(buffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
+            VK_ACCESS_TRANSFER_WRITE_BIT,
+            VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+            VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT);
+
+    if (pObjectCount > 0 && getBuffer(pObjects) != nullptr)
+    {
+        cull_constants_t constants = {
+            .objects = pObjects,
+            .objectCount = pObjectCount,
+            .commands = pCommands.slot,
+            .count = pCount.slot,
+            .view = pViews.slot,
+            .frame = frame,
+            .pyramid = pPyramid.slot,
+        };
+        vkCmdBindPipeline(buffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+                          pCullPipeline);
+        bindComputeDescriptors(buffer);
+        pushComputeConstants(buffer, &constants, sizeof(constants));
+        vkCmdDispatch(buffer,
+                      (pObjectCount + GERANIUM_CULL_GROUP - 1) /
+                          GERANIUM_CULL_GROUP,
+                      1, 1);
+    }
+
+    barrier(buffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+            VK_ACCESS_SHADER_WRITE_BIT, VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT,
+            VK_ACCESS_INDIRECT_COMMAND_READ_BIT);
+}
+
+// Each level halves the last, rounding up, so a texel at level n always
+// covers exactly 2^(n + 1) depth pixels a side. Returns the level count.
+static uint32_t layoutPyramid(const VkExtent2D *const extent,
+                              pyramid_level_t *levels, VkDeviceSize *size)
+{
+    uint32_t width = extent->width, height = extent->height, offset = 0;
+    uint32_t count = 0;
+    while (count < GERANIUM_PYRAMID_LEVELS && (width > 1 || height > 1))
+    {
+        width = (width + 1) / 2;
+        height = (height + 1) / 2;
+        levels[count++] = (pyramid_level_t){width, height, offset, 0};
+        offset += width * height;
+    }
+    *size = (VkDeviceSize)offset * sizeof(float);
+    return count;
+}
+
+// Only grows, and only when the depth image does, so stalling for it is
+// rare enough. The frame being recorded already culled against the old
+// pyramid, so it's told there isn't one.
+static bool reservePyramid(VkDeviceSize size, uint32_t frame)
+{
+    if (size <= pPyramidSize) return true;
+
+    setPhase(GERANIUM_PHASE_RESIZE);
+    vkDeviceWaitIdle(pDevice);
+    destroyStorage(&pPyramid);
+    pPyramidSize = 0;
+    pMappedViews[frame].levelCount = 0;
+    bool created = createStorage(size, 0, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                                 "depth pyramid", &pPyramid);
+    setPhase(GERANIUM_PHASE_FRAME);
+    if (!created) return false;
+    pPyramidSize = size;
+    return true;
+}
+
+// Recorded after the graph, whose barriers leave the depth image readable
+// for the main pass. Reduces it to the farthest depth under every texel of
+// each level.
+void recordPyramid(VkCommandBuffer buffer, uint32_t frame)
+{
+    if (!pEnabled) return;
+
+    VkExtent2D extent;
+    pyramid_level_t levels[GERANIUM_PYRAMID_LEVELS];
+    VkDeviceSize size = 0;
+    uint32_t count = 0;
+    if (getMainDepth(pDepth, &extent))
+        count = layoutPyramid(&extent, levels, &size);
+    if (count == 0 || !reservePyramid(size, frame))
+    {
+        pNextView.levelCount = 0;
+        return;
+    }
+
+    // The culling at the start of the frame has to be done reading first.
+    barrier(buffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0,
+            VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0);
+    vkCmdBindPipeline(buffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+                      pPyramidPipeline);
+    bindComputeDescriptors(buffer);
+    for (uint32_t i = 0; i < count; i++)
+    {
+        pyramid_constants_t constants = {
+            .depth = geranium_getImageTexture(pDepth),
+            .pyramid = pPyramid.slot,
+            .sourceWidth = i == 0 ? extent.width : levels[i - 1].width,
+            .sourceHeight = i == 0 ? extent.height : levels[i - 1].height,
+            .sourceOffset = i == 0 ? 0 : levels[i - 1].offset,
+            .width = levels[i].width,
+            .height = levels[i].height,
+            .offset = levels[i].offset,
+            .first = i == 0,
+        };
+        pushComputeConstants(buffer, &constants, sizeof(constants));
+        vkCmdDispatch(buffer,
+                      (levels[i].width + GERANIUM_PYRAMID_GROUP - 1) /
+                          GERANIUM_PYRAMID_GROUP,
+                      (levels[i].height + GERANIUM_PYRAMID_GROUP - 1) /
+                          GERANIUM_PYRAMID_GROUP,
+                      1);
+        if (i + 1 < count)
+            barrier(buffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                    VK_ACCESS_SHADER_WRITE_BIT,
+                    VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                    VK_ACCESS_SHADER_READ_BIT);
+    }
+
+    memcpy(pNextView.depthViewProjection, pViewProjection,
+           sizeof(pViewProjection));
+    memcpy(pNextView.levels, levels, sizeof(pyramid_level_t) * count);
+    pNextView.extent[0] = (float)extent.width;
+    pNextView.extent[1] = (float)extent.height;
+    pNextView.levelCount = count;
+}
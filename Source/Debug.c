@@ -0,0 +1,204 @@
+#include <Geranium.h>
+#include <Primrose.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <vulkan/vulkan.h>
+
+// Contained in Memory.c.
+extern const VkAllocationCallbacks *gAllocator;
+extern void *arenaAllocate(size_t size);
+extern size_t arenaMark(void);
+extern void arenaRelease(size_t mark);
+
+#define GERANIUM_VALIDATION_LAYER "VK_LAYER_KHRONOS_validation"
+#define GERANIUM_MAX_DEBUG_NAME 128
+
+static bool pRequested = false;
+static bool pEnabled = false;
+
+static VkInstance pInstance = nullptr;
+static VkDevice pDevice = nullptr;
+static VkDebugUtilsMessengerEXT pMessenger = nullptr;
+// Also chained into instance creation, which the messenger itself can't see.
+static VkDebugUtilsMessengerCreateInfoEXT pMessengerInfo = {0};
+
+static PFN_vkCreateDebugUtilsMessengerEXT pCreateMessenger = nullptr;
+static PFN_vkDestroyDebugUtilsMessengerEXT pDestroyMessenger = nullptr;
+static PFN_vkSetDebugUtilsObjectNameEXT pSetName = nullptr;
+static PFN_vkCmdBeginDebugUtilsLabelEXT pBeginLabel = nullptr;
+static PFN_vkCmdEndDebugUtilsLabelEXT pEndLabel = nullptr;
+
+void geranium_enableDebugging(bool enabled) { pRequested = enabled; }
+
+static VkBool32 report(VkDebugUtilsMessageSeverityFlagBitsEXT severity,
+                       VkDebugUtilsMessageTypeFlagsEXT,
+                       const VkDebugUtilsMessengerCallbackDataEXT *data, void *)
+{
+    if (severity >= VK_DEBUG_UTILS_MESSAGE_SEVERITY_WARNING_BIT_EXT)
+        primrose_log(ERROR, "Vulkan: %s", data->pMessage);
+    else primrose_log(VERBOSE, "Vulkan: %s", data->pMessage);
+    return VK_FALSE;
+}
+
+static bool hasLayer(void)
+{
+    uint32_t count = 0;
+    vkEnumerateInstanceLayerProperties(&count, nullptr);
+    size_t mark = arenaMark();
+    VkLayerProperties *available =
+        arenaAllocate(sizeof(VkLayerProperties) * count);
+    if (available == nullptr) return false;
+    vkEnumerateInstanceLayerProperties(&count, available);
+
+    bool found = false;
+    for (size_t i = 0; i < count && !found; i++)
+        found = strcmp(available[i].layerName, GERANIUM_VALIDATION_LAYER) == 0;
+    arenaRelease(mark);
+    return found;
+}
+
+static bool hasExtension(const char *layer)
+{
+    uint32_t count = 0;
+    vkEnumerateInstanceExtensionProperties(layer, &count, nullptr);
+    size_t mark = arenaMark();
+    VkExtensionProperties *available =
+        arenaAllocate(sizeof(VkExtensionProperties) * count);
+    if (available == nullptr) return false;
+    vkEnumerateInstanceExtensionProperties(layer, &count, available);
+
+    bool found = false;
+    for (size_t i = 0; i < count && !found; i++)
+        found = strcmp(available[i].extensionName,
+                       VK_EXT_DEBUG_UTILS_EXTENSION_NAME) == 0;
+    arenaRelease(mark);
+    return found;
+}
+
+// Adds whatever of validation and debug utils is installed to the instance
+// info. Both arrays need room for one more entry. Missing pieces only cost
+// their features, never the instance.
+void prepareDebugging(VkInstanceCreateInfo *info, const char **extensions,
+                      const char **layers)
+{
+    if (!pRequested) return;
+
+    bool layer = hasLayer();
+    if (layer)
+    {
+        layers[info->enabledLayerCount++] = GERANIUM_VALIDATION_LAYER;
+        info->ppEnabledLayerNames = layers;
+    }
+    else primrose_log(ERROR, "Validation layer not installed.");
+
+    if (!hasExtension(nullptr) &&
+        !(layer && hasExtension(GERANIUM_VALIDATION_LAYER)))
+    {
+        primrose_log(ERROR, "Debug utils not available; objects will go "
+                            "unnamed.");
+        return;
+    }
+    extensions[info->enabledExtensionCount++] =
+        VK_EXT_DEBUG_UTILS_EXTENSION_NAME;
+    info->ppEnabledExtensionNames = extensions;
+
+    pMessengerInfo.sType =
+        VK_STRUCTURE_TYPE_DEBUG_UTILS_MESSENGER_CREATE_INFO_EXT;
+    pMessengerInfo.messageSeverity =
+        VK_DEBUG_UTILS_MESSAGE_SEVERITY_INFO_BIT_EXT |
+        VK_DEBUG_UTILS_MESSAGE_SEVERITY_WARNING_BIT_EXT |
+        VK_DEBUG_UTILS_MESSAGE_SEVERITY_ERROR_BIT_EXT;
+    pMessengerInfo.messageType =
+        VK_DEBUG_UTILS_MESSAGE_TYPE_GENERAL_BIT_EXT |
+        VK_DEBUG_UTILS_MESSAGE_TYPE_VALIDATION_BIT_EXT |
+        VK_DEBUG_UTILS_MESSAGE_TYPE_PERFORMANCE_BIT_EXT;
+    pMessengerInfo.pfnUserCallback = report;
+    pMessengerInfo.pNext = info->pNext;
+    info->pNext = &pMessengerInfo;
+    pEnabled = true;
+}
+
+bool createDebugging(VkInstance instance)
+{
+    if (!pEnabled) return true;
+
+    pInstance = instance;
+    pCreateMessenger = (PFN_vkCreateDebugUtilsMessengerEXT)
+        vkGetInstanceProcAddr(instance, "vkCreateDebugUtilsMessengerEXT");
+    pDestroyMessenger = (PFN_vkDestroyDebugUtilsMessengerEXT)
+        vkGetInstanceProcAddr(instance, "vkDestroyDebugUtilsMessengerEXT");
+    pSetName = (PFN_vkSetDebugUtilsObjectNameEXT)vkGetInstanceProcAddr(
+        instance, "vkSetDebugUtilsObjectNameEXT");
+    pBeginLabel = (PFN_vkCmdBeginDebugUtilsLabelEXT)vkGetInstanceProcAddr(
+        instance, "vkCmdBeginDebugUtilsLabelEXT");
+    pEndLabel = (PFN_vkCmdEndDebugUtilsLabelEXT)vkGetInstanceProcAddr(
+        instance, "vkCmdEndDebugUtilsLabelEXT");
+    if (pCreateMessenger == nullptr || pDestroyMessenger == nullptr ||
+        pSetName == nullptr || pBeginLabel == nullptr || pEndLabel == nullptr)
+    {
+        primrose_log(ERROR, "Failed to load debug utils functions.");
+        pEnabled = false;
+        return true;
+    }
+
+    // Instance creation is over, so it's only this messenger from now on.
+    pMessengerInfo.pNext = nullptr;
+    VkResult result = pCreateMessenger(instance, &pMessengerInfo, gAllocator,
+                                       &pMessenger);
+    if (result != VK_SUCCESS)
+    {
+        primrose_log(ERROR, "Failed to create debug messenger. Code: %d.",
+                     result);
+        return false;
+    }
+    primrose_log(VERBOSE_OK, "Enabled debug utils.");
+    return true;
+}
+
+void setDebugDevice(VkDevice device) { pDevice = device; }
+
+// Before the instance goes.
+void destroyDebugging(void)
+{
+    if (!pEnabled) return;
+
+    pDestroyMessenger(pInstance, pMessenger, gAllocator);
+    pMessenger = nullptr;
+    pDevice = nullptr;
+    pInstance = nullptr;
+    pEnabled = false;
+}
+
+void nameObject(VkObjectType type, uint64_t handle, const char *format, ...)
+{
+    if (!pEnabled || pDevice == nullptr || handle == 0) return;
+
+    char name[GERANIUM_MAX_DEBUG_NAME];
+    va_list arguments;
+    va_start(arguments, format);
+    vsnprintf(name, sizeof(name), format, arguments);
+    va_end(arguments);
+
+    VkDebugUtilsObjectNameInfoEXT nameInfo = {0};
+    nameInfo.sType = VK_STRUCTURE_TYPE_DEBUG_UTILS_OBJECT_NAME_INFO_EXT;
+    nameInfo.objectType = type;
+    nameInfo.objectHandle = handle;
+    nameInfo.pObjectName = name;
+    pSetName(pDevice, &nameInfo);
+}
+
+void beginLabel(VkCommandBuffer buffer, const char *name)
+{
+    if (!pEnabled) return;
+
+    VkDebugUtilsLabelEXT label = {0};
+    label.sType = VK_STRUCTURE_TYPE_DEBUG_UTILS_LABEL_EXT;
+    label.pLabelName = name;
+    pBeginLabel(buffer, &label);
+}
+
+void endLabel(VkCommandBuffer buffer)
+{
+    if (pEnabled) pEndLabel(buffer);
+}
@@ -0,0 +1,216 @@
+#include <Geranium.h>
+#include <Primrose.h>
+#include <vulkan/vulkan.h>
+
+// Contained in Memory.c.
+extern const VkAllocationCallbacks *gAllocator;
+
+// Contained in Debug.c.
+extern void nameObject(VkObjectType type, uint64_t handle, const char *format,
+                       ...);
+
+VkDescriptorSetLayout gDescriptorLayout = nullptr;
+VkDescriptorSet gDescriptorSet = nullptr;
+
+static VkDevice pDevice = nullptr;
+static VkDescriptorPool pPool = nullptr;
+
+// Each binding hands out its slots from a stack of free indices, lowest
+// first, so the live range of a binding stays compact.
+typedef struct free_list
+{
+    uint32_t *slots;
+    uint32_t count;
+} free_list_t;
+
+static uint32_t pTextureSlots[GERANIUM_MAX_TEXTURES];
+static uint32_t pBufferSlots[GERANIUM_MAX_BUFFERS];
+static free_list_t pFreeLists[2] = {{pTextureSlots, 0}, {pBufferSlots, 0}};
+
+static void fillFreeList(free_list_t *list, uint32_t capacity)
+{
+    list->count = capacity;
+    for (uint32_t i = 0; i < capacity; i++)
+        list->slots[i] = capacity - 1 - i;
+}
+
+bool createDescriptors(VkPhysicalDevice physicalDevice, VkDevice device)
+{
+    GERANIUM_TRACE_SCOPE(__func__);
+
+    pDevice = device;
+
+    // Some implementations cap update-after-bind arrays below our maximums,
+    // in which case the tail of the array simply never gets handed out.
+    VkPhysicalDeviceVulkan12Properties properties12 = {0};
+    properties12.sType =
+        VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_PROPERTIES;
+    VkPhysicalDeviceProperties2 properties = {0};
+    properties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2;
+    properties.pNext = &properties12;
+    vkGetPhysicalDeviceProperties2(physicalDevice, &properties);
+
+    uint32_t textureCount = GERANIUM_MAX_TEXTURES;
+    if (properties12.maxPerStageDescriptorUpdateAfterBindSamplers <
+        textureCount)
+        textureCount =
+            properties12.maxPerStageDescriptorUpdateAfterBindSamplers;
+    if (properties12.maxPerStageDescriptorUpdateAfterBindSampledImages <
+        textureCount)
+        textureCount =
+            properties12.maxPerStageDescriptorUpdateAfterBindSampledImages;
+
+    uint32_t bufferCount = GERANIUM_MAX_BUFFERS;
+    if (properties12.maxPerStageDescriptorUpdateAfterBindStorageBuffers <
+        bufferCount)
+        bufferCount =
+            properties12.maxPerStageDescriptorUpdateAfterBindStorageBuffers;
+
+    VkDescriptorSetLayoutBinding bindings[2] = {{0}, {0}};
+    bindings[0].binding = GERANIUM_TEXTURE_BINDING;
+    bindings[0].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+    bindings[0].descriptorCount = textureCount;
+    bindings[0].stageFlags = VK_SHADER_STAGE_ALL;
+    bindings[1].binding = GERANIUM_BUFFER_BINDING;
+    bindings[1].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    bindings[1].descriptorCount = bufferCount;
+    bindings[1].stageFlags = VK_SHADER_STAGE_ALL;
+
+    // Slots nobody uses are never touched, and slots can be rewritten while
+    // frames using other ones are still in flight.
+    VkDescriptorBindingFlags flags =
+        VK_DESCRIPTOR_BINDING_UPDATE_AFTER_BIND_BIT |
+        VK_DESCRIPTOR_BINDING_UPDATE_UNUSED_WHILE_PENDING_BIT |
+        VK_DESCRIPTOR_BINDING_PARTIALLY_BOUND_BIT;
+    VkDescriptorBindingFlags bindingFlags[2] = {flags, flags};
+
+    VkDescriptorSetLayoutBindingFlagsCreateInfo flagsInfo = {0};
+    flagsInfo.sType =
+        VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_BINDING_FLAGS_CREATE_INFO;
+    flagsInfo.bindingCount = 2;
+    flagsInfo.pBindingFlags = bindingFlags;
+
+    VkDescriptorSetLayoutCreateInfo layoutInfo = {0};
+    layoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+    layoutInfo.pNext = &flagsInfo;
+    layoutInfo.flags =
+        VK_DESCRIPTOR_SET_LAYOUT_CREATE_UPDATE_AFTER_BIND_POOL_BIT;
+    layoutInfo.bindingCount = 2;
+    layoutInfo.pBindings = bindings;
+
+    VkResult result = vkCreateDescriptorSetLayout(
+        device, &layoutInfo, gAllocator, &gDescriptorLayout);
+    if (result != VK_SUCCESS)
+    {
+        primrose_log(ERROR, "Failed to create descriptor layout. Code: %d.",
+                     result);
+        return false;
+    }
+
+    VkDescriptorPoolSize sizes[2] = {
+        {VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, textureCount},
+        {VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, bufferCount},
+    };
+
+    VkDescriptorPoolCreateInfo poolInfo = {0};
+    poolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+    poolInfo.flags = VK_DESCRIPTOR_POOL_CREATE_UPDATE_AFTER_BIND_BIT;
+    poolInfo.maxSets = 1;
+    poolInfo.poolSizeCount = 2;
+    poolInfo.pPoolSizes = sizes;
+
+    result = vkCreateDescriptorPool(device, &poolInfo, gAllocator, &pPool);
+    if (result != VK_SUCCESS)
+    {
+        primrose_log(ERROR, "Failed to create descriptor pool. Code: %d.",
+                     result);
+        return false;
+    }
+
+    VkDescriptorSetAllocateInfo allocateInfo = {0};
+    allocateInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+    allocateInfo.descriptorPool = pPool;
+    allocateInfo.descriptorSetCount = 1;
+    allocateInfo.pSetLayouts = &gDescriptorLayout;
+
+    result = vkAllocateDescriptorSets(device, &allocateInfo, &gDescriptorSet);
+    if (result != VK_SUCCESS)
+    {
+        primrose_log(ERROR, "Failed to allocate descriptor heap. Code: %d.",
+                     result);
+        return false;
+    }
+    nameObject(VK_OBJECT_TYPE_DESCRIPTOR_SET_LAYOUT,
+               (uint64_t)gDescriptorLayout, "descriptor heap layout");
+    nameObject(VK_OBJECT_TYPE_DESCRIPTOR_POOL, (uint64_t)pPool,
+               "descriptor heap pool");
+    nameObject(VK_OBJECT_TYPE_DESCRIPTOR_SET, (uint64_t)gDescriptorSet,
+               "descriptor heap");
+
+    fillFreeList(&pFreeLists[GERANIUM_TEXTURE_BINDING], textureCount);
+    fillFreeList(&pFreeLists[GERANIUM_BUFFER_BINDING], bufferCount);
+
+    primrose_log(VERBOSE_OK,
+                 "Created descriptor heap with %u textures and %u buffers.",
+                 textureCount, bufferCount);
+    return true;
+}
+
+void destroyDescriptors(void)
+{
+    if (pDevice == nullptr) return;
+
+    vkDestroyDescriptorPool(pDevice, pPool, gAllocator);
+    vkDestroyDescriptorSetLayout(pDevice, gDescriptorLayout, gAllocator);
+    pDevice = nullptr;
+}
+
+uint32_t acquireSlot(uint32_t binding)
+{
+    free_list_t *list = &pFreeLists[binding];
+    if (list->count == 0) return UINT32_MAX;
+    return list->slots[--list->count];
+}
+
+// The caller is responsible for making sure no frame in flight still uses
+// the slot.
+void releaseSlot(uint32_t binding, uint32_t slot)
+{
+    free_list_t *list = &pFreeLists[binding];
+    list->slots[list->count++] = slot;
+}
+
+void writeTextureSlot(uint32_t slot, VkImageView view, VkSampler sampler)
+{
+    VkDescriptorImageInfo imageInfo = {0};
+    imageInfo.sampler = sampler;
+    imageInfo.imageView = view;
+    imageInfo.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+
+    VkWriteDescriptorSet write = {0};
+    write.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    write.dstSet = gDescriptorSet;
+    write.dstBinding = GERANIUM_TEXTURE_BINDING;
+    write.dstArrayElement = slot;
+    write.descriptorCount = 1;
+    write.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+    write.pImageInfo = &imageInfo;
+    vkUpdateDescriptorSets(pDevice, 1, &write, 0, nullptr);
+}
+
+void writeBufferSlot(uint32_t slot, VkBuffer buffer)
+{
+    VkDescriptorBufferInfo bufferInfo = {0};
+    bufferInfo.buffer = buffer;
+    bufferInfo.range = VK_WHOLE_SIZE;
+
+    VkWriteDescriptorSet write = {0};
+    write.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    write.dstSet = gDescriptorSet;
+    write.dstBinding = GERANIUM_BUFFER_BINDING;
+    write.dstArrayElement = slot;
+    write.descriptorCount = 1;
+    write.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    write.pBufferInfo = &bufferInfo;
+    vkUpdateDescriptorSets(pDevice, 1, &write, 0, nullptr);
+}
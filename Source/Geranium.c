@@ -1,16 +1,153 @@
 #include <Geranium.h>
 #include <Hyacinth.h>
+#include <Primrose.h>
 #include <stdio.h>
-#include <stdlib.h>
 #include <string.h>
 #include <vulkan/vulkan.h>
 
-extern bool createPipeline(const VkExtent2D *const extent,
-                           const VkDevice device, VkFormat format);
-extern void beginRenderpass(VkFramebuffer framebuffer, VkCommandBuffer buffer,
+// Contained in Memory.c.
+extern const VkAllocationCallbacks *gAllocator;
+extern bool createArena(size_t size);
+extern void destroyArena(void);
+extern void *arenaAllocate(size_t size);
+extern size_t arenaMark(void);
+extern void arenaRelease(size_t mark);
+extern void setPhase(geranium_phase_t phase);
+
+extern bool createPipeline(const VkDevice device, VkFormat format);
+extern void destroyPipeline(void);
+extern void beginRenderpass(VkRenderPass renderpass, VkFramebuffer framebuffer,
+                            VkCommandBuffer buffer,
                             const VkExtent2D *const extent);
 
+extern void bindDescriptors(VkCommandBuffer buffer);
+
 extern VkRenderPass gRenderpass;
+extern VkRenderPass gOffscreenRenderpass;
+
+// Contained in Descriptors.c.
+extern bool createDescriptors(VkPhysicalDevice physicalDevice,
+                              VkDevice device);
+extern void destroyDescriptors(void);
+
+// Contained in Buffers.c.
+extern void createBuffers(VkDevice device);
+extern void destroyBuffers(void);
+
+// Contained in Retire.c.
+extern void collectRetired(bool all);
+
+// Contained in Graph.c.
+extern void createGraph(VkDevice device, const VkExtent2D *const extent);
+extern void resizeGraph(const VkExtent2D *const extent);
+extern void destroyGraph(void);
+extern void recordGraph(VkCommandBuffer buffer);
+
+// Contained in Cache.c.
+extern void swapPipelines(void);
+extern void destroyPipelines(void);
+
+// Contained in Libraries.c.
+extern bool createLibraries(bool enabled);
+extern void destroyLibraries(void);
+extern void collectLibraries(void);
+
+// Contained in Scaling.c.
+extern bool createScaling(VkPhysicalDevice physicalDevice, VkDevice device,
+                          const VkExtent2D *const extent, VkFormat format,
+                          uint32_t timestampBits);
+extern bool resizeScaling(VkDevice device, const VkExtent2D *const extent);
+extern void destroyScaling(VkDevice device);
+extern bool scalingRequested(void);
+extern bool scalingActive(void);
+extern bool scalingCreated(void);
+extern void updateScaling(VkDevice device, uint32_t frame);
+extern VkExtent2D getScaledExtent(const VkExtent2D *const extent);
+extern VkFramebuffer getScaledFramebuffer(void);
+extern void beginScaledTiming(VkCommandBuffer buffer, uint32_t frame);
+extern void endScaledTiming(VkCommandBuffer buffer, uint32_t frame);
+extern void blitScaled(VkCommandBuffer buffer, VkImage image,
+                       const VkExtent2D *const source,
+                       const VkExtent2D *const destination);
+
+// Contained in Readback.c.
+extern bool createReadback(VkDevice device, const VkExtent2D *const extent,
+                           VkFormat format);
+extern bool resizeReadback(VkDevice device, const VkExtent2D *const extent);
+extern void destroyReadback(VkDevice device);
+extern bool readbackRequested(void);
+extern void completeReadbacks(VkDevice device, uint32_t frame);
+extern void recordReadback(VkCommandBuffer buffer, VkImage image,
+                           uint32_t frame);
+
+// Contained in Textures.c.
+extern bool createTextures(VkPhysicalDevice physicalDevice, VkDevice device,
+                           VkQueue transferQueue, uint32_t transferIndex,
+                           uint32_t graphicsIndex);
+extern void destroyTextures(void);
+extern bool pumpTextures(void);
+extern void recordTextureWork(VkCommandBuffer buffer);
+extern VkSemaphore getTransferSemaphore(void);
+extern uint64_t getTransferValue(void);
+
+// Contained in Pacing.c.
+extern bool claimFrame(void);
+
+// Contained in Debug.c.
+extern void prepareDebugging(VkInstanceCreateInfo *info,
+                             const char **extensions, const char **layers);
+extern bool createDebugging(VkInstance instance);
+extern void setDebugDevice(VkDevice device);
+extern void destroyDebugging(void);
+extern void nameObject(VkObjectType type, uint64_t handle, const char *format,
+                       ...);
+extern void beginLabel(VkCommandBuffer buffer, const char *name);
+extern void endLabel(VkCommandBuffer buffer);
+
+// Contained in Attachments.c.
+extern bool createAttachments(VkPhysicalDevice physicalDevice,
+                              VkDevice device, const VkExtent2D *const extent,
+                              VkFormat format);
+extern bool resizeAttachments(const VkExtent2D *const extent);
+extern void destroyAttachments(void);
+extern uint32_t getMainAttachments(VkImageView target, VkImageView *views);
+
+// Contained in Budget.c.
+extern void createBudget(VkPhysicalDevice physicalDevice, bool supported);
+extern void updateBudget(void);
+extern void destroyBudget(void);
+
+// Contained in Selection.c.
+extern bool loadDeviceCache(const VkPhysicalDevice *devices, uint32_t count,
+                            uint32_t *chosen, uint32_t families[3],
+                            uint32_t *familyCount);
+extern void saveDeviceCache(VkPhysicalDevice device,
+                            const uint32_t families[3], uint32_t familyCount);
+
+// Contained in Culling.c.
+extern bool cullingRequested(void);
+extern bool createCulling(VkDevice device, bool supported);
+extern void destroyCulling(void);
+extern void recordCulling(VkCommandBuffer buffer, uint32_t frame);
+extern void recordPyramid(VkCommandBuffer buffer, uint32_t frame);
+
+#ifdef GERANIUM_TRACE
+// Contained in Trace.c.
+extern bool createTrace(VkInstance instance, VkPhysicalDevice physicalDevice,
+                        VkDevice device, uint32_t timestampBits,
+                        bool calibrated);
+extern void destroyTrace(void);
+extern void beginGpuTrace(VkCommandBuffer buffer, uint32_t frame);
+extern void beginGpuScope(VkCommandBuffer buffer, const char *name);
+extern void endGpuScope(VkCommandBuffer buffer);
+extern void collectGpuTrace(uint32_t frame);
+
+#define GERANIUM_GPU_BEGIN(buffer, name) beginGpuScope(buffer, name)
+#define GERANIUM_GPU_END(buffer) endGpuScope(buffer)
+#else
+#define GERANIUM_GPU_BEGIN(buffer, name)
+#define GERANIUM_GPU_END(buffer)
+#endif
 
 static uint32_t currentFrame = 0;
 
@@ -19,8 +156,11 @@ static VkPhysicalDevice pPhysicalDevice = nullptr;
 static VkDevice pLogicalDevice = nullptr;
 static VkQueue pGraphicsQueue = nullptr;
 static VkQueue pPresentQueue = nullptr;
+static VkQueue pTransferQueue = nullptr;
 static uint32_t pGraphicsIndex = 0;
 static uint32_t pPresentIndex = 0;
+static uint32_t pTransferIndex = 0;
+static uint32_t pTimestampBits = 0;
 
 static VkSurfaceKHR pSurface = nullptr;
 static uint32_t pFormatCount = 0;
@@ -34,6 +174,8 @@ static VkPresentModeKHR pMode;
 
 static VkSwapchainKHR pSwapchain = nullptr;
 static uint32_t pImageCount = 0;
+static uint32_t pImageCapacity = 0;
+static VkImage *pImages = nullptr;
 static VkImageView *pSwapchainImages = nullptr;
 static VkFramebuffer *pSwapchainFramebuffers = nullptr;
 
@@ -83,7 +225,8 @@ VkSurfaceFormatKHR chooseSurfaceFormat(void)
             return pFormat;
         }
     }
-    return pFormats[0];
+    pFormat = pFormats[0];
+    return pFormat;
 }
 
 VkPresentModeKHR chooseSurfaceMode(void)
@@ -110,8 +253,109 @@ VkSurfaceCapabilitiesKHR findSurfaceCapabilities(void)
 
 VkSurfaceCapabilitiesKHR getSurfaceCapabilities() { return pCapabilities; }
 
+// Picks a memory type with all the required properties, favouring one that
+// also has the preferred ones.
+static uint32_t findMemoryType(uint32_t typeBits,
+                               VkMemoryPropertyFlags required,
+                               VkMemoryPropertyFlags preferred)
+{
+    VkPhysicalDeviceMemoryProperties memoryProperties;
+    vkGetPhysicalDeviceMemoryProperties(pPhysicalDevice, &memoryProperties);
+
+    uint32_t fallback = UINT32_MAX;
+    for (uint32_t i = 0; i < memoryProperties.memoryTypeCount; i++)
+    {
+        if (!(typeBits & (1u << i))) continue;
+
+        VkMemoryPropertyFlags flags =
+            memoryProperties.memoryTypes[i].propertyFlags;
+        if ((flags & (required | preferred)) == (required | preferred))
+            return i;
+        if ((flags & required) == required && fallback == UINT32_MAX)
+            fallback = i;
+    }
+    return fallback;
+}
+
+bool allocateMemory(const VkMemoryRequirements *const requirements,
+                    VkMemoryPropertyFlags required,
+                    VkMemoryPropertyFlags preferred, VkDeviceMemory *memory)
+{
+    VkMemoryAllocateInfo allocateInfo = {0};
+    allocateInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+    allocateInfo.allocationSize = requirements->size;
+    allocateInfo.memoryTypeIndex =
+        findMemoryType(requirements->memoryTypeBits, required, preferred);
+    if (allocateInfo.memoryTypeIndex == UINT32_MAX)
+    {
+        primrose_log(ERROR, "Failed to find suitable memory type.");
+        return false;
+    }
+
+    VkResult result =
+        vkAllocateMemory(pLogicalDevice, &allocateInfo, gAllocator, memory);
+    if (result != VK_SUCCESS)
+    {
+        primrose_log(ERROR, "Failed to allocate device memory. Code: %d.",
+                     result);
+        return false;
+    }
+    return true;
+}
+
+bool allocateImage(const VkImageCreateInfo *const info,
+                   VkMemoryPropertyFlags required,
+                   VkMemoryPropertyFlags preferred, VkImage *image,
+                   VkDeviceMemory *memory)
+{
+    VkResult result = vkCreateImage(pLogicalDevice, info, gAllocator, image);
+    if (result != VK_SUCCESS)
+    {
+        primrose_log(ERROR, "Failed to create image. Code: %d.", result);
+        return false;
+    }
+
+    VkMemoryRequirements requirements;
+    vkGetImageMemoryRequirements(pLogicalDevice, *image, &requirements);
+    if (!allocateMemory(&requirements, required, preferred, memory))
+        return false;
+
+    vkBindImageMemory(pLogicalDevice, *image, *memory, 0);
+    return true;
+}
+
+bool allocateBuffer(VkDeviceSize size, VkBufferUsageFlags usage,
+                    VkMemoryPropertyFlags required,
+                    VkMemoryPropertyFlags preferred, VkBuffer *buffer,
+                    VkDeviceMemory *memory)
+{
+    VkBufferCreateInfo bufferInfo = {0};
+    bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+    bufferInfo.size = size;
+    bufferInfo.usage = usage;
+    bufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+
+    VkResult result =
+        vkCreateBuffer(pLogicalDevice, &bufferInfo, gAllocator, buffer);
+    if (result != VK_SUCCESS)
+    {
+        primrose_log(ERROR, "Failed to create buffer. Code: %d.", result);
+        return false;
+    }
+
+    VkMemoryRequirements requirements;
+    vkGetBufferMemoryRequirements(pLogicalDevice, *buffer, &requirements);
+    if (!allocateMemory(&requirements, required, preferred, memory))
+        return false;
+
+    vkBindBufferMemory(pLogicalDevice, *buffer, *memory, 0);
+    return true;
+}
+
 bool createSwapchain(const VkExtent2D *const extent)
 {
+    GERANIUM_TRACE_SCOPE(__func__);
+
     VkSurfaceFormatKHR format = chooseSurfaceFormat();
     VkPresentModeKHR mode = chooseSurfaceMode();
     VkSurfaceCapabilitiesKHR capabilities = getSurfaceCapabilities();
@@ -130,6 +374,32 @@ bool createSwapchain(const VkExtent2D *const extent)
     createInfo.imageExtent = *extent;
     createInfo.imageArrayLayers = 1;
     createInfo.imageUsage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT;
+    // The scaled target gets blitted into the swapchain image. Once it
+    // exists scaling can be turned back on at any time, so every later
+    // swapchain needs this too.
+    if (scalingRequested() || scalingCreated())
+    {
+        if (capabilities.supportedUsageFlags & VK_IMAGE_USAGE_TRANSFER_DST_BIT)
+            createInfo.imageUsage |= VK_IMAGE_USAGE_TRANSFER_DST_BIT;
+        else
+        {
+            primrose_log(ERROR, "Swapchain cannot be blitted into; dynamic "
+                                "resolution disabled.");
+            geranium_setDynamicResolution(0.0f);
+        }
+    }
+    // Readbacks copy straight out of the swapchain image.
+    if (readbackRequested())
+    {
+        if (capabilities.supportedUsageFlags & VK_IMAGE_USAGE_TRANSFER_SRC_BIT)
+            createInfo.imageUsage |= VK_IMAGE_USAGE_TRANSFER_SRC_BIT;
+        else
+        {
+            primrose_log(ERROR, "Swapchain cannot be copied from; readback "
+                                "disabled.");
+            geranium_enableReadback(false);
+        }
+    }
     createInfo.preTransform = capabilities.currentTransform;
     createInfo.compositeAlpha = VK_COMPOSITE_ALPHA_OPAQUE_BIT_KHR;
     createInfo.presentMode = mode;
@@ -145,18 +415,30 @@ bool createSwapchain(const VkExtent2D *const extent)
     }
     else createInfo.imageSharingMode = VK_SHARING_MODE_EXCLUSIVE;
 
-    if (vkCreateSwapchainKHR(pLogicalDevice, &createInfo, nullptr,
+    if (vkCreateSwapchainKHR(pLogicalDevice, &createInfo, gAllocator,
                              &pSwapchain) != VK_SUCCESS)
     {
         fprintf(stderr, "Failed to create swapchain.\n");
         return false;
     }
+    nameObject(VK_OBJECT_TYPE_SWAPCHAIN_KHR, (uint64_t)pSwapchain,
+               "swapchain");
 
+    // Recreating the swapchain reuses the arrays, and only has to take new
+    // ones from the arena if it somehow comes back with more images.
     vkGetSwapchainImagesKHR(pLogicalDevice, pSwapchain, &pImageCount, nullptr);
-    VkImage *images = malloc(sizeof(VkImage) * pImageCount);
-    pSwapchainImages = malloc(sizeof(VkImageView) * pImageCount);
-    pSwapchainFramebuffers = malloc(sizeof(VkFramebuffer) * pImageCount);
-    vkGetSwapchainImagesKHR(pLogicalDevice, pSwapchain, &pImageCount, images);
+    if (pImageCount > pImageCapacity)
+    {
+        pImages = arenaAllocate(sizeof(VkImage) * pImageCount);
+        pSwapchainImages = arenaAllocate(sizeof(VkImageView) * pImageCount);
+        pSwapchainFramebuffers =
+            arenaAllocate(sizeof(VkFramebuffer) * pImageCount);
+        if (pImages == nullptr || pSwapchainImages == nullptr ||
+            pSwapchainFramebuffers == nullptr)
+            return false;
+        pImageCapacity = pImageCount;
+    }
+    vkGetSwapchainImagesKHR(pLogicalDevice, pSwapchain, &pImageCount, pImages);
 
     VkImageViewCreateInfo imageCreateInfo = {0};
     imageCreateInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
@@ -174,18 +456,23 @@ bool createSwapchain(const VkExtent2D *const extent)
 
     for (size_t i = 0; i < pImageCount; i++)
     {
-        imageCreateInfo.image = images[i];
-        if (vkCreateImageView(pLogicalDevice, &imageCreateInfo, nullptr,
+        imageCreateInfo.image = pImages[i];
+        if (vkCreateImageView(pLogicalDevice, &imageCreateInfo, gAllocator,
                               &pSwapchainImages[i]) != VK_SUCCESS)
         {
             fprintf(stderr, "Failed to create image view %zu.", i);
             return false;
         }
+        nameObject(VK_OBJECT_TYPE_IMAGE, (uint64_t)pImages[i],
+                   "swapchain image %zu", i);
+        nameObject(VK_OBJECT_TYPE_IMAGE_VIEW, (uint64_t)pSwapchainImages[i],
+                   "swapchain view %zu", i);
     }
 
     return true;
 }
 
+// Only ever called for the chosen device, so the arrays stay put.
 VkSurfaceFormatKHR *getSurfaceFormats(VkPhysicalDevice device)
 {
     if (pFormats != nullptr) return pFormats;
@@ -193,7 +480,8 @@ VkSurfaceFormatKHR *getSurfaceFormats(VkPhysicalDevice device)
     vkGetPhysicalDeviceSurfaceFormatsKHR(device, pSurface, &pFormatCount,
                                          nullptr);
     if (pFormatCount == 0) return nullptr;
-    pFormats = malloc(sizeof(VkSurfaceFormatKHR) * pFormatCount);
+    pFormats = arenaAllocate(sizeof(VkSurfaceFormatKHR) * pFormatCount);
+    if (pFormats == nullptr) return nullptr;
     vkGetPhysicalDeviceSurfaceFormatsKHR(device, pSurface, &pFormatCount,
                                          pFormats);
     return pFormats;
@@ -205,101 +493,296 @@ VkPresentModeKHR *getSurfaceModes(VkPhysicalDevice device)
     vkGetPhysicalDeviceSurfacePresentModesKHR(device, pSurface, &pModeCount,
                                               nullptr);
     if (pModeCount == 0) return nullptr;
-    pModes = malloc(sizeof(VkPresentModeKHR) * pModeCount);
+    pModes = arenaAllocate(sizeof(VkPresentModeKHR) * pModeCount);
+    if (pModes == nullptr) return nullptr;
     vkGetPhysicalDeviceSurfacePresentModesKHR(device, pSurface, &pModeCount,
                                               pModes);
     return pModes;
 }
 
-uint32_t scoreDevice(VkPhysicalDevice device, const char **extensions,
-                     size_t extensionCount)
+static bool hasDeviceExtension(VkPhysicalDevice device, const char *name)
 {
-    VkPhysicalDeviceProperties properties;
-    VkPhysicalDeviceFeatures features;
-    vkGetPhysicalDeviceProperties(device, &properties);
-    vkGetPhysicalDeviceFeatures(device, &features);
+    uint32_t count = 0;
+    vkEnumerateDeviceExtensionProperties(device, nullptr, &count, nullptr);
+    size_t mark = arenaMark();
+    VkExtensionProperties *available =
+        arenaAllocate(sizeof(VkExtensionProperties) * count);
+    if (available == nullptr) return false;
+    vkEnumerateDeviceExtensionProperties(device, nullptr, &count, available);
+
+    bool found = false;
+    for (size_t i = 0; i < count && !found; i++)
+        found = strcmp(available[i].extensionName, name) == 0;
+    arenaRelease(mark);
+    return found;
+}
 
-    uint32_t score = 0;
-    switch (properties.deviceType)
+// Where a device's queues come from, as found by scoring or the cache.
+typedef struct queue_layout
+{
+    // Graphics, present and transfer, in that order.
+    uint32_t families[3];
+    uint32_t familyCount;
+    uint32_t timestampBits;
+} queue_layout_t;
+
+static bool meetsRequirements(VkPhysicalDevice device,
+                              const VkPhysicalDeviceProperties *properties)
+{
+    // Timeline semaphores and descriptor indexing are both 1.2 core, and
+    // both texture streaming and the descriptor heap need them.
+    if (properties->apiVersion < VK_API_VERSION_1_2)
+    {
+        primrose_log(VERBOSE, "%s is older than Vulkan 1.2.",
+                     properties->deviceName);
+        return false;
+    }
+
+    VkPhysicalDeviceVulkan12Features features12 = {0};
+    features12.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES;
+    VkPhysicalDeviceFeatures2 features = {0};
+    features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+    features.pNext = &features12;
+    vkGetPhysicalDeviceFeatures2(device, &features);
+
+    if (!features12.timelineSemaphore || !features12.runtimeDescriptorArray ||
+        !features12.descriptorBindingPartiallyBound ||
+        !features12.descriptorBindingUpdateUnusedWhilePending ||
+        !features12.descriptorBindingSampledImageUpdateAfterBind ||
+        !features12.descriptorBindingStorageBufferUpdateAfterBind ||
+        !features12.shaderSampledImageArrayNonUniformIndexing ||
+        !features12.shaderStorageBufferArrayNonUniformIndexing)
     {
-        case VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU:   score += 4; break;
-        case VK_PHYSICAL_DEVICE_TYPE_INTEGRATED_GPU: score += 3; break;
-        case VK_PHYSICAL_DEVICE_TYPE_VIRTUAL_GPU:    score += 2; break;
-        default:                                     score += 1; break;
+        primrose_log(VERBOSE, "%s lacks timeline semaphores or descriptor "
+                              "indexing.",
+                     properties->deviceName);
+        return false;
     }
+    return true;
+}
 
-    uint32_t availableExtensionCount = 0;
-    vkEnumerateDeviceExtensionProperties(device, nullptr,
-                                         &availableExtensionCount, nullptr);
-    VkExtensionProperties *availableExtensions =
-        malloc(sizeof(VkExtensionProperties) * availableExtensionCount);
-    vkEnumerateDeviceExtensionProperties(
-        device, nullptr, &availableExtensionCount, availableExtensions);
+// Counts only; the arrays themselves are fetched once a device is chosen.
+static bool supportsSurface(VkPhysicalDevice device)
+{
+    uint32_t formatCount = 0, modeCount = 0;
+    vkGetPhysicalDeviceSurfaceFormatsKHR(device, pSurface, &formatCount,
+                                         nullptr);
+    vkGetPhysicalDeviceSurfacePresentModesKHR(device, pSurface, &modeCount,
+                                              nullptr);
+    return formatCount > 0 && modeCount > 0;
+}
 
-    size_t foundCount = 0;
-    for (size_t i = 0; i < availableExtensionCount; i++)
+static VkQueueFamilyProperties *getQueueFamilies(VkPhysicalDevice device,
+                                                 uint32_t *count)
+{
+    vkGetPhysicalDeviceQueueFamilyProperties(device, count, nullptr);
+    VkQueueFamilyProperties *families =
+        arenaAllocate(sizeof(VkQueueFamilyProperties) * *count);
+    if (families == nullptr) return nullptr;
+    vkGetPhysicalDeviceQueueFamilyProperties(device, count, families);
+    return families;
+}
+
+static bool findQueueFamilies(VkPhysicalDevice device, queue_layout_t *layout)
+{
+    size_t mark = arenaMark();
+    VkQueueFamilyProperties *families =
+        getQueueFamilies(device, &layout->familyCount);
+    if (families == nullptr) return false;
+
+    bool foundGraphics = false, foundPresent = false;
+    for (uint32_t i = 0; i < layout->familyCount; i++)
     {
-        VkExtensionProperties extension = availableExtensions[i];
+        if (!foundGraphics && (families[i].queueFlags & VK_QUEUE_GRAPHICS_BIT))
+        {
+            layout->families[0] = i;
+            layout->timestampBits = families[i].timestampValidBits;
+            foundGraphics = true;
+        }
 
-        for (size_t j = 0; j < extensionCount; j++)
-            if (strcmp(extension.extensionName, extensions[j]) == 0)
-            {
-                foundCount++;
-                printf("Found: %s device extension.\n",
-                       extension.extensionName);
-                break;
-            }
+        VkBool32 presentSupport = false;
+        if (!foundPresent)
+            vkGetPhysicalDeviceSurfaceSupportKHR(device, i, pSurface,
+                                                 &presentSupport);
+        if (presentSupport)
+        {
+            layout->families[1] = i;
+            foundPresent = true;
+        }
     }
-    free(availableExtensions);
-    if (foundCount != extensionCount)
+
+    // A dedicated transfer family is usually the DMA engine, which lets
+    // uploads run alongside rendering. Otherwise, the graphics queue it is.
+    layout->families[2] = layout->families[0];
+    for (uint32_t i = 0; i < layout->familyCount; i++)
     {
-        fprintf(stderr, "Failed to find all device extensions.\n");
+        VkQueueFlags flags = families[i].queueFlags;
+        if (!(flags & VK_QUEUE_TRANSFER_BIT) || (flags & VK_QUEUE_GRAPHICS_BIT))
+            continue;
+
+        layout->families[2] = i;
+        if (!(flags & VK_QUEUE_COMPUTE_BIT)) break;
+    }
+    arenaRelease(mark);
+    return foundGraphics && foundPresent;
+}
+
+// The cheap check a cached choice goes through instead of scoring: the same
+// families, still able to do what they were picked for.
+static bool checkQueueFamilies(VkPhysicalDevice device, queue_layout_t *layout)
+{
+    uint32_t count = 0;
+    size_t mark = arenaMark();
+    VkQueueFamilyProperties *families = getQueueFamilies(device, &count);
+    if (families == nullptr) return false;
+
+    bool valid = count == layout->familyCount;
+    for (uint32_t i = 0; i < 3 && valid; i++)
+        valid = layout->families[i] < count;
+    if (valid)
+    {
+        VkQueueFlags graphics = families[layout->families[0]].queueFlags;
+        VkQueueFlags transfer = families[layout->families[2]].queueFlags;
+        // Graphics families can always transfer, flag or no flag.
+        valid = (graphics & VK_QUEUE_GRAPHICS_BIT) &&
+                (transfer & (VK_QUEUE_TRANSFER_BIT | VK_QUEUE_GRAPHICS_BIT));
+        layout->timestampBits =
+            families[layout->families[0]].timestampValidBits;
+    }
+    arenaRelease(mark);
+    if (!valid) return false;
+
+    VkBool32 presentSupport = false;
+    vkGetPhysicalDeviceSurfaceSupportKHR(device, layout->families[1],
+                                         pSurface, &presentSupport);
+    return presentSupport;
+}
+
+static bool checkDevice(VkPhysicalDevice device, queue_layout_t *layout)
+{
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(device, &properties);
+    return meetsRequirements(device, &properties) &&
+           checkQueueFamilies(device, layout) &&
+           hasDeviceExtension(device, VK_KHR_SWAPCHAIN_EXTENSION_NAME) &&
+           supportsSurface(device);
+}
+
+// The type still decides between devices that can both run us; everything
+// after it only breaks ties, and adds up to less than a step in type.
+static uint32_t scoreDevice(VkPhysicalDevice device, queue_layout_t *layout)
+{
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(device, &properties);
+    if (!meetsRequirements(device, &properties)) return 0;
+
+    if (!findQueueFamilies(device, layout))
+    {
+        primrose_log(VERBOSE, "%s can't both render and present.",
+                     properties.deviceName);
         return 0;
     }
 
-    if (getSurfaceFormats(device) == nullptr ||
-        getSurfaceModes(device) == nullptr)
+    uint32_t count = 0;
+    vkEnumerateDeviceExtensionProperties(device, nullptr, &count, nullptr);
+    size_t mark = arenaMark();
+    VkExtensionProperties *available =
+        arenaAllocate(sizeof(VkExtensionProperties) * count);
+    if (available == nullptr) return 0;
+    vkEnumerateDeviceExtensionProperties(device, nullptr, &count, available);
+
+    bool swapchain = false, libraries = false;
+    for (size_t i = 0; i < count; i++)
+    {
+        const char *name = available[i].extensionName;
+        if (strcmp(name, VK_KHR_SWAPCHAIN_EXTENSION_NAME) == 0)
+            swapchain = true;
+        else if (strcmp(name,
+                        VK_EXT_GRAPHICS_PIPELINE_LIBRARY_EXTENSION_NAME) == 0)
+            libraries = true;
+    }
+    arenaRelease(mark);
+
+    if (!swapchain || !supportsSurface(device))
     {
-        fprintf(stderr, "Failed to find surface format/present modes.\n");
+        primrose_log(VERBOSE, "%s can't present to the surface.",
+                     properties.deviceName);
         return 0;
     }
 
-    // TODO: Extra grading to be done here.
+    uint32_t score = 0;
+    switch (properties.deviceType)
+    {
+        case VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU:   score += 4000; break;
+        case VK_PHYSICAL_DEVICE_TYPE_INTEGRATED_GPU: score += 3000; break;
+        case VK_PHYSICAL_DEVICE_TYPE_VIRTUAL_GPU:    score += 2000; break;
+        default:                                     score += 1000; break;
+    }
 
+    // Integrated parts report shared system memory as local, hence the cap.
+    VkPhysicalDeviceMemoryProperties memory;
+    vkGetPhysicalDeviceMemoryProperties(device, &memory);
+    VkDeviceSize localSize = 0;
+    for (uint32_t i = 0; i < memory.memoryHeapCount; i++)
+        if ((memory.memoryHeaps[i].flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT) &&
+            memory.memoryHeaps[i].size > localSize)
+            localSize = memory.memoryHeaps[i].size;
+    VkDeviceSize gibibytes = localSize >> 30;
+    score += (gibibytes > 32 ? 32 : gibibytes) * 16;
+
+    // Dynamic resolution and traces both time the graphics queue.
+    if (properties.limits.timestampComputeAndGraphics &&
+        layout->timestampBits > 0)
+        score += 100;
+    if (libraries) score += 200;
+    score += properties.limits.maxImageDimension2D / 4096 * 16;
+    // Less copying between families when one does both.
+    if (layout->families[0] == layout->families[1]) score += 50;
+
+    primrose_log(VERBOSE, "%s scored %u.", properties.deviceName, score);
     return score;
 }
 
 bool createFramebuffers(const VkExtent2D *const extent)
 {
+    GERANIUM_TRACE_SCOPE(__func__);
+
     VkFramebufferCreateInfo framebufferInfo = {0};
     framebufferInfo.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
     framebufferInfo.renderPass = gRenderpass;
-    framebufferInfo.attachmentCount = 1;
     framebufferInfo.width = extent->width;
     framebufferInfo.height = extent->height;
     framebufferInfo.layers = 1;
 
     for (size_t i = 0; i < pImageCount; i++)
     {
-        framebufferInfo.pAttachments = &pSwapchainImages[i];
-        if (vkCreateFramebuffer(pLogicalDevice, &framebufferInfo, nullptr,
+        VkImageView attachments[3];
+        framebufferInfo.attachmentCount =
+            getMainAttachments(pSwapchainImages[i], attachments);
+        framebufferInfo.pAttachments = attachments;
+        if (vkCreateFramebuffer(pLogicalDevice, &framebufferInfo, gAllocator,
                                 &pSwapchainFramebuffers[i]) != VK_SUCCESS)
         {
             fprintf(stderr, "Failed to create framebuffer.\n");
             return false;
         }
+        nameObject(VK_OBJECT_TYPE_FRAMEBUFFER,
+                   (uint64_t)pSwapchainFramebuffers[i],
+                   "swapchain framebuffer %zu", i);
     }
     return true;
 }
 
 bool createCommandBuffers(void)
 {
+    GERANIUM_TRACE_SCOPE(__func__);
+
     VkCommandPoolCreateInfo poolInfo = {0};
     poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
     poolInfo.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
     poolInfo.queueFamilyIndex = pGraphicsIndex;
 
-    if (vkCreateCommandPool(pLogicalDevice, &poolInfo, nullptr,
+    if (vkCreateCommandPool(pLogicalDevice, &poolInfo, gAllocator,
                             &pCommandPool) != VK_SUCCESS)
     {
         fprintf(stderr, "Failed to create command pool.\n");
@@ -319,11 +802,18 @@ bool createCommandBuffers(void)
         return false;
     }
 
+    nameObject(VK_OBJECT_TYPE_COMMAND_POOL, (uint64_t)pCommandPool,
+               "frame command pool");
+    for (size_t i = 0; i < GERANIUM_CONCURRENT_FRAMES; i++)
+        nameObject(VK_OBJECT_TYPE_COMMAND_BUFFER, (uint64_t)pCommandBuffers[i],
+                   "frame %zu commands", i);
     return true;
 }
 
 bool createSyncObjects(void)
 {
+    GERANIUM_TRACE_SCOPE(__func__);
+
     VkSemaphoreCreateInfo semaphoreInfo = {0};
     semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
     VkFenceCreateInfo fenceInfo = {0};
@@ -332,16 +822,24 @@ bool createSyncObjects(void)
 
     for (size_t i = 0; i < GERANIUM_CONCURRENT_FRAMES; i++)
     {
-        if (vkCreateSemaphore(pLogicalDevice, &semaphoreInfo, nullptr,
+        if (vkCreateSemaphore(pLogicalDevice, &semaphoreInfo, gAllocator,
                               &pImageAvailableSemaphores[i]) != VK_SUCCESS ||
-            vkCreateSemaphore(pLogicalDevice, &semaphoreInfo, nullptr,
+            vkCreateSemaphore(pLogicalDevice, &semaphoreInfo, gAllocator,
                               &pRenderFinishedSemaphores[i]) != VK_SUCCESS ||
-            vkCreateFence(pLogicalDevice, &fenceInfo, nullptr, &pFences[i]) !=
-                VK_SUCCESS)
+            vkCreateFence(pLogicalDevice, &fenceInfo, gAllocator,
+                          &pFences[i]) != VK_SUCCESS)
         {
             fprintf(stderr, "Failed to create sync object.\n");
             return false;
         }
+        nameObject(VK_OBJECT_TYPE_SEMAPHORE,
+                   (uint64_t)pImageAvailableSemaphores[i],
+                   "frame %zu image available", i);
+        nameObject(VK_OBJECT_TYPE_SEMAPHORE,
+                   (uint64_t)pRenderFinishedSemaphores[i],
+                   "frame %zu render finished", i);
+        nameObject(VK_OBJECT_TYPE_FENCE, (uint64_t)pFences[i],
+                   "frame %zu fence", i);
     }
     return true;
 }
@@ -357,11 +855,72 @@ bool recordCommandBuffer(VkCommandBuffer commandBuffer,
         fprintf(stderr, "Failed to begin command buffer.\n");
         return false;
     }
-
-    beginRenderpass(pSwapchainFramebuffers[imageIndex],
-                    pCommandBuffers[currentFrame], extent);
-    vkCmdDraw(commandBuffer, 3, 1, 0, 0);
-    vkCmdEndRenderPass(commandBuffer);
+#ifdef GERANIUM_TRACE
+    beginGpuTrace(commandBuffer, currentFrame);
+#endif
+    GERANIUM_GPU_BEGIN(commandBuffer, "frame");
+    swapPipelines();
+    collectLibraries();
+    collectRetired(false);
+    beginLabel(commandBuffer, "texture uploads");
+    recordTextureWork(commandBuffer);
+    endLabel(commandBuffer);
+    GERANIUM_GPU_BEGIN(commandBuffer, "culling");
+    beginLabel(commandBuffer, "culling");
+    recordCulling(commandBuffer, currentFrame);
+    endLabel(commandBuffer);
+    GERANIUM_GPU_END(commandBuffer);
+    bindDescriptors(commandBuffer);
+    GERANIUM_GPU_BEGIN(commandBuffer, "graph");
+    beginLabel(commandBuffer, "graph");
+    recordGraph(commandBuffer);
+    endLabel(commandBuffer);
+    GERANIUM_GPU_END(commandBuffer);
+    GERANIUM_GPU_BEGIN(commandBuffer, "depth pyramid");
+    beginLabel(commandBuffer, "depth pyramid");
+    recordPyramid(commandBuffer, currentFrame);
+    endLabel(commandBuffer);
+    GERANIUM_GPU_END(commandBuffer);
+    // The pyramid pass pushed its own constants over the user's.
+    bindDescriptors(commandBuffer);
+
+    // Everything above runs at full size whatever the scale, so it stays
+    // out of the timing the scale is driven by.
+    if (scalingActive())
+    {
+        VkExtent2D scaled = getScaledExtent(extent);
+
+        beginScaledTiming(commandBuffer, currentFrame);
+        GERANIUM_GPU_BEGIN(commandBuffer, "main pass");
+        beginLabel(commandBuffer, "main pass");
+        beginRenderpass(gOffscreenRenderpass, getScaledFramebuffer(),
+                        commandBuffer, &scaled);
+        vkCmdDraw(commandBuffer, 3, 1, 0, 0);
+        vkCmdEndRenderPass(commandBuffer);
+        endLabel(commandBuffer);
+        GERANIUM_GPU_END(commandBuffer);
+        GERANIUM_GPU_BEGIN(commandBuffer, "upscale");
+        beginLabel(commandBuffer, "upscale");
+        blitScaled(commandBuffer, pImages[imageIndex], &scaled, extent);
+        endLabel(commandBuffer);
+        GERANIUM_GPU_END(commandBuffer);
+        endScaledTiming(commandBuffer, currentFrame);
+    }
+    else
+    {
+        GERANIUM_GPU_BEGIN(commandBuffer, "main pass");
+        beginLabel(commandBuffer, "main pass");
+        beginRenderpass(gRenderpass, pSwapchainFramebuffers[imageIndex],
+                        commandBuffer, extent);
+        vkCmdDraw(commandBuffer, 3, 1, 0, 0);
+        vkCmdEndRenderPass(commandBuffer);
+        endLabel(commandBuffer);
+        GERANIUM_GPU_END(commandBuffer);
+    }
+    beginLabel(commandBuffer, "readback");
+    recordReadback(commandBuffer, pImages[imageIndex], currentFrame);
+    endLabel(commandBuffer);
+    GERANIUM_GPU_END(commandBuffer);
 
     if (vkEndCommandBuffer(commandBuffer) != VK_SUCCESS)
     {
@@ -374,109 +933,165 @@ bool recordCommandBuffer(VkCommandBuffer commandBuffer,
 
 bool createDevice(uint32_t framebufferWidth, uint32_t framebufferHeight)
 {
+    GERANIUM_TRACE_SCOPE(__func__);
+
     uint32_t physicalCount = 0;
     vkEnumeratePhysicalDevices(pInstance, &physicalCount, nullptr);
+    size_t mark = arenaMark();
     VkPhysicalDevice *physicalDevices =
-        malloc(sizeof(VkPhysicalDevice) * physicalCount);
+        arenaAllocate(sizeof(VkPhysicalDevice) * physicalCount);
+    if (physicalDevices == nullptr) return false;
     vkEnumeratePhysicalDevices(pInstance, &physicalCount, physicalDevices);
 
-    const size_t extensionCount = 1;
-    const char *extensions[1] = {"VK_KHR_swapchain"};
-
-    VkPhysicalDevice currentChosen = nullptr;
-    uint32_t bestScore = 0;
-    for (size_t i = 0; i < physicalCount; i++)
+    // A cached choice skips scoring entirely, provided the device is still
+    // there and still fit for it.
+    queue_layout_t layout = {0};
+    uint32_t cached = 0;
+    if (loadDeviceCache(physicalDevices, physicalCount, &cached,
+                        layout.families, &layout.familyCount) &&
+        checkDevice(physicalDevices[cached], &layout))
     {
-        uint32_t score =
-            scoreDevice(physicalDevices[i], extensions, extensionCount);
-        if (score > bestScore)
-        {
-            currentChosen = physicalDevices[i];
-            bestScore = score;
-        }
+        pPhysicalDevice = physicalDevices[cached];
+        primrose_log(VERBOSE_OK, "Using cached device choice.");
     }
-
-    if (currentChosen == nullptr)
+    else
     {
-        fprintf(stderr, "Failed to find suitable Vulkan device.\n");
-        return false;
-    }
-    pPhysicalDevice = currentChosen;
-    free(physicalDevices);
-
-    uint32_t queueFamilyCount = 0;
-    vkGetPhysicalDeviceQueueFamilyProperties(pPhysicalDevice, &queueFamilyCount,
-                                             nullptr);
-
-    VkQueueFamilyProperties *queueFamilies =
-        malloc(sizeof(VkQueueFamilyProperties) * queueFamilyCount);
-    vkGetPhysicalDeviceQueueFamilyProperties(pPhysicalDevice, &queueFamilyCount,
-                                             queueFamilies);
-
-    bool foundGraphicsQueue = false, foundPresentQueue = false;
-    for (size_t i = 0; i < queueFamilyCount; i++)
-    {
-        if (foundGraphicsQueue && foundPresentQueue) break;
-
-        VkQueueFamilyProperties family = queueFamilies[i];
-        if (family.queueFlags & VK_QUEUE_GRAPHICS_BIT)
+        uint32_t bestScore = 0;
+        for (size_t i = 0; i < physicalCount; i++)
         {
-            pGraphicsIndex = i;
-            foundGraphicsQueue = true;
+            queue_layout_t current = {0};
+            uint32_t score = scoreDevice(physicalDevices[i], &current);
+            if (score > bestScore)
+            {
+                pPhysicalDevice = physicalDevices[i];
+                layout = current;
+                bestScore = score;
+            }
         }
 
-        VkBool32 presentSupport = false;
-        vkGetPhysicalDeviceSurfaceSupportKHR(pPhysicalDevice, i, pSurface,
-                                             &presentSupport);
-        if (presentSupport)
+        if (bestScore == 0)
         {
-            pPresentIndex = i;
-            foundPresentQueue = true;
+            arenaRelease(mark);
+            fprintf(stderr, "Failed to find suitable Vulkan device.\n");
+            return false;
         }
+        saveDeviceCache(pPhysicalDevice, layout.families, layout.familyCount);
     }
+    arenaRelease(mark);
+
+    pGraphicsIndex = layout.families[0];
+    pPresentIndex = layout.families[1];
+    pTransferIndex = layout.families[2];
+    pTimestampBits = layout.timestampBits;
 
-    if (!foundGraphicsQueue)
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(pPhysicalDevice, &properties);
+    primrose_log(VERBOSE_OK, "Chose %s.", properties.deviceName);
+
+    if (getSurfaceFormats(pPhysicalDevice) == nullptr ||
+        getSurfaceModes(pPhysicalDevice) == nullptr)
     {
-        fprintf(stderr, "Failed to find graphics queue.\n");
+        fprintf(stderr, "Failed to find surface format/present modes.\n");
         return false;
     }
 
-    if (!foundPresentQueue)
+    // Only the swapchain is required, the rest is enabled where available.
+    size_t extensionCount = 1;
+    const char *extensions[5] = {VK_KHR_SWAPCHAIN_EXTENSION_NAME};
+
+    VkPhysicalDeviceGraphicsPipelineLibraryFeaturesEXT libraryFeatures = {0};
+    libraryFeatures.sType =
+        VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_GRAPHICS_PIPELINE_LIBRARY_FEATURES_EXT;
+    bool libraries = hasDeviceExtension(
+        pPhysicalDevice, VK_EXT_GRAPHICS_PIPELINE_LIBRARY_EXTENSION_NAME);
+    if (libraries)
     {
-        fprintf(stderr, "Failed to find presentation queue.\n");
-        return false;
+        VkPhysicalDeviceFeatures2 features = {0};
+        features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+        features.pNext = &libraryFeatures;
+        vkGetPhysicalDeviceFeatures2(pPhysicalDevice, &features);
+        libraries = libraryFeatures.graphicsPipelineLibrary;
+    }
+    if (libraries)
+    {
+        extensions[extensionCount++] = VK_KHR_PIPELINE_LIBRARY_EXTENSION_NAME;
+        extensions[extensionCount++] =
+            VK_EXT_GRAPHICS_PIPELINE_LIBRARY_EXTENSION_NAME;
     }
+    bool budget = hasDeviceExtension(pPhysicalDevice,
+                                     VK_EXT_MEMORY_BUDGET_EXTENSION_NAME);
+    if (budget)
+        extensions[extensionCount++] = VK_EXT_MEMORY_BUDGET_EXTENSION_NAME;
+
+    // Culled draws are all one indirect count draw.
+    VkPhysicalDeviceVulkan12Features features12 = {0};
+    features12.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES;
+    VkPhysicalDeviceFeatures2 features = {0};
+    features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+    features.pNext = &features12;
+    vkGetPhysicalDeviceFeatures2(pPhysicalDevice, &features);
+    bool culling = cullingRequested() &&
+                   features.features.multiDrawIndirect &&
+                   features12.drawIndirectCount;
+#ifdef GERANIUM_TRACE
+    bool calibrated = hasDeviceExtension(
+        pPhysicalDevice, VK_EXT_CALIBRATED_TIMESTAMPS_EXTENSION_NAME);
+    if (calibrated)
+        extensions[extensionCount++] =
+            VK_EXT_CALIBRATED_TIMESTAMPS_EXTENSION_NAME;
+#endif
 
     float priority = 1.0f;
-    VkDeviceQueueCreateInfo queueCreateInfos[2] = {{0}, {0}};
-    queueCreateInfos[0].sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
-    queueCreateInfos[0].queueFamilyIndex = pGraphicsIndex;
-    queueCreateInfos[0].queueCount = 1;
-    queueCreateInfos[0].pQueuePriorities = &priority;
-
-    queueCreateInfos[1].sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
-    queueCreateInfos[1].queueFamilyIndex = pPresentIndex;
-    queueCreateInfos[1].queueCount = 1;
-    queueCreateInfos[1].pQueuePriorities = &priority;
-
-    // We don't need any features at the moment.
+    uint32_t families[3] = {pGraphicsIndex, pPresentIndex, pTransferIndex};
+    VkDeviceQueueCreateInfo queueCreateInfos[3];
+    uint32_t queueCreateInfoCount = 0;
+    for (size_t i = 0; i < 3; i++)
+    {
+        bool duplicate = false;
+        for (size_t j = 0; j < queueCreateInfoCount; j++)
+            if (queueCreateInfos[j].queueFamilyIndex == families[i])
+                duplicate = true;
+        if (duplicate) continue;
+
+        queueCreateInfos[queueCreateInfoCount] = (VkDeviceQueueCreateInfo){0};
+        queueCreateInfos[queueCreateInfoCount].sType =
+            VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
+        queueCreateInfos[queueCreateInfoCount].queueFamilyIndex = families[i];
+        queueCreateInfos[queueCreateInfoCount].queueCount = 1;
+        queueCreateInfos[queueCreateInfoCount].pQueuePriorities = &priority;
+        queueCreateInfoCount++;
+    }
+
     VkPhysicalDeviceFeatures usedFeatures = {0};
+    VkPhysicalDeviceVulkan12Features usedFeatures12 = {0};
+    usedFeatures12.sType =
+        VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES;
+    usedFeatures12.timelineSemaphore = VK_TRUE;
+    usedFeatures12.runtimeDescriptorArray = VK_TRUE;
+    usedFeatures12.descriptorBindingPartiallyBound = VK_TRUE;
+    usedFeatures12.descriptorBindingUpdateUnusedWhilePending = VK_TRUE;
+    usedFeatures12.descriptorBindingSampledImageUpdateAfterBind = VK_TRUE;
+    usedFeatures12.descriptorBindingStorageBufferUpdateAfterBind = VK_TRUE;
+    usedFeatures12.shaderSampledImageArrayNonUniformIndexing = VK_TRUE;
+    usedFeatures12.shaderStorageBufferArrayNonUniformIndexing = VK_TRUE;
+    usedFeatures.multiDrawIndirect = culling;
+    usedFeatures12.drawIndirectCount = culling;
+    if (libraries) usedFeatures12.pNext = &libraryFeatures;
 
     // Layers for logical devices no longer need to be set in newer
     // implementations.
     VkDeviceCreateInfo logicalDeviceCreateInfo = {0};
     logicalDeviceCreateInfo.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
+    logicalDeviceCreateInfo.pNext = &usedFeatures12;
     logicalDeviceCreateInfo.pQueueCreateInfos = queueCreateInfos;
-    if (pPresentIndex != pGraphicsIndex)
-        logicalDeviceCreateInfo.queueCreateInfoCount = 2;
-    else logicalDeviceCreateInfo.queueCreateInfoCount = 1;
+    logicalDeviceCreateInfo.queueCreateInfoCount = queueCreateInfoCount;
     logicalDeviceCreateInfo.pEnabledFeatures = &usedFeatures;
 
     logicalDeviceCreateInfo.enabledExtensionCount = extensionCount;
     logicalDeviceCreateInfo.ppEnabledExtensionNames = extensions;
 
     VkResult code = vkCreateDevice(pPhysicalDevice, &logicalDeviceCreateInfo,
-                                   nullptr, &pLogicalDevice);
+                                   gAllocator, &pLogicalDevice);
     if (code != VK_SUCCESS)
     {
         fprintf(stderr, "Failed to create logical device. Code: %d.\n", code);
@@ -485,20 +1100,53 @@ bool createDevice(uint32_t framebufferWidth, uint32_t framebufferHeight)
 
     vkGetDeviceQueue(pLogicalDevice, pGraphicsIndex, 0, &pGraphicsQueue);
     vkGetDeviceQueue(pLogicalDevice, pPresentIndex, 0, &pPresentQueue);
+    vkGetDeviceQueue(pLogicalDevice, pTransferIndex, 0, &pTransferQueue);
+    setDebugDevice(pLogicalDevice);
+    nameObject(VK_OBJECT_TYPE_QUEUE, (uint64_t)pGraphicsQueue, "graphics");
+    if (pPresentQueue != pGraphicsQueue)
+        nameObject(VK_OBJECT_TYPE_QUEUE, (uint64_t)pPresentQueue, "present");
+    if (pTransferQueue != pGraphicsQueue)
+        nameObject(VK_OBJECT_TYPE_QUEUE, (uint64_t)pTransferQueue, "transfer");
+#ifdef GERANIUM_TRACE
+    if (!createTrace(pInstance, pPhysicalDevice, pLogicalDevice,
+                     pTimestampBits, calibrated))
+        return false;
+#endif
+    createBudget(pPhysicalDevice, budget);
 
     findSurfaceCapabilities();
     VkExtent2D extent = getSurfaceExtent(framebufferWidth, framebufferHeight);
     if (!createSwapchain(&extent)) return false;
-    if (!createPipeline(&extent, pLogicalDevice, pFormat.format)) return false;
+    if (!createDescriptors(pPhysicalDevice, pLogicalDevice)) return false;
+    if (!createLibraries(libraries)) return false;
+    if (!createAttachments(pPhysicalDevice, pLogicalDevice, &extent,
+                           pFormat.format))
+        return false;
+    if (!createPipeline(pLogicalDevice, pFormat.format)) return false;
     if (!createFramebuffers(&extent)) return false;
+    if (!createScaling(pPhysicalDevice, pLogicalDevice, &extent,
+                       pFormat.format, pTimestampBits))
+        return false;
+    if (!createReadback(pLogicalDevice, &extent, pFormat.format)) return false;
     if (!createCommandBuffers()) return false;
     if (!createSyncObjects()) return false;
+    if (!createTextures(pPhysicalDevice, pLogicalDevice, pTransferQueue,
+                        pTransferIndex, pGraphicsIndex))
+        return false;
+    createBuffers(pLogicalDevice);
+    createGraph(pLogicalDevice, &extent);
+    if (!createCulling(pLogicalDevice, culling)) return false;
 
     return true;
 }
 
 bool geranium_create(const char *name, uint32_t version)
 {
+    GERANIUM_TRACE_SCOPE(__func__);
+
+    if (!createArena(GERANIUM_ARENA_SIZE)) return false;
+    setPhase(GERANIUM_PHASE_CREATE);
+
     VkApplicationInfo applicationInfo = {0};
     applicationInfo.sType = VK_STRUCTURE_TYPE_APPLICATION_INFO;
     applicationInfo.pApplicationName = name;
@@ -511,22 +1159,23 @@ bool geranium_create(const char *name, uint32_t version)
     instanceInfo.sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO;
     instanceInfo.pApplicationInfo = &applicationInfo;
 
-    char *extensions[2];
+    // Room for debug utils, should it be asked for.
+    char *extensions[3];
     geranium_getExtensions(extensions);
     instanceInfo.enabledExtensionCount = 2;
     instanceInfo.ppEnabledExtensionNames = (const char **)extensions;
 
-    const char *layers[1] = {"VK_LAYER_KHRONOS_validation"};
-    instanceInfo.enabledLayerCount = 1;
-    instanceInfo.ppEnabledLayerNames = layers;
+    const char *layers[1];
+    prepareDebugging(&instanceInfo, (const char **)extensions, layers);
 
-    VkResult result = vkCreateInstance(&instanceInfo, nullptr, &pInstance);
+    VkResult result = vkCreateInstance(&instanceInfo, gAllocator, &pInstance);
     if (result != VK_SUCCESS)
     {
         fprintf(stderr, "Failed to create Vulkan instance. Code: %d.\n",
                 result);
         return false;
     }
+    if (!createDebugging(pInstance)) return false;
 
     // This is provided by the current target file.
     extern VkSurfaceKHR createSurface(VkInstance instance, void **data);
@@ -539,47 +1188,119 @@ bool geranium_create(const char *name, uint32_t version)
     hyacinth_getSize(&width, &height);
     if (!createDevice(width, height)) return false;
 
+    setPhase(GERANIUM_PHASE_FRAME);
+
     return true;
 }
 
-void geranium_destroy(void) { vkDeviceWaitIdle(pLogicalDevice); }
+void geranium_destroy(void)
+{
+    setPhase(GERANIUM_PHASE_DESTROY);
+    geranium_unwatchShaders();
+    vkDeviceWaitIdle(pLogicalDevice);
+    destroyScaling(pLogicalDevice);
+    destroyReadback(pLogicalDevice);
+    collectRetired(true);
+    destroyCulling();
+    destroyGraph();
+    destroyLibraries();
+    destroyPipelines();
+    destroyBuffers();
+    destroyTextures();
+    destroyDescriptors();
+    destroyPipeline();
+    destroyBudget();
+#ifdef GERANIUM_TRACE
+    destroyTrace();
+#endif
+
+    cleanupSwapchain();
+    destroyAttachments();
+    for (size_t i = 0; i < GERANIUM_CONCURRENT_FRAMES; i++)
+    {
+        vkDestroySemaphore(pLogicalDevice, pImageAvailableSemaphores[i],
+                           gAllocator);
+        vkDestroySemaphore(pLogicalDevice, pRenderFinishedSemaphores[i],
+                           gAllocator);
+        vkDestroyFence(pLogicalDevice, pFences[i], gAllocator);
+    }
+    vkDestroyCommandPool(pLogicalDevice, pCommandPool, gAllocator);
+    vkDestroyDevice(pLogicalDevice, gAllocator);
+    vkDestroySurfaceKHR(pInstance, pSurface, gAllocator);
+    destroyDebugging();
+    vkDestroyInstance(pInstance, gAllocator);
+
+    // The arena takes these with it.
+    pFormats = nullptr;
+    pModes = nullptr;
+    pImageCapacity = 0;
+    destroyArena();
+}
 
 void cleanupSwapchain(void)
 {
     for (size_t i = 0; i < pImageCount; i++)
     {
         vkDestroyFramebuffer(pLogicalDevice, pSwapchainFramebuffers[i],
-                             nullptr);
-        vkDestroyImageView(pLogicalDevice, pSwapchainImages[i], nullptr);
+                             gAllocator);
+        vkDestroyImageView(pLogicalDevice, pSwapchainImages[i], gAllocator);
     }
-    vkDestroySwapchainKHR(pLogicalDevice, pSwapchain, nullptr);
+    vkDestroySwapchainKHR(pLogicalDevice, pSwapchain, gAllocator);
 }
 
 bool recreateSwapchain(const VkExtent2D *const extent)
 {
+    GERANIUM_TRACE_SCOPE(__func__);
+
+    setPhase(GERANIUM_PHASE_RESIZE);
     vkDeviceWaitIdle(pLogicalDevice);
 
     cleanupSwapchain();
-    if (!createSwapchain(extent)) return false;
-    if (!createFramebuffers(extent)) return false;
-
-    return true;
+    bool recreated = createSwapchain(extent) && resizeAttachments(extent) &&
+                     createFramebuffers(extent) &&
+                     resizeScaling(pLogicalDevice, extent) &&
+                     resizeReadback(pLogicalDevice, extent);
+    resizeGraph(extent);
+
+    setPhase(GERANIUM_PHASE_FRAME);
+    return recreated;
 }
 
 bool geranium_render(uint32_t framebufferWidth,
                                  uint32_t framebufferHeight)
 {
-    vkWaitForFences(pLogicalDevice, 1, &pFences[currentFrame], VK_TRUE,
-                    UINT64_MAX);
+    GERANIUM_TRACE_SCOPE("render");
+
+    // Uploads keep moving even while frames are being skipped.
+    if (!pumpTextures()) return false;
+    updateBudget();
+    if (!claimFrame()) return true;
+
+    {
+        GERANIUM_TRACE_SCOPE("wait");
+        vkWaitForFences(pLogicalDevice, 1, &pFences[currentFrame], VK_TRUE,
+                        UINT64_MAX);
+    }
+#ifdef GERANIUM_TRACE
+    collectGpuTrace(currentFrame);
+#endif
+    updateScaling(pLogicalDevice, currentFrame);
+    completeReadbacks(pLogicalDevice, currentFrame);
 
     VkExtent2D extent = getSurfaceExtent(framebufferWidth, framebufferHeight);
 
     uint32_t imageIndex;
-    VkResult result = vkAcquireNextImageKHR(
-        pLogicalDevice, pSwapchain, UINT64_MAX,
-        pImageAvailableSemaphores[currentFrame], VK_NULL_HANDLE, &imageIndex);
+    VkResult result;
+    {
+        GERANIUM_TRACE_SCOPE("acquire");
+        result = vkAcquireNextImageKHR(pLogicalDevice, pSwapchain, UINT64_MAX,
+                                       pImageAvailableSemaphores[currentFrame],
+                                       VK_NULL_HANDLE, &imageIndex);
+    }
     if (result == VK_ERROR_OUT_OF_DATE_KHR)
     {
+        // Nothing was drawn, so make sure the next frame isn't skipped.
+        geranium_markDirty();
         if (!recreateSwapchain(&extent)) return false;
         return true;
     }
@@ -591,17 +1312,32 @@ bool geranium_render(uint32_t framebufferWidth,
 
     vkResetFences(pLogicalDevice, 1, &pFences[currentFrame]);
 
-    vkResetCommandBuffer(pCommandBuffers[currentFrame], 0);
-    if (!recordCommandBuffer(pCommandBuffers[currentFrame], &extent, imageIndex))
-        return false;
+    {
+        GERANIUM_TRACE_SCOPE("record");
+        vkResetCommandBuffer(pCommandBuffers[currentFrame], 0);
+        if (!recordCommandBuffer(pCommandBuffers[currentFrame], &extent,
+                                 imageIndex))
+            return false;
+    }
 
     VkSubmitInfo submitInfo = {0};
     submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
 
-    VkSemaphore waitSemaphores[] = {pImageAvailableSemaphores[currentFrame]};
+    // The transfer timeline value waited on has already been reached, this
+    // just makes the uploads visible to the frame.
+    VkSemaphore waitSemaphores[] = {pImageAvailableSemaphores[currentFrame],
+                                    getTransferSemaphore()};
     VkPipelineStageFlags waitStages[] = {
-        VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT};
-    submitInfo.waitSemaphoreCount = 1;
+        VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+        VK_PIPELINE_STAGE_ALL_COMMANDS_BIT};
+    uint64_t waitValues[] = {0, getTransferValue()};
+
+    VkTimelineSemaphoreSubmitInfo timelineInfo = {0};
+    timelineInfo.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
+    timelineInfo.waitSemaphoreValueCount = 2;
+    timelineInfo.pWaitSemaphoreValues = waitValues;
+    submitInfo.pNext = &timelineInfo;
+    submitInfo.waitSemaphoreCount = 2;
     submitInfo.pWaitSemaphores = waitSemaphores;
     submitInfo.pWaitDstStageMask = waitStages;
     submitInfo.commandBufferCount = 1;
@@ -610,11 +1346,14 @@ bool geranium_render(uint32_t framebufferWidth,
     VkSemaphore signalSemaphores[] = {pRenderFinishedSemaphores[currentFrame]};
     submitInfo.signalSemaphoreCount = 1;
     submitInfo.pSignalSemaphores = signalSemaphores;
-    if (vkQueueSubmit(pGraphicsQueue, 1, &submitInfo, pFences[currentFrame]) !=
-        VK_SUCCESS)
     {
-        fprintf(stderr, "Failed to submit to the queue.\n");
-        return false;
+        GERANIUM_TRACE_SCOPE("submit");
+        if (vkQueueSubmit(pGraphicsQueue, 1, &submitInfo,
+                          pFences[currentFrame]) != VK_SUCCESS)
+        {
+            fprintf(stderr, "Failed to submit to the queue.\n");
+            return false;
+        }
     }
 
     VkPresentInfoKHR presentInfo = {0};
@@ -627,9 +1366,13 @@ bool geranium_render(uint32_t framebufferWidth,
     presentInfo.pSwapchains = swapChains;
     presentInfo.pImageIndices = &imageIndex;
 
-    result = vkQueuePresentKHR(pPresentQueue, &presentInfo);
+    {
+        GERANIUM_TRACE_SCOPE("present");
+        result = vkQueuePresentKHR(pPresentQueue, &presentInfo);
+    }
     if (result == VK_ERROR_OUT_OF_DATE_KHR || result == VK_SUBOPTIMAL_KHR)
     {
+        geranium_markDirty();
         if (!recreateSwapchain(&extent)) return false;
     }
     else if (result != VK_SUCCESS)
@@ -644,5 +1387,7 @@ bool geranium_render(uint32_t framebufferWidth,
 
 bool geranium_sync(void)
 {
-    return vkDeviceWaitIdle(pLogicalDevice) == VK_SUCCESS;
+    if (vkDeviceWaitIdle(pLogicalDevice) != VK_SUCCESS) return false;
+    completeReadbacks(pLogicalDevice, UINT32_MAX);
+    return true;
 }
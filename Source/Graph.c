@@ -0,0 +1,961 @@
+#include <Geranium.h>
+#include <Primrose.h>
+#include <vulkan/vulkan.h>
+
+// Contained in Memory.c.
+extern const VkAllocationCallbacks *gAllocator;
+extern void setPhase(geranium_phase_t phase);
+
+// Contained in Geranium.c.
+extern bool allocateMemory(const VkMemoryRequirements *const requirements,
+                           VkMemoryPropertyFlags required,
+                           VkMemoryPropertyFlags preferred,
+                           VkDeviceMemory *memory);
+
+// Contained in Pipeline.c.
+extern VkRenderPass gRenderpass;
+extern void setViewport(VkCommandBuffer buffer, const VkExtent2D *const extent);
+
+// Contained in Descriptors.c.
+extern uint32_t acquireSlot(uint32_t binding);
+extern void releaseSlot(uint32_t binding, uint32_t slot);
+extern void writeTextureSlot(uint32_t slot, VkImageView view,
+                             VkSampler sampler);
+
+// Contained in Textures.c.
+extern VkSampler getTextureSampler(void);
+
+// Contained in Buffers.c.
+extern VkBuffer getBuffer(uint32_t buffer);
+
+// Contained in Debug.c.
+extern void nameObject(VkObjectType type, uint64_t handle, const char *format,
+                       ...);
+extern void beginLabel(VkCommandBuffer buffer, const char *name);
+extern void endLabel(VkCommandBuffer buffer);
+
+typedef struct access_info
+{
+    VkImageLayout layout;
+    VkPipelineStageFlags stages;
+    VkAccessFlags access;
+    bool write;
+} access_info_t;
+
+static const access_info_t pAccessInfo[GERANIUM_ACCESS_COUNT] = {
+    [GERANIUM_ACCESS_COLOR_WRITE] =
+        {VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
+         VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+         VK_ACCESS_COLOR_ATTACHMENT_READ_BIT |
+             VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT,
+         true},
+    [GERANIUM_ACCESS_DEPTH_WRITE] =
+        {VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL,
+         VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT |
+             VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT,
+         VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT |
+             VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT,
+         true},
+    [GERANIUM_ACCESS_DEPTH_READ] =
+        {VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL,
+         VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT |
+             VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT,
+         VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT, false},
+    [GERANIUM_ACCESS_SAMPLED] = {VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+                                 VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT |
+                                     VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                                 VK_ACCESS_SHADER_READ_BIT, false},
+    [GERANIUM_ACCESS_STORAGE_READ] =
+        {VK_IMAGE_LAYOUT_UNDEFINED,
+         VK_PIPELINE_STAGE_VERTEX_SHADER_BIT |
+             VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT |
+             VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+         VK_ACCESS_SHADER_READ_BIT, false},
+    [GERANIUM_ACCESS_STORAGE_WRITE] =
+        {VK_IMAGE_LAYOUT_UNDEFINED,
+         VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT |
+             VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+         VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT, true},
+    [GERANIUM_ACCESS_INDIRECT_READ] = {VK_IMAGE_LAYOUT_UNDEFINED,
+                                       VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT,
+                                       VK_ACCESS_INDIRECT_COMMAND_READ_BIT,
+                                       false},
+};
+
+typedef struct resource
+{
+    bool image;
+    // Images only.
+    VkFormat format;
+    float scale;
+    uint32_t texture;
+    VkImage handle;
+    VkImageView view;
+    VkExtent2D extent;
+    VkImageUsageFlags usage;
+    VkMemoryRequirements requirements;
+    uint32_t memory;
+    // Buffers only.
+    uint32_t buffer;
+    VkBuffer bufferHandle;
+    // The positions of the first and last passes touching the resource,
+    // UINT32_MAX if none do.
+    uint32_t first;
+    uint32_t last;
+} resource_t;
+
+// Images whose lifetimes don't overlap share one of these.
+typedef struct memory_slot
+{
+    VkDeviceMemory memory;
+    VkMemoryRequirements requirements;
+    bool lazy;
+    uint32_t last;
+    // Everything any of its images is used for, which the first use of
+    // each has to wait on, and the writes among it to make available.
+    VkPipelineStageFlags stages;
+    VkAccessFlags writeAccess;
+} memory_slot_t;
+
+typedef struct pass
+{
+    const char *name;
+    geranium_record_t record;
+    void *data;
+    geranium_resource_access_t accesses[GERANIUM_MAX_PASS_ACCESSES];
+    uint32_t accessCount;
+
+    // Pipelines are built against the first, which never changes. The
+    // second has the real load and store operations and is what's begun.
+    VkRenderPass compatible;
+    VkRenderPass renderpass;
+    VkFramebuffer framebuffer;
+    VkExtent2D extent;
+    uint32_t attachments[GERANIUM_MAX_PASS_ACCESSES];
+    VkClearValue clears[GERANIUM_MAX_PASS_ACCESSES];
+    uint32_t attachmentCount;
+
+    VkImageMemoryBarrier imageBarriers[GERANIUM_MAX_PASS_ACCESSES];
+    uint32_t imageBarrierCount;
+    VkBufferMemoryBarrier bufferBarriers[GERANIUM_MAX_PASS_ACCESSES];
+    uint32_t bufferBarrierCount;
+    VkPipelineStageFlags srcStages;
+    VkPipelineStageFlags dstStages;
+} pass_t;
+
+// What the simulation knows about a resource at some point in the frame.
+typedef struct resource_state
+{
+    VkImageLayout layout;
+    VkPipelineStageFlags writeStages;
+    VkAccessFlags writeAccess;
+    VkPipelineStageFlags readStages;
+    // The stages the last write has been made visible to.
+    VkPipelineStageFlags visibleStages;
+} resource_state_t;
+
+static VkDevice pDevice = nullptr;
+static VkExtent2D pExtent;
+static bool pDirty = false;
+static bool pValid = false;
+
+static resource_t pResources[GERANIUM_MAX_RESOURCES];
+static uint32_t pResourceCount = 0;
+static memory_slot_t pMemory[GERANIUM_MAX_RESOURCES];
+static uint32_t pMemoryCount = 0;
+// The main pass sits at index zero but runs last, at position pPassCount.
+static pass_t pPasses[GERANIUM_MAX_PASSES] = {{0}};
+static uint32_t pPassCount = 1;
+
+static bool isDepthFormat(VkFormat format)
+{
+    switch (format)
+    {
+        case VK_FORMAT_D16_UNORM:
+        case VK_FORMAT_X8_D24_UNORM_PACK32:
+        case VK_FORMAT_D32_SFLOAT:
+        case VK_FORMAT_D16_UNORM_S8_UINT:
+        case VK_FORMAT_D24_UNORM_S8_UINT:
+        case VK_FORMAT_D32_SFLOAT_S8_UINT: return true;
+        default:                           return false;
+    }
+}
+
+static bool hasStencil(VkFormat format)
+{
+    return format == VK_FORMAT_D16_UNORM_S8_UINT ||
+           format == VK_FORMAT_D24_UNORM_S8_UINT ||
+           format == VK_FORMAT_D32_SFLOAT_S8_UINT;
+}
+
+static VkImageAspectFlags getAspect(VkFormat format)
+{
+    if (!isDepthFormat(format)) return VK_IMAGE_ASPECT_COLOR_BIT;
+    if (hasStencil(format))
+        return VK_IMAGE_ASPECT_DEPTH_BIT | VK_IMAGE_ASPECT_STENCIL_BIT;
+    return VK_IMAGE_ASPECT_DEPTH_BIT;
+}
+
+static bool isAttachment(geranium_access_t access)
+{
+    return access == GERANIUM_ACCESS_COLOR_WRITE ||
+           access == GERANIUM_ACCESS_DEPTH_WRITE ||
+           access == GERANIUM_ACCESS_DEPTH_READ;
+}
+
+static uint32_t getPosition(uint32_t pass)
+{
+    return pass == GERANIUM_MAIN_PASS ? pPassCount : pass;
+}
+
+// With exact set, attachments are only cleared where nothing earlier in the
+// frame wrote them and only stored where something later reads them.
+static bool createPassRenderpass(pass_t *pass, uint32_t position, bool exact,
+                                 VkRenderPass *renderpass)
+{
+    VkAttachmentDescription attachments[GERANIUM_MAX_PASS_ACCESSES];
+    VkAttachmentReference colors[GERANIUM_MAX_PASS_ACCESSES];
+    VkAttachmentReference depth = {0};
+    uint32_t colorCount = 0;
+    bool hasDepth = false;
+
+    pass->attachmentCount = 0;
+    for (uint32_t i = 0; i < pass->accessCount; i++)
+    {
+        geranium_access_t access = pass->accesses[i].access;
+        if (!isAttachment(access)) continue;
+
+        const resource_t *resource = &pResources[pass->accesses[i].resource];
+        bool load = exact && (resource->first != position ||
+                              access == GERANIUM_ACCESS_DEPTH_READ);
+        bool store = !exact || resource->last != position;
+
+        uint32_t index = pass->attachmentCount++;
+        VkAttachmentDescription *description = &attachments[index];
+        *description = (VkAttachmentDescription){0};
+        description->format = resource->format;
+        description->samples = VK_SAMPLE_COUNT_1_BIT;
+        description->loadOp =
+            load ? VK_ATTACHMENT_LOAD_OP_LOAD : VK_ATTACHMENT_LOAD_OP_CLEAR;
+        description->storeOp = store ? VK_ATTACHMENT_STORE_OP_STORE
+                                     : VK_ATTACHMENT_STORE_OP_DONT_CARE;
+        description->stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+        description->stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+        if (hasStencil(resource->format))
+        {
+            description->stencilLoadOp = description->loadOp;
+            description->stencilStoreOp = description->storeOp;
+        }
+        // Transitions all happen in the barriers before the pass.
+        description->initialLayout = pAccessInfo[access].layout;
+        description->finalLayout = pAccessInfo[access].layout;
+
+        VkAttachmentReference reference = {index, pAccessInfo[access].layout};
+        if (access == GERANIUM_ACCESS_COLOR_WRITE)
+        {
+            colors[colorCount++] = reference;
+            pass->clears[index] = (VkClearValue){{{0.0f, 0.0f, 0.0f, 0.0f}}};
+        }
+        else
+        {
+            depth = reference;
+            hasDepth = true;
+            pass->clears[index].depthStencil = (VkClearDepthStencilValue){1.0f,
+                                                                          0};
+        }
+        pass->attachments[index] = pass->accesses[i].resource;
+    }
+
+    VkSubpassDescription description = {0};
+    description.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
+    description.colorAttachmentCount = colorCount;
+    description.pColorAttachments = colors;
+    if (hasDepth) description.pDepthStencilAttachment = &depth;
+
+    VkRenderPassCreateInfo renderPassInfo = {0};
+    renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
+    renderPassInfo.attachmentCount = pass->attachmentCount;
+    renderPassInfo.pAttachments = attachments;
+    renderPassInfo.subpassCount = 1;
+    renderPassInfo.pSubpasses = &description;
+
+    VkResult result =
+        vkCreateRenderPass(pDevice, &renderPassInfo, gAllocator, renderpass);
+    if (result != VK_SUCCESS)
+    {
+        primrose_log(ERROR, "Failed to create graph renderpass. Code: %d.",
+                     result);
+        return false;
+    }
+    nameObject(VK_OBJECT_TYPE_RENDER_PASS, (uint64_t)*renderpass, "%s pass",
+               pass->name);
+    return true;
+}
+
+static void computeLifetimes(void)
+{
+    for (uint32_t i = 0; i < pResourceCount; i++)
+    {
+        pResources[i].first = UINT32_MAX;
+        pResources[i].last = UINT32_MAX;
+        pResources[i].usage = 0;
+    }
+
+    for (uint32_t i = 0; i < pPassCount; i++)
+        for (uint32_t j = 0; j < pPasses[i].accessCount; j++)
+        {
+            resource_t *resource = &pResources[pPasses[i].accesses[j].resource];
+            uint32_t position = getPosition(i);
+            if (resource->first == UINT32_MAX || position < resource->first)
+                resource->first = position;
+            if (resource->last == UINT32_MAX || position > resource->last)
+                resource->last = position;
+
+            switch (pPasses[i].accesses[j].access)
+            {
+                case GERANIUM_ACCESS_COLOR_WRITE:
+                    resource->usage |= VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT;
+                    break;
+                case GERANIUM_ACCESS_DEPTH_WRITE:
+                case GERANIUM_ACCESS_DEPTH_READ:
+                    resource->usage |=
+                        VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT;
+                    break;
+                case GERANIUM_ACCESS_SAMPLED:
+                    resource->usage |= VK_IMAGE_USAGE_SAMPLED_BIT;
+                    break;
+                default: break;
+            }
+        }
+}
+
+// Attachments only one pass ever touches never have to leave tile memory,
+// so they're made transient and given lazily allocated memory if there's any.
+static bool isLazy(const resource_t *resource)
+{
+    return resource->first == resource->last &&
+           !(resource->usage & VK_IMAGE_USAGE_SAMPLED_BIT);
+}
+
+static bool createImage(resource_t *resource)
+{
+    resource->extent = pExtent;
+    if (resource->scale > 0.0f)
+    {
+        resource->extent.width = (uint32_t)(pExtent.width * resource->scale);
+        resource->extent.height =
+            (uint32_t)(pExtent.height * resource->scale);
+        if (resource->extent.width == 0) resource->extent.width = 1;
+        if (resource->extent.height == 0) resource->extent.height = 1;
+    }
+
+    VkImageCreateInfo imageInfo = {0};
+    imageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+    imageInfo.imageType = VK_IMAGE_TYPE_2D;
+    imageInfo.format = resource->format;
+    imageInfo.extent = (VkExtent3D){resource->extent.width,
+                                    resource->extent.height, 1};
+    imageInfo.mipLevels = 1;
+    imageInfo.arrayLayers = 1;
+    imageInfo.samples = VK_SAMPLE_COUNT_1_BIT;
+    imageInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
+    imageInfo.usage = resource->usage;
+    if (isLazy(resource))
+        imageInfo.usage |= VK_IMAGE_USAGE_TRANSIENT_ATTACHMENT_BIT;
+    imageInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    imageInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+
+    VkResult result =
+        vkCreateImage(pDevice, &imageInfo, gAllocator, &resource->handle);
+    if (result != VK_SUCCESS)
+    {
+        primrose_log(ERROR, "Failed to create graph image. Code: %d.", result);
+        return false;
+    }
+    nameObject(VK_OBJECT_TYPE_IMAGE, (uint64_t)resource->handle,
+               "graph image %u", (uint32_t)(resource - pResources));
+    vkGetImageMemoryRequirements(pDevice, resource->handle,
+                                 &resource->requirements);
+    return true;
+}
+
+// Greedy, in order of first use: each image goes into the first slot whose
+// images are all done with before it starts.
+static void assignMemory(void)
+{
+    pMemoryCount = 0;
+    for (uint32_t position = 1; position <= pPassCount; position++)
+        for (uint32_t i = 0; i < pResourceCount; i++)
+        {
+            resource_t *resource = &pResources[i];
+            if (!resource->image || resource->first != position) continue;
+
+            const VkMemoryRequirements *requirements = &resource->requirements;
+            bool lazy = isLazy(resource);
+            uint32_t slot = 0;
+            for (; slot < pMemoryCount; slot++)
+            {
+                const memory_slot_t *memory = &pMemory[slot];
+                if (memory->last < position && memory->lazy == lazy &&
+                    (memory->requirements.memoryTypeBits &
+                     requirements->memoryTypeBits))
+                    break;
+            }
+
+            memory_slot_t *memory = &pMemory[slot];
+            if (slot == pMemoryCount)
+            {
+                *memory = (memory_slot_t){.requirements = *requirements,
+                                          .lazy = lazy};
+                pMemoryCount++;
+            }
+            else
+            {
+                if (requirements->size > memory->requirements.size)
+                    memory->requirements.size = requirements->size;
+                if (requirements->alignment > memory->requirements.alignment)
+                    memory->requirements.alignment = requirements->alignment;
+                memory->requirements.memoryTypeBits &=
+                    requirements->memoryTypeBits;
+            }
+            memory->last = resource->last;
+            resource->memory = slot;
+        }
+
+    for (uint32_t i = 0; i < pPassCount; i++)
+        for (uint32_t j = 0; j < pPasses[i].accessCount; j++)
+        {
+            const geranium_resource_access_t *access = &pPasses[i].accesses[j];
+            const resource_t *resource = &pResources[access->resource];
+            if (!resource->image) continue;
+
+            const access_info_t *info = &pAccessInfo[access->access];
+            memory_slot_t *memory = &pMemory[resource->memory];
+            memory->stages |= info->stages;
+            if (info->write) memory->writeAccess |= info->access;
+        }
+}
+
+static bool bindImages(void)
+{
+    for (uint32_t i = 0; i < pMemoryCount; i++)
+    {
+        VkMemoryPropertyFlags preferred =
+            pMemory[i].lazy ? VK_MEMORY_PROPERTY_LAZILY_ALLOCATED_BIT : 0;
+        if (!allocateMemory(&pMemory[i].requirements,
+                            VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, preferred,
+                            &pMemory[i].memory))
+            return false;
+        nameObject(VK_OBJECT_TYPE_DEVICE_MEMORY, (uint64_t)pMemory[i].memory,
+                   "graph memory %u", i);
+    }
+
+    for (uint32_t i = 0; i < pResourceCount; i++)
+    {
+        resource_t *resource = &pResources[i];
+        if (!resource->image || resource->first == UINT32_MAX) continue;
+
+        vkBindImageMemory(pDevice, resource->handle,
+                          pMemory[resource->memory].memory, 0);
+
+        VkImageViewCreateInfo viewInfo = {0};
+        viewInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+        viewInfo.image = resource->handle;
+        viewInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
+        viewInfo.format = resource->format;
+        // Sampling a depth image only ever reads depth.
+        viewInfo.subresourceRange.aspectMask =
+            getAspect(resource->format) & ~VK_IMAGE_ASPECT_STENCIL_BIT;
+        viewInfo.subresourceRange.levelCount = 1;
+        viewInfo.subresourceRange.layerCount = 1;
+
+        VkResult result =
+            vkCreateImageView(pDevice, &viewInfo, gAllocator, &resource->view);
+        if (result != VK_SUCCESS)
+        {
+            primrose_log(ERROR, "Failed to create graph image view. Code: %d.",
+                         result);
+            return false;
+        }
+        nameObject(VK_OBJECT_TYPE_IMAGE_VIEW, (uint64_t)resource->view,
+                   "graph image %u view", i);
+
+        if (resource->usage & VK_IMAGE_USAGE_SAMPLED_BIT)
+            writeTextureSlot(resource->texture, resource->view,
+                             getTextureSampler());
+    }
+    return true;
+}
+
+static void addBarrier(pass_t *pass, const resource_t *resource,
+                       VkImageLayout oldLayout, const access_info_t *info,
+                       VkPipelineStageFlags srcStages, VkAccessFlags srcAccess)
+{
+    pass->srcStages |= srcStages ? srcStages
+                                 : VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT;
+    pass->dstStages |= info->stages;
+
+    if (!resource->image)
+    {
+        VkBufferMemoryBarrier *barrier =
+            &pass->bufferBarriers[pass->bufferBarrierCount++];
+        *barrier = (VkBufferMemoryBarrier){0};
+        barrier->sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+        barrier->srcAccessMask = srcAccess;
+        barrier->dstAccessMask = info->access;
+        barrier->srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        barrier->dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        barrier->buffer = resource->bufferHandle;
+        barrier->size = VK_WHOLE_SIZE;
+        return;
+    }
+
+    VkImageMemoryBarrier *barrier =
+        &pass->imageBarriers[pass->imageBarrierCount++];
+    *barrier = (VkImageMemoryBarrier){0};
+    barrier->sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+    barrier->srcAccessMask = srcAccess;
+    barrier->dstAccessMask = info->access;
+    barrier->oldLayout = oldLayout;
+    barrier->newLayout = info->layout;
+    barrier->srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier->dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier->image = resource->handle;
+    barrier->subresourceRange.aspectMask = getAspect(resource->format);
+    barrier->subresourceRange.levelCount = 1;
+    barrier->subresourceRange.layerCount = 1;
+}
+
+// Walks the frame once, only recording barriers when emit is set. Reads
+// after reads in the same layout need none; everything else waits on just
+// the stages that touched the resource since its last write.
+static void simulate(resource_state_t *states, bool emit)
+{
+    for (uint32_t position = 1; position <= pPassCount; position++)
+    {
+        pass_t *pass =
+            &pPasses[position == pPassCount ? GERANIUM_MAIN_PASS : position];
+        if (emit)
+        {
+            pass->imageBarrierCount = 0;
+            pass->bufferBarrierCount = 0;
+            pass->srcStages = 0;
+            pass->dstStages = 0;
+        }
+
+        for (uint32_t i = 0; i < pass->accessCount; i++)
+        {
+            const resource_t *resource =
+                &pResources[pass->accesses[i].resource];
+            const access_info_t *info = &pAccessInfo[pass->accesses[i].access];
+            resource_state_t *state = &states[pass->accesses[i].resource];
+
+            // An image's contents don't survive the frame, so its first
+            // use discards them, but still has to wait out the previous
+            // frame and whatever else shares its memory.
+            bool first = resource->image && resource->first == position;
+            bool transition =
+                resource->image && (first || state->layout != info->layout);
+
+            bool barrier = false;
+            VkPipelineStageFlags srcStages = 0;
+            VkAccessFlags srcAccess = state->writeAccess;
+            if (transition || info->write)
+            {
+                srcStages = state->writeStages | state->readStages;
+                if (first)
+                {
+                    srcStages |= pMemory[resource->memory].stages;
+                    srcAccess |= pMemory[resource->memory].writeAccess;
+                }
+                barrier = transition || srcStages != 0;
+            }
+            else if (state->writeStages &&
+                     (info->stages & ~state->visibleStages))
+            {
+                srcStages = state->writeStages;
+                barrier = true;
+            }
+
+            if (barrier && emit)
+                addBarrier(pass, resource,
+                           first ? VK_IMAGE_LAYOUT_UNDEFINED : state->layout,
+                           info, srcStages, srcAccess);
+
+            if (resource->image) state->layout = info->layout;
+            if (info->write)
+            {
+                state->writeStages = info->stages;
+                state->writeAccess = info->access;
+                state->readStages = 0;
+                state->visibleStages = 0;
+            }
+            else if (transition)
+            {
+                // The transition is itself a write, finished by the time
+                // these stages run.
+                state->writeStages = info->stages;
+                state->writeAccess = 0;
+                state->readStages = info->stages;
+                state->visibleStages = info->stages;
+            }
+            else
+            {
+                state->readStages |= info->stages;
+                if (barrier) state->visibleStages |= info->stages;
+            }
+        }
+    }
+}
+
+static void releaseResources(void)
+{
+    for (uint32_t i = 1; i < pPassCount; i++)
+    {
+        vkDestroyFramebuffer(pDevice, pPasses[i].framebuffer, gAllocator);
+        vkDestroyRenderPass(pDevice, pPasses[i].renderpass, gAllocator);
+        pPasses[i].framebuffer = nullptr;
+        pPasses[i].renderpass = nullptr;
+    }
+
+    for (uint32_t i = 0; i < pResourceCount; i++)
+    {
+        resource_t *resource = &pResources[i];
+        if (!resource->image) continue;
+        vkDestroyImageView(pDevice, resource->view, gAllocator);
+        vkDestroyImage(pDevice, resource->handle, gAllocator);
+        resource->view = nullptr;
+        resource->handle = nullptr;
+    }
+
+    for (uint32_t i = 0; i < pMemoryCount; i++)
+        vkFreeMemory(pDevice, pMemory[i].memory, gAllocator);
+    pMemoryCount = 0;
+}
+
+static bool createFramebuffer(pass_t *pass)
+{
+    VkImageView views[GERANIUM_MAX_PASS_ACCESSES];
+    for (uint32_t i = 0; i < pass->attachmentCount; i++)
+        views[i] = pResources[pass->attachments[i]].view;
+    pass->extent = pResources[pass->attachments[0]].extent;
+
+    VkFramebufferCreateInfo framebufferInfo = {0};
+    framebufferInfo.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
+    framebufferInfo.renderPass = pass->renderpass;
+    framebufferInfo.attachmentCount = pass->attachmentCount;
+    framebufferInfo.pAttachments = views;
+    framebufferInfo.width = pass->extent.width;
+    framebufferInfo.height = pass->extent.height;
+    framebufferInfo.layers = 1;
+
+    VkResult result = vkCreateFramebuffer(pDevice, &framebufferInfo,
+                                          gAllocator, &pass->framebuffer);
+    if (result != VK_SUCCESS)
+    {
+        primrose_log(ERROR, "Failed to create graph framebuffer. Code: %d.",
+                     result);
+        return false;
+    }
+    nameObject(VK_OBJECT_TYPE_FRAMEBUFFER, (uint64_t)pass->framebuffer,
+               "%s framebuffer", pass->name);
+    return true;
+}
+
+static bool compileGraph(void)
+{
+    vkDeviceWaitIdle(pDevice);
+    releaseResources();
+    computeLifetimes();
+
+    for (uint32_t i = 0; i < pResourceCount; i++)
+    {
+        resource_t *resource = &pResources[i];
+        if (!resource->image)
+        {
+            resource->bufferHandle = getBuffer(resource->buffer);
+            continue;
+        }
+        if (resource->first == UINT32_MAX) continue;
+        if (!createImage(resource)) return false;
+    }
+    assignMemory();
+    if (!bindImages()) return false;
+
+    for (uint32_t i = 1; i < pPassCount; i++)
+    {
+        pass_t *pass = &pPasses[i];
+        if (pass->attachmentCount == 0) continue;
+        if (!createPassRenderpass(pass, i, true, &pass->renderpass) ||
+            !createFramebuffer(pass))
+            return false;
+    }
+
+    // The second walk starts from where the first ended, which is where
+    // the previous frame leaves everything.
+    resource_state_t states[GERANIUM_MAX_RESOURCES] = {{0}};
+    simulate(states, false);
+    simulate(states, true);
+
+    primrose_log(VERBOSE_OK,
+                 "Compiled render graph with %u passes into %u memory slots.",
+                 pPassCount - 1, pMemoryCount);
+    return true;
+}
+
+void createGraph(VkDevice device, const VkExtent2D *const extent)
+{
+    pDevice = device;
+    pExtent = *extent;
+}
+
+void resizeGraph(const VkExtent2D *const extent)
+{
+    pExtent = *extent;
+    pDirty = true;
+}
+
+void destroyGraph(void)
+{
+    if (pDevice == nullptr) return;
+
+    releaseResources();
+    for (uint32_t i = 1; i < pPassCount; i++)
+        vkDestroyRenderPass(pDevice, pPasses[i].compatible, gAllocator);
+    for (uint32_t i = 0; i < pResourceCount; i++)
+        if (pResources[i].image)
+            releaseSlot(GERANIUM_TEXTURE_BINDING, pResources[i].texture);
+
+    pResourceCount = 0;
+    pPassCount = 1;
+    pPasses[GERANIUM_MAIN_PASS] = (pass_t){0};
+    pDirty = false;
+    pValid = false;
+    pDevice = nullptr;
+}
+
+VkRenderPass getGraphRenderpass(uint32_t pass)
+{
+    if (pass == GERANIUM_MAIN_PASS) return gRenderpass;
+    if (pass >= pPassCount) return nullptr;
+    return pPasses[pass].compatible;
+}
+
+// Whether the pass's subpass has a depth attachment, and if so whether it
+// may be written. The main pass always has one it writes.
+bool getGraphDepth(uint32_t pass, bool *writable)
+{
+    *writable = pass == GERANIUM_MAIN_PASS;
+    if (pass == GERANIUM_MAIN_PASS) return true;
+    if (pass >= pPassCount) return false;
+
+    for (uint32_t i = 0; i < pPasses[pass].accessCount; i++)
+    {
+        geranium_access_t access = pPasses[pass].accesses[i].access;
+        if (access == GERANIUM_ACCESS_DEPTH_WRITE) *writable = true;
+        if (access == GERANIUM_ACCESS_DEPTH_WRITE ||
+            access == GERANIUM_ACCESS_DEPTH_READ)
+            return true;
+    }
+    return false;
+}
+
+static void recordBarriers(VkCommandBuffer buffer, const pass_t *pass)
+{
+    if (pass->imageBarrierCount == 0 && pass->bufferBarrierCount == 0)
+        return;
+    vkCmdPipelineBarrier(buffer, pass->srcStages, pass->dstStages, 0, 0,
+                         nullptr, pass->bufferBarrierCount,
+                         pass->bufferBarriers, pass->imageBarrierCount,
+                         pass->imageBarriers);
+}
+
+// Records every pass ahead of the main one, along with the barriers the main
+// pass needs.
+void recordGraph(VkCommandBuffer buffer)
+{
+    if (pDirty)
+    {
+        setPhase(GERANIUM_PHASE_RESIZE);
+        pValid = compileGraph();
+        pDirty = false;
+        setPhase(GERANIUM_PHASE_FRAME);
+    }
+    if (!pValid) return;
+
+    for (uint32_t i = 1; i < pPassCount; i++)
+    {
+        pass_t *pass = &pPasses[i];
+        beginLabel(buffer, pass->name);
+        recordBarriers(buffer, pass);
+        if (pass->attachmentCount == 0)
+        {
+            pass->record(buffer, pass->data);
+            endLabel(buffer);
+            continue;
+        }
+
+        VkRenderPassBeginInfo renderPassInfo = {0};
+        renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
+        renderPassInfo.renderPass = pass->renderpass;
+        renderPassInfo.framebuffer = pass->framebuffer;
+        renderPassInfo.renderArea.extent = pass->extent;
+        renderPassInfo.clearValueCount = pass->attachmentCount;
+        renderPassInfo.pClearValues = pass->clears;
+
+        vkCmdBeginRenderPass(buffer, &renderPassInfo,
+                             VK_SUBPASS_CONTENTS_INLINE);
+        setViewport(buffer, &pass->extent);
+        pass->record(buffer, pass->data);
+        vkCmdEndRenderPass(buffer);
+        endLabel(buffer);
+    }
+    recordBarriers(buffer, &pPasses[GERANIUM_MAIN_PASS]);
+}
+
+uint32_t geranium_addImage(const geranium_image_info_t *info)
+{
+    if (pResourceCount == GERANIUM_MAX_RESOURCES)
+    {
+        primrose_log(ERROR, "Ran out of graph resources.");
+        return GERANIUM_INVALID_RESOURCE;
+    }
+
+    uint32_t texture = acquireSlot(GERANIUM_TEXTURE_BINDING);
+    if (texture == UINT32_MAX)
+    {
+        primrose_log(ERROR, "Ran out of texture slots for graph images.");
+        return GERANIUM_INVALID_RESOURCE;
+    }
+
+    pResources[pResourceCount] = (resource_t){
+        .image = true,
+        .format = info->format,
+        .scale = info->scale,
+        .texture = texture,
+    };
+    pDirty = true;
+    return pResourceCount++;
+}
+
+uint32_t geranium_addBuffer(uint32_t buffer)
+{
+    if (pResourceCount == GERANIUM_MAX_RESOURCES ||
+        getBuffer(buffer) == nullptr)
+    {
+        primrose_log(ERROR, "Failed to add buffer %u to the graph.", buffer);
+        return GERANIUM_INVALID_RESOURCE;
+    }
+
+    pResources[pResourceCount] = (resource_t){.buffer = buffer};
+    pDirty = true;
+    return pResourceCount++;
+}
+
+static bool checkAccesses(const geranium_resource_access_t *accesses,
+                          uint32_t count)
+{
+    if (count > GERANIUM_MAX_PASS_ACCESSES) return false;
+
+    float scale = -1.0f;
+    bool depth = false;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        if (accesses[i].resource >= pResourceCount ||
+            accesses[i].access >= GERANIUM_ACCESS_COUNT)
+            return false;
+        for (uint32_t j = 0; j < i; j++)
+            if (accesses[j].resource == accesses[i].resource) return false;
+
+        // Images can be attached or sampled, buffers anything else.
+        const resource_t *resource = &pResources[accesses[i].resource];
+        geranium_access_t access = accesses[i].access;
+        if (resource->image != (isAttachment(access) ||
+                                access == GERANIUM_ACCESS_SAMPLED))
+            return false;
+        if (!isAttachment(access)) continue;
+
+        bool isDepth = access != GERANIUM_ACCESS_COLOR_WRITE;
+        if (isDepth != isDepthFormat(resource->format) || (isDepth && depth))
+            return false;
+        depth |= isDepth;
+
+        // Every attachment of a pass has to be the same size.
+        if (scale >= 0.0f && scale != resource->scale) return false;
+        scale = resource->scale;
+    }
+    return true;
+}
+
+uint32_t geranium_addPass(const geranium_pass_info_t *info)
+{
+    if (pDevice == nullptr || pPassCount == GERANIUM_MAX_PASSES ||
+        info->record == nullptr ||
+        !checkAccesses(info->accesses, info->accessCount))
+    {
+        primrose_log(ERROR, "Failed to add render graph pass.");
+        return GERANIUM_INVALID_PASS;
+    }
+
+    pass_t *pass = &pPasses[pPassCount];
+    *pass = (pass_t){
+        .name = info->name != nullptr ? info->name : "graph",
+        .record = info->record,
+        .data = info->data,
+        .accessCount = info->accessCount,
+    };
+    for (uint32_t i = 0; i < info->accessCount; i++)
+        pass->accesses[i] = info->accesses[i];
+
+    bool attachments = false;
+    for (uint32_t i = 0; i < info->accessCount; i++)
+        attachments |= isAttachment(info->accesses[i].access);
+    if (attachments &&
+        !createPassRenderpass(pass, pPassCount, false, &pass->compatible))
+        return GERANIUM_INVALID_PASS;
+
+    pDirty = true;
+    return pPassCount++;
+}
+
+bool geranium_setMainAccesses(const geranium_resource_access_t *accesses,
+                              uint32_t count)
+{
+    // The main pass's own attachments aren't the graph's to manage.
+    for (uint32_t i = 0; i < count; i++)
+        if (isAttachment(accesses[i].access)) return false;
+    if (!checkAccesses(accesses, count)) return false;
+
+    pass_t *pass = &pPasses[GERANIUM_MAIN_PASS];
+    pass->accessCount = count;
+    for (uint32_t i = 0; i < count; i++)
+        pass->accesses[i] = accesses[i];
+    pDirty = true;
+    return true;
+}
+
+uint32_t geranium_getImageTexture(uint32_t image)
+{
+    if (image >= pResourceCount || !pResources[image].image)
+        return GERANIUM_INVALID_TEXTURE;
+    return pResources[image].texture;
+}
+
+// The size of a depth image the main pass samples, which keeps it around and
+// in a readable layout until then. False if there's no such image this frame.
+bool getMainDepth(uint32_t image, VkExtent2D *extent)
+{
+    if (!pValid || image >= pResourceCount || !pResources[image].image ||
+        !isDepthFormat(pResources[image].format))
+        return false;
+
+    const pass_t *pass = &pPasses[GERANIUM_MAIN_PASS];
+    for (uint32_t i = 0; i < pass->accessCount; i++)
+        if (pass->accesses[i].resource == image &&
+            pass->accesses[i].access == GERANIUM_ACCESS_SAMPLED)
+        {
+            *extent = pResources[image].extent;
+            return true;
+        }
+    return false;
+}
@@ -0,0 +1,320 @@
+#include <Geranium.h>
+#include <Primrose.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <vulkan/vulkan.h>
+
+// Contained in Pipeline.c.
+extern bool buildPipeline(const geranium_pipeline_info_t *info,
+                          VkPipeline *pipeline);
+extern bool buildPipelinePart(const geranium_pipeline_info_t *info,
+                              VkGraphicsPipelineLibraryFlagsEXT parts,
+                              VkPipeline *pipeline);
+extern bool linkPipeline(const VkPipeline *libraries, uint32_t count,
+                         bool optimize, VkPipeline *pipeline);
+extern void discardPipeline(VkPipeline pipeline);
+
+// Contained in Cache.c.
+extern void deliverPipeline(uint32_t index, VkPipeline pipeline,
+                            uint32_t generation);
+
+// Contained in Retire.c.
+extern bool retireObject(void (*release)(uint64_t object), uint64_t object);
+
+// Contained in Memory.c.
+extern void setBackground(void);
+
+// Contained in Debug.c.
+extern void nameObject(VkObjectType type, uint64_t handle, const char *format,
+                       ...);
+
+#define GERANIUM_MAX_LIBRARIES 256
+#define GERANIUM_LIBRARY_PARTS 4
+
+static const VkGraphicsPipelineLibraryFlagsEXT pParts[GERANIUM_LIBRARY_PARTS] =
+    {
+        VK_GRAPHICS_PIPELINE_LIBRARY_VERTEX_INPUT_INTERFACE_BIT_EXT,
+        VK_GRAPHICS_PIPELINE_LIBRARY_PRE_RASTERIZATION_SHADERS_BIT_EXT,
+        VK_GRAPHICS_PIPELINE_LIBRARY_FRAGMENT_SHADER_BIT_EXT,
+        VK_GRAPHICS_PIPELINE_LIBRARY_FRAGMENT_OUTPUT_INTERFACE_BIT_EXT,
+};
+
+// Only the state a part actually depends on, so that variants differing
+// elsewhere share it. Zeroed before filling, like the variant keys.
+typedef struct library_key
+{
+    char shader[GERANIUM_MAX_SHADER_NAME];
+    uint32_t part;
+    uint32_t state[2];
+    uint32_t pass;
+    uint32_t constantCount;
+    uint32_t constants[GERANIUM_MAX_SPECIALIZATION];
+} library_key_t;
+
+typedef struct library
+{
+    library_key_t key;
+    // Null while the slot is empty.
+    VkPipeline pipeline;
+    // Built from shaders that have since been recompiled. Pipelines linked
+    // from it are still fine, but nothing new is.
+    bool stale;
+    // Links in progress using it. Stale libraries are retired once this
+    // drops to zero.
+    uint32_t users;
+} library_t;
+
+typedef struct link_job
+{
+    uint32_t index;
+    geranium_pipeline_info_t info;
+} link_job_t;
+
+static bool pEnabled = false;
+
+static library_t pLibraries[GERANIUM_MAX_LIBRARIES];
+// One past the last slot in use; empty slots below it are reused first.
+static uint32_t pLibraryCount = 0;
+static pthread_mutex_t pLibraryLock = PTHREAD_MUTEX_INITIALIZER;
+// Bumped by every reload. Links stamped with an older one were made from
+// stale libraries and must not be delivered.
+static atomic_uint pGeneration = 0;
+
+// The optimized links waiting to be done, oldest first.
+static link_job_t pJobs[GERANIUM_MAX_PIPELINES];
+static uint32_t pJobStart = 0;
+static uint32_t pJobCount = 0;
+static bool pRunning = false;
+static pthread_t pThread;
+static pthread_mutex_t pJobLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pJobSignal = PTHREAD_COND_INITIALIZER;
+
+static void createLibraryKey(const geranium_pipeline_info_t *info,
+                             uint32_t part, library_key_t *key)
+{
+    memset(key, 0, sizeof(library_key_t));
+    key->part = pParts[part];
+    // The renderpass is part of every library but the vertex input one.
+    if (pParts[part] !=
+        VK_GRAPHICS_PIPELINE_LIBRARY_VERTEX_INPUT_INTERFACE_BIT_EXT)
+        key->pass = info->pass;
+    switch (pParts[part])
+    {
+        case VK_GRAPHICS_PIPELINE_LIBRARY_VERTEX_INPUT_INTERFACE_BIT_EXT:
+            key->state[0] = info->topology;
+            return;
+        case VK_GRAPHICS_PIPELINE_LIBRARY_PRE_RASTERIZATION_SHADERS_BIT_EXT:
+            strcpy(key->shader, info->vertex);
+            key->state[0] = info->cullMode;
+            key->state[1] = info->frontFace;
+            break;
+        case VK_GRAPHICS_PIPELINE_LIBRARY_FRAGMENT_SHADER_BIT_EXT:
+            strcpy(key->shader, info->fragment);
+            key->state[0] = info->depthTest;
+            break;
+        default: key->state[0] = info->blend; return;
+    }
+
+    // Only the shader parts see the constants.
+    key->constantCount = info->constantCount;
+    if (info->constantCount > 0)
+        memcpy(key->constants, info->constants,
+               info->constantCount * sizeof(uint32_t));
+}
+
+// The library lock must be held. Returns the library's slot, or UINT32_MAX
+// if it couldn't be built.
+static uint32_t getLibrary(const geranium_pipeline_info_t *info,
+                           uint32_t part)
+{
+    library_key_t key;
+    createLibraryKey(info, part, &key);
+    uint32_t empty = UINT32_MAX;
+    for (uint32_t i = 0; i < pLibraryCount; i++)
+    {
+        if (pLibraries[i].pipeline == nullptr)
+        {
+            if (empty == UINT32_MAX) empty = i;
+            continue;
+        }
+        if (!pLibraries[i].stale &&
+            memcmp(&pLibraries[i].key, &key, sizeof(library_key_t)) == 0)
+            return i;
+    }
+
+    if (empty == UINT32_MAX && pLibraryCount == GERANIUM_MAX_LIBRARIES)
+    {
+        primrose_log(ERROR, "Ran out of pipeline libraries.");
+        return UINT32_MAX;
+    }
+    VkPipeline pipeline;
+    if (!buildPipelinePart(info, pParts[part], &pipeline)) return UINT32_MAX;
+    if (empty == UINT32_MAX) empty = pLibraryCount++;
+    pLibraries[empty] = (library_t){
+        .key = key,
+        .pipeline = pipeline,
+    };
+    return empty;
+}
+
+// The generation is that of the libraries the link was made from.
+static bool link(const geranium_pipeline_info_t *info, bool optimize,
+                 VkPipeline *pipeline, uint32_t *generation)
+{
+    VkPipeline libraries[GERANIUM_LIBRARY_PARTS];
+    uint32_t slots[GERANIUM_LIBRARY_PARTS];
+
+    // Holding the libraries keeps them from being retired mid-link, even
+    // if they go stale once the lock is dropped.
+    pthread_mutex_lock(&pLibraryLock);
+    *generation = atomic_load(&pGeneration);
+    uint32_t held = 0;
+    for (; held < GERANIUM_LIBRARY_PARTS; held++)
+    {
+        slots[held] = getLibrary(info, held);
+        if (slots[held] == UINT32_MAX) break;
+        pLibraries[slots[held]].users++;
+        libraries[held] = pLibraries[slots[held]].pipeline;
+    }
+    pthread_mutex_unlock(&pLibraryLock);
+
+    bool linked =
+        held == GERANIUM_LIBRARY_PARTS &&
+        linkPipeline(libraries, GERANIUM_LIBRARY_PARTS, optimize, pipeline);
+
+    pthread_mutex_lock(&pLibraryLock);
+    for (uint32_t i = 0; i < held; i++) pLibraries[slots[i]].users--;
+    pthread_mutex_unlock(&pLibraryLock);
+    if (!linked) return false;
+    nameObject(VK_OBJECT_TYPE_PIPELINE, (uint64_t)*pipeline, "%s + %s (%s)",
+               info->vertex, info->fragment, optimize ? "optimized" : "linked");
+    return true;
+}
+
+static void *optimize(void *)
+{
+    setBackground();
+
+    pthread_mutex_lock(&pJobLock);
+    while (true)
+    {
+        while (pRunning && pJobCount == 0)
+            pthread_cond_wait(&pJobSignal, &pJobLock);
+        if (!pRunning) break;
+
+        link_job_t job = pJobs[pJobStart];
+        pJobStart = (pJobStart + 1) % GERANIUM_MAX_PIPELINES;
+        pJobCount--;
+        pthread_mutex_unlock(&pJobLock);
+
+        VkPipeline pipeline;
+        uint32_t generation;
+        if (link(&job.info, true, &pipeline, &generation))
+            deliverPipeline(job.index, pipeline, generation);
+
+        pthread_mutex_lock(&pJobLock);
+    }
+    pthread_mutex_unlock(&pJobLock);
+    return nullptr;
+}
+
+bool createLibraries(bool enabled)
+{
+    GERANIUM_TRACE_SCOPE(__func__);
+
+    if (!enabled) return true;
+
+    pRunning = true;
+    if (pthread_create(&pThread, nullptr, optimize, nullptr) != 0)
+    {
+        primrose_log(ERROR, "Failed to start pipeline link thread.");
+        pRunning = false;
+        return false;
+    }
+
+    pEnabled = true;
+    primrose_log(VERBOSE_OK, "Using graphics pipeline libraries.");
+    return true;
+}
+
+void destroyLibraries(void)
+{
+    if (!pEnabled) return;
+
+    pthread_mutex_lock(&pJobLock);
+    pRunning = false;
+    pJobCount = 0;
+    pthread_cond_signal(&pJobSignal);
+    pthread_mutex_unlock(&pJobLock);
+    pthread_join(pThread, nullptr);
+
+    for (uint32_t i = 0; i < pLibraryCount; i++)
+        if (pLibraries[i].pipeline != nullptr)
+            discardPipeline(pLibraries[i].pipeline);
+    pLibraryCount = 0;
+    pEnabled = false;
+}
+
+// Called from the reload thread before the variants are rebuilt.
+void invalidateLibraries(void)
+{
+    pthread_mutex_lock(&pLibraryLock);
+    for (uint32_t i = 0; i < pLibraryCount; i++)
+        if (pLibraries[i].key.shader[0] != '\0') pLibraries[i].stale = true;
+    atomic_fetch_add(&pGeneration, 1);
+    pthread_mutex_unlock(&pLibraryLock);
+}
+
+uint32_t getLibraryGeneration(void) { return atomic_load(&pGeneration); }
+
+static void releaseLibrary(uint64_t pipeline)
+{
+    discardPipeline((VkPipeline)pipeline);
+}
+
+// Called at the start of every recorded frame, which is the only place
+// retiring is safe from. Libraries are never bound, so once no link holds a
+// stale one it's only kept for the retire queue's sake.
+void collectLibraries(void)
+{
+    if (!pEnabled) return;
+
+    pthread_mutex_lock(&pLibraryLock);
+    for (uint32_t i = 0; i < pLibraryCount; i++)
+    {
+        library_t *library = &pLibraries[i];
+        if (library->pipeline == nullptr || !library->stale ||
+            library->users > 0)
+            continue;
+        // A full queue just leaves the rest for a later frame.
+        if (!retireObject(releaseLibrary, (uint64_t)library->pipeline))
+            break;
+        library->pipeline = nullptr;
+    }
+    while (pLibraryCount > 0 &&
+           pLibraries[pLibraryCount - 1].pipeline == nullptr)
+        pLibraryCount--;
+    pthread_mutex_unlock(&pLibraryLock);
+}
+
+// Without libraries this is a full build. With them, the parts are reused or
+// built, the variant is fast-linked, and an optimized link is queued to
+// replace it later. The info has to outlive the variant.
+bool createVariant(const geranium_pipeline_info_t *info, uint32_t index,
+                   VkPipeline *pipeline)
+{
+    uint32_t generation;
+    if (!pEnabled || !link(info, false, pipeline, &generation))
+        return buildPipeline(info, pipeline);
+
+    pthread_mutex_lock(&pJobLock);
+    pJobs[(pJobStart + pJobCount) % GERANIUM_MAX_PIPELINES] = (link_job_t){
+        .index = index,
+        .info = *info,
+    };
+    pJobCount++;
+    pthread_cond_signal(&pJobSignal);
+    pthread_mutex_unlock(&pJobLock);
+    return true;
+}
@@ -0,0 +1,191 @@
+#include <Geranium.h>
+#include <Primrose.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vulkan/vulkan.h>
+
+// Everything Geranium keeps on the host comes out of one block allocated at
+// creation, bumped forward and never freed piecemeal.
+static uint8_t *pArena = nullptr;
+static size_t pArenaSize = 0;
+static size_t pArenaUsed = 0;
+static size_t pArenaPeak = 0;
+
+typedef struct phase_counters
+{
+    atomic_uint_fast64_t allocations;
+    atomic_uint_fast64_t allocatedBytes;
+    atomic_uint_fast64_t frees;
+} phase_counters_t;
+
+static phase_counters_t pPhases[GERANIUM_PHASE_COUNT];
+static atomic_uint_fast64_t pLiveBytes = 0;
+static atomic_uint_fast64_t pPeakBytes = 0;
+
+static atomic_uint pPhase = GERANIUM_PHASE_CREATE;
+// Threads of our own that aren't the frame loop count separately, so the
+// frame phase only ever shows what geranium_render itself caused.
+static thread_local bool pBackground = false;
+
+// Sits right before every pointer handed to the driver.
+typedef struct header
+{
+    size_t size;
+    size_t offset;
+} header_t;
+
+bool createArena(size_t size)
+{
+    pArena = malloc(size);
+    if (pArena == nullptr)
+    {
+        primrose_log(ERROR, "Failed to allocate %zu byte arena.", size);
+        return false;
+    }
+    pArenaSize = size;
+    pArenaUsed = 0;
+    pArenaPeak = 0;
+    return true;
+}
+
+void destroyArena(void)
+{
+    free(pArena);
+    pArena = nullptr;
+    pArenaSize = 0;
+    pArenaUsed = 0;
+}
+
+// Main thread only.
+void *arenaAllocate(size_t size)
+{
+    size_t start = (pArenaUsed + alignof(max_align_t) - 1) &
+                   ~(alignof(max_align_t) - 1);
+    if (pArena == nullptr || start + size > pArenaSize)
+    {
+        primrose_log(ERROR, "Arena exhausted allocating %zu bytes.", size);
+        return nullptr;
+    }
+
+    pArenaUsed = start + size;
+    if (pArenaUsed > pArenaPeak) pArenaPeak = pArenaUsed;
+    return pArena + start;
+}
+
+// Scratch space is taken after a mark and handed back by releasing it.
+size_t arenaMark(void) { return pArenaUsed; }
+void arenaRelease(size_t mark) { pArenaUsed = mark; }
+
+void setPhase(geranium_phase_t phase) { atomic_store(&pPhase, phase); }
+void setBackground(void) { pBackground = true; }
+
+static phase_counters_t *getCounters(void)
+{
+    if (pBackground) return &pPhases[GERANIUM_PHASE_BACKGROUND];
+    return &pPhases[atomic_load(&pPhase)];
+}
+
+static void countAllocation(size_t size)
+{
+    phase_counters_t *counters = getCounters();
+    atomic_fetch_add(&counters->allocations, 1);
+    atomic_fetch_add(&counters->allocatedBytes, size);
+
+    uint_fast64_t live = atomic_fetch_add(&pLiveBytes, size) + size;
+    uint_fast64_t peak = atomic_load(&pPeakBytes);
+    while (live > peak &&
+           !atomic_compare_exchange_weak(&pPeakBytes, &peak, live));
+}
+
+static void countFree(size_t size)
+{
+    atomic_fetch_add(&getCounters()->frees, 1);
+    atomic_fetch_sub(&pLiveBytes, size);
+}
+
+static void *allocate(void *, size_t size, size_t alignment,
+                      VkSystemAllocationScope)
+{
+    if (alignment < sizeof(header_t)) alignment = sizeof(header_t);
+
+    uint8_t *raw = malloc(size + alignment + sizeof(header_t));
+    if (raw == nullptr) return nullptr;
+
+    uintptr_t user = ((uintptr_t)raw + sizeof(header_t) + alignment - 1) &
+                     ~(uintptr_t)(alignment - 1);
+    header_t *header = (header_t *)user - 1;
+    header->size = size;
+    header->offset = user - (uintptr_t)raw;
+
+    countAllocation(size);
+    return (void *)user;
+}
+
+static void release(void *, void *memory)
+{
+    if (memory == nullptr) return;
+
+    header_t *header = (header_t *)memory - 1;
+    countFree(header->size);
+    free((uint8_t *)memory - header->offset);
+}
+
+static void *reallocate(void *data, void *original, size_t size,
+                        size_t alignment, VkSystemAllocationScope scope)
+{
+    if (original == nullptr) return allocate(data, size, alignment, scope);
+    if (size == 0)
+    {
+        release(data, original);
+        return nullptr;
+    }
+
+    void *memory = allocate(data, size, alignment, scope);
+    if (memory == nullptr) return nullptr;
+
+    size_t previous = ((header_t *)original - 1)->size;
+    memcpy(memory, original, previous < size ? previous : size);
+    release(data, original);
+    return memory;
+}
+
+// Allocations the driver makes on its own and only tells us about.
+static void notifyAllocation(void *, size_t size,
+                             VkInternalAllocationType,
+                             VkSystemAllocationScope)
+{
+    countAllocation(size);
+}
+
+static void notifyFree(void *, size_t size, VkInternalAllocationType,
+                       VkSystemAllocationScope)
+{
+    countFree(size);
+}
+
+static const VkAllocationCallbacks pCallbacks = {
+    .pfnAllocation = allocate,
+    .pfnReallocation = reallocate,
+    .pfnFree = release,
+    .pfnInternalAllocation = notifyAllocation,
+    .pfnInternalFree = notifyFree,
+};
+
+const VkAllocationCallbacks *gAllocator = &pCallbacks;
+
+void geranium_getMemoryStats(geranium_phase_t phase,
+                             geranium_memory_stats_t *stats)
+{
+    *stats = (geranium_memory_stats_t){
+        .allocations = atomic_load(&pPhases[phase].allocations),
+        .allocatedBytes = atomic_load(&pPhases[phase].allocatedBytes),
+        .frees = atomic_load(&pPhases[phase].frees),
+        .liveBytes = atomic_load(&pLiveBytes),
+        .peakBytes = atomic_load(&pPeakBytes),
+        .arenaUsed = pArenaUsed,
+        .arenaPeak = pArenaPeak,
+        .arenaSize = pArenaSize,
+    };
+}
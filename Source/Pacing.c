@@ -0,0 +1,82 @@
+#define _POSIX_C_SOURCE 200809L
+#include <Geranium.h>
+#include <errno.h>
+#include <stdatomic.h>
+#include <time.h>
+
+// The scheduler routinely oversleeps by up to a millisecond, so we stop
+// sleeping this long before a deadline and spin out the remainder.
+#define GERANIUM_SPIN_THRESHOLD 1500000ull
+
+static uint64_t pInterval = 0;
+static uint64_t pDeadline = 0;
+
+static bool pDirtyRendering = false;
+static atomic_bool pDirty = true;
+
+static uint64_t getTime(void)
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (uint64_t)time.tv_sec * 1000000000ull + (uint64_t)time.tv_nsec;
+}
+
+static void sleepUntil(uint64_t deadline)
+{
+    struct timespec time = {
+        .tv_sec = (time_t)(deadline / 1000000000ull),
+        .tv_nsec = (long)(deadline % 1000000000ull),
+    };
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &time, nullptr) ==
+           EINTR);
+}
+
+// Advances to the next frame slot, returning when it begins. Slots we've
+// fallen more than a whole frame behind on are dropped rather than rendered
+// back-to-back to catch up.
+static void waitForSlot(bool precise)
+{
+    uint64_t now = getTime();
+    if (pDeadline > now)
+    {
+        if (!precise) sleepUntil(pDeadline);
+        else
+        {
+            if (pDeadline - now > GERANIUM_SPIN_THRESHOLD)
+                sleepUntil(pDeadline - GERANIUM_SPIN_THRESHOLD);
+            while (getTime() < pDeadline);
+        }
+    }
+    else if (now - pDeadline > pInterval) pDeadline = now;
+
+    pDeadline += pInterval;
+}
+
+void geranium_setFrameLimit(uint32_t framesPerSecond)
+{
+    pInterval = framesPerSecond == 0 ? 0 : 1000000000ull / framesPerSecond;
+    pDeadline = 0;
+}
+
+void geranium_setDirtyRendering(bool enabled)
+{
+    pDirtyRendering = enabled;
+    atomic_store(&pDirty, true);
+}
+
+void geranium_markDirty(void) { atomic_store(&pDirty, true); }
+
+// Decides whether this frame gets drawn at all, and if so holds it back
+// until the limiter allows it. Skipped frames only wait out a set limit, and
+// otherwise return straight away for the caller's event loop to block in.
+bool claimFrame(void)
+{
+    if (pDirtyRendering && !atomic_exchange(&pDirty, false))
+    {
+        if (pInterval != 0) waitForSlot(false);
+        return false;
+    }
+
+    if (pInterval != 0) waitForSlot(true);
+    return true;
+}
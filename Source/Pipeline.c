@@ -1,35 +1,73 @@
+#include <Geranium.h>
 #include <Primrose.h>
+#include <string.h>
 #include <vulkan/vulkan.h>
 
+// Contained in Memory.c.
+extern const VkAllocationCallbacks *gAllocator;
+
+// Contained in Debug.c.
+extern void nameObject(VkObjectType type, uint64_t handle, const char *format,
+                       ...);
+
 // Contained in Shaders.c.
 extern bool createShaderStage(const char *, VkPipelineShaderStageCreateInfo *,
                               VkDevice);
 
+// Contained in Retire.c.
+extern bool retireObject(void (*release)(uint64_t object), uint64_t object);
+
+// Contained in Cache.c.
+extern VkPipeline getActivePipeline(void);
+
+// Contained in Graph.c.
+extern VkRenderPass getGraphRenderpass(uint32_t pass);
+extern bool getGraphDepth(uint32_t pass, bool *writable);
+
+// Contained in Attachments.c.
+extern VkSampleCountFlagBits getSampleCount(void);
+extern VkFormat getDepthFormat(void);
+extern bool multisampled(void);
+
+// Contained in Descriptors.c.
+extern VkDescriptorSetLayout gDescriptorLayout;
+extern VkDescriptorSet gDescriptorSet;
+
+static VkDevice pDevice = nullptr;
 static VkPipelineLayout pPipelineLayout = nullptr;
-static VkPipeline pGraphicsPipeline = nullptr;
 
-VkRenderPass gRenderpass = nullptr;
+static uint8_t pConstants[GERANIUM_PUSH_CONSTANT_SIZE];
 
-static VkPipelineViewportStateCreateInfo
-getViewport(const VkExtent2D *const extent)
-{
-    VkViewport viewport = {0};
-    viewport.width = (float)extent->width;
-    viewport.height = (float)extent->height;
-    viewport.maxDepth = 1.0f;
+// Both main renderpasses draw into the multisampled color and depth
+// attachments, resolving into the swapchain image or the scaled target.
+VkRenderPass gRenderpass = nullptr;
+// Identical to gRenderpass save for the final layout, this is used when
+// rendering into the scaled offscreen target instead of the swapchain.
+VkRenderPass gOffscreenRenderpass = nullptr;
 
-    VkRect2D scissor = {0};
-    scissor.extent = *extent;
+// The viewport and scissor are set at record time so the same pipeline can
+// draw into targets of any size, including the dynamically scaled one.
+static const VkDynamicState pDynamicStates[2] = {VK_DYNAMIC_STATE_VIEWPORT,
+                                                 VK_DYNAMIC_STATE_SCISSOR};
 
+static VkPipelineViewportStateCreateInfo getViewport(void)
+{
     VkPipelineViewportStateCreateInfo viewportState = {0};
     viewportState.sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
     viewportState.viewportCount = 1;
-    viewportState.pViewports = &viewport;
     viewportState.scissorCount = 1;
-    viewportState.pScissors = &scissor;
     return viewportState;
 }
 
+static VkPipelineDynamicStateCreateInfo createDynamicState(void)
+{
+    VkPipelineDynamicStateCreateInfo dynamicState = {0};
+    dynamicState.sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO;
+    dynamicState.dynamicStateCount = 2;
+    dynamicState.pDynamicStates = pDynamicStates;
+    return dynamicState;
+}
+
 static VkPipelineVertexInputStateCreateInfo createInput(void)
 {
     VkPipelineVertexInputStateCreateInfo vertexInputInfo = {0};
@@ -38,114 +76,219 @@ static VkPipelineVertexInputStateCreateInfo createInput(void)
     return vertexInputInfo;
 }
 
-static VkPipelineInputAssemblyStateCreateInfo createAssembly(void)
+static VkPipelineInputAssemblyStateCreateInfo
+createAssembly(VkPrimitiveTopology topology)
 {
     VkPipelineInputAssemblyStateCreateInfo inputAssembly = {0};
     inputAssembly.sType =
         VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO;
-    inputAssembly.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
+    inputAssembly.topology = topology;
     return inputAssembly;
 }
 
-static VkPipelineRasterizationStateCreateInfo createRasterizer(void)
+static VkPipelineRasterizationStateCreateInfo
+createRasterizer(VkCullModeFlags cullMode, VkFrontFace frontFace)
 {
     VkPipelineRasterizationStateCreateInfo rasterizer = {0};
     rasterizer.sType =
         VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO;
     rasterizer.lineWidth = 1.0f;
-    rasterizer.cullMode = VK_CULL_MODE_BACK_BIT;
-    rasterizer.frontFace = VK_FRONT_FACE_CLOCKWISE;
+    rasterizer.cullMode = cullMode;
+    rasterizer.frontFace = frontFace;
     return rasterizer;
 }
 
-static VkPipelineMultisampleStateCreateInfo createMultisampling(void)
+// Only the main pass has the multisampled attachments; graph passes draw
+// into their own single-sampled images.
+static VkPipelineMultisampleStateCreateInfo createMultisampling(uint32_t pass)
 {
     VkPipelineMultisampleStateCreateInfo multisampling = {0};
     multisampling.sType =
         VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO;
-    multisampling.rasterizationSamples = VK_SAMPLE_COUNT_1_BIT;
+    multisampling.rasterizationSamples = pass == GERANIUM_MAIN_PASS
+                                             ? getSampleCount()
+                                             : VK_SAMPLE_COUNT_1_BIT;
     return multisampling;
 }
 
-static VkPipelineColorBlendStateCreateInfo createColorBlend(void)
+// Read-only depth attachments are tested against but never written.
+static VkPipelineDepthStencilStateCreateInfo createDepthStencil(bool test,
+                                                                bool writable)
+{
+    VkPipelineDepthStencilStateCreateInfo depthStencil = {0};
+    depthStencil.sType =
+        VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO;
+    depthStencil.depthTestEnable = test;
+    depthStencil.depthWriteEnable = test && writable;
+    depthStencil.depthCompareOp = VK_COMPARE_OP_LESS;
+    return depthStencil;
+}
+
+static VkPipelineColorBlendAttachmentState createBlendAttachment(bool blend)
 {
     VkPipelineColorBlendAttachmentState colorBlendAttachment = {0};
     colorBlendAttachment.colorWriteMask =
         VK_COLOR_COMPONENT_R_BIT | VK_COLOR_COMPONENT_G_BIT |
         VK_COLOR_COMPONENT_B_BIT | VK_COLOR_COMPONENT_A_BIT;
+    if (!blend) return colorBlendAttachment;
+
+    // Premultiplied alpha.
+    colorBlendAttachment.blendEnable = VK_TRUE;
+    colorBlendAttachment.srcColorBlendFactor = VK_BLEND_FACTOR_ONE;
+    colorBlendAttachment.dstColorBlendFactor =
+        VK_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA;
+    colorBlendAttachment.srcAlphaBlendFactor = VK_BLEND_FACTOR_ONE;
+    colorBlendAttachment.dstAlphaBlendFactor =
+        VK_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA;
+    return colorBlendAttachment;
+}
 
+static VkPipelineColorBlendStateCreateInfo createColorBlend(
+    const VkPipelineColorBlendAttachmentState *const colorBlendAttachment)
+{
     VkPipelineColorBlendStateCreateInfo colorBlending = {0};
     colorBlending.sType =
         VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO;
     colorBlending.attachmentCount = 1;
-    colorBlending.pAttachments = &colorBlendAttachment;
+    colorBlending.pAttachments = colorBlendAttachment;
     return colorBlending;
 }
 
-static VkAttachmentDescription createColorAttachment(VkFormat format)
+// With multisampling, the color attachment is only the transient one that
+// resolves into the target; otherwise it is the target.
+static VkAttachmentDescription createColorAttachment(VkFormat format,
+                                                     VkImageLayout finalLayout)
 {
     VkAttachmentDescription colorAttachment = {0};
     colorAttachment.format = format;
-    colorAttachment.samples = VK_SAMPLE_COUNT_1_BIT;
+    colorAttachment.samples = getSampleCount();
     colorAttachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
     colorAttachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
     colorAttachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
-    colorAttachment.finalLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+    colorAttachment.finalLayout = finalLayout;
+    if (multisampled())
+    {
+        colorAttachment.storeOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+        colorAttachment.finalLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+    }
     return colorAttachment;
 }
 
-static void createSubpass(VkSubpassDescription *description,
-                          VkSubpassDependency *dependency)
+static VkAttachmentDescription createDepthAttachment(void)
+{
+    VkAttachmentDescription depthAttachment = {0};
+    depthAttachment.format = getDepthFormat();
+    depthAttachment.samples = getSampleCount();
+    depthAttachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
+    depthAttachment.storeOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+    depthAttachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+    depthAttachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+    depthAttachment.finalLayout =
+        VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+    return depthAttachment;
+}
+
+static VkAttachmentDescription
+createResolveAttachment(VkFormat format, VkImageLayout finalLayout)
 {
-    VkAttachmentReference colorAttachmentRef = {0};
-    colorAttachmentRef.layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+    VkAttachmentDescription resolveAttachment = {0};
+    resolveAttachment.format = format;
+    resolveAttachment.samples = VK_SAMPLE_COUNT_1_BIT;
+    resolveAttachment.loadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+    resolveAttachment.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
+    resolveAttachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+    resolveAttachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+    resolveAttachment.finalLayout = finalLayout;
+    return resolveAttachment;
+}
 
+static void createSubpass(const VkAttachmentReference *const references,
+                          VkSubpassDescription *description,
+                          VkSubpassDependency *dependency)
+{
     description->pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
     description->colorAttachmentCount = 1;
-    description->pColorAttachments = &colorAttachmentRef;
+    description->pColorAttachments = &references[0];
+    description->pDepthStencilAttachment = &references[1];
+    if (multisampled()) description->pResolveAttachments = &references[2];
 
+    // The depth and multisampled attachments are shared by every frame in
+    // flight, so the last frame's writes to them have to be done first.
     dependency->srcSubpass = VK_SUBPASS_EXTERNAL;
-    dependency->srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
-    dependency->dstStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
-    dependency->dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+    dependency->srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT |
+                               VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT;
+    dependency->srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT |
+                                VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+    dependency->dstStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT |
+                               VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT;
+    dependency->dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT |
+                                VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
 }
 
 static bool createLayout(const VkDevice device)
 {
+    // Everything is reached through the one descriptor heap, with the push
+    // constants left free for indices into it.
+    VkPushConstantRange constantRange = {0};
+    constantRange.stageFlags = VK_SHADER_STAGE_ALL;
+    constantRange.size = GERANIUM_PUSH_CONSTANT_SIZE;
+
     VkPipelineLayoutCreateInfo pipelineLayoutInfo = {0};
     pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+    pipelineLayoutInfo.setLayoutCount = 1;
+    pipelineLayoutInfo.pSetLayouts = &gDescriptorLayout;
+    pipelineLayoutInfo.pushConstantRangeCount = 1;
+    pipelineLayoutInfo.pPushConstantRanges = &constantRange;
 
     VkResult result = vkCreatePipelineLayout(device, &pipelineLayoutInfo,
-                                             nullptr, &pPipelineLayout);
+                                             gAllocator, &pPipelineLayout);
     if (result != VK_SUCCESS)
     {
         primrose_log(ERROR, "Failed to create pipeline layout. Code: %d.",
                      result);
         return false;
     }
+    nameObject(VK_OBJECT_TYPE_PIPELINE_LAYOUT, (uint64_t)pPipelineLayout,
+               "pipeline layout");
     primrose_log(VERBOSE_OK, "Created pipeline layout.");
     return true;
 }
 
-static bool createRenderpass(VkFormat format, const VkDevice device)
+static bool createRenderpass(VkFormat format, VkImageLayout finalLayout,
+                             VkRenderPass *renderpass, const VkDevice device)
 {
-    VkAttachmentDescription colorAttachment = createColorAttachment(format);
+    VkAttachmentDescription attachments[3] = {
+        createColorAttachment(format, finalLayout),
+        createDepthAttachment(),
+        createResolveAttachment(format, finalLayout),
+    };
+    uint32_t attachmentCount = multisampled() ? 3 : 2;
+
+    VkAttachmentReference references[3] = {
+        {0, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL},
+        {1, VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL},
+        {2, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL},
+    };
 
     VkSubpassDescription description = {0};
     VkSubpassDependency dependency = {0};
-    createSubpass(&description, &dependency);
+    createSubpass(references, &description, &dependency);
+    // The offscreen target is read by the previous frame's upscale blit, so
+    // that has to finish before we clear it again.
+    if (finalLayout == VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL)
+        dependency.srcStageMask |= VK_PIPELINE_STAGE_TRANSFER_BIT;
 
     VkRenderPassCreateInfo renderPassInfo = {0};
     renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
-    renderPassInfo.attachmentCount = 1;
-    renderPassInfo.pAttachments = &colorAttachment;
+    renderPassInfo.attachmentCount = attachmentCount;
+    renderPassInfo.pAttachments = attachments;
     renderPassInfo.subpassCount = 1;
     renderPassInfo.pSubpasses = &description;
     renderPassInfo.dependencyCount = 1;
     renderPassInfo.pDependencies = &dependency;
 
     VkResult result =
-        vkCreateRenderPass(device, &renderPassInfo, nullptr, &gRenderpass);
+        vkCreateRenderPass(device, &renderPassInfo, gAllocator, renderpass);
     if (result != VK_SUCCESS)
     {
         primrose_log(ERROR, "Failed to create renderpass. Code: %d.", result);
@@ -156,67 +299,327 @@ static bool createRenderpass(VkFormat format, const VkDevice device)
     return true;
 }
 
-bool createPipeline(const VkExtent2D *const extent, const VkDevice device,
-                    VkFormat format)
+// Builds the parts of a pipeline named by parts as a library, or the whole
+// pipeline when parts is zero, from whatever SPIR-V is on disk right now.
+// Safe to call from any thread once the layout and renderpasses exist.
+bool buildPipelinePart(const geranium_pipeline_info_t *info,
+                       VkGraphicsPipelineLibraryFlagsEXT parts,
+                       VkPipeline *pipeline)
 {
+    bool whole = parts == 0;
+    bool input =
+        whole ||
+        parts & VK_GRAPHICS_PIPELINE_LIBRARY_VERTEX_INPUT_INTERFACE_BIT_EXT;
+    bool rasterization =
+        whole ||
+        parts & VK_GRAPHICS_PIPELINE_LIBRARY_PRE_RASTERIZATION_SHADERS_BIT_EXT;
+    bool fragment =
+        whole || parts & VK_GRAPHICS_PIPELINE_LIBRARY_FRAGMENT_SHADER_BIT_EXT;
+    bool output =
+        whole ||
+        parts & VK_GRAPHICS_PIPELINE_LIBRARY_FRAGMENT_OUTPUT_INTERFACE_BIT_EXT;
+
     VkPipelineShaderStageCreateInfo stages[2];
-    createShaderStage("default.vert", &stages[0], device);
-    createShaderStage("default.frag", &stages[1], device);
+    uint32_t stageCount = 0;
+    if (rasterization)
+    {
+        if (!createShaderStage(info->vertex, &stages[stageCount], pDevice))
+            return false;
+        stageCount++;
+    }
+    if (fragment)
+    {
+        if (!createShaderStage(info->fragment, &stages[stageCount], pDevice))
+        {
+            for (uint32_t i = 0; i < stageCount; i++)
+                vkDestroyShaderModule(pDevice, stages[i].module, gAllocator);
+            return false;
+        }
+        stageCount++;
+    }
 
-    VkPipelineVertexInputStateCreateInfo input = createInput();
-    VkPipelineInputAssemblyStateCreateInfo assembly = createAssembly();
-    VkPipelineViewportStateCreateInfo viewport = getViewport(extent);
+    // Each constant is a 32-bit value with its index as its constant_id, and
+    // both stages see the same set.
+    VkSpecializationMapEntry entries[GERANIUM_MAX_SPECIALIZATION];
+    for (uint32_t i = 0; i < info->constantCount; i++)
+        entries[i] = (VkSpecializationMapEntry){
+            .constantID = i,
+            .offset = i * sizeof(uint32_t),
+            .size = sizeof(uint32_t),
+        };
+
+    VkSpecializationInfo specialization = {0};
+    specialization.mapEntryCount = info->constantCount;
+    specialization.pMapEntries = entries;
+    specialization.dataSize = info->constantCount * sizeof(uint32_t);
+    specialization.pData = info->constants;
+    if (info->constantCount > 0)
+        for (uint32_t i = 0; i < stageCount; i++)
+            stages[i].pSpecializationInfo = &specialization;
+
+    VkPipelineVertexInputStateCreateInfo vertexInput = createInput();
+    VkPipelineInputAssemblyStateCreateInfo assembly =
+        createAssembly(info->topology);
+    VkPipelineViewportStateCreateInfo viewport = getViewport();
+    VkPipelineDynamicStateCreateInfo dynamicState = createDynamicState();
+
+    VkPipelineRasterizationStateCreateInfo rasterizer =
+        createRasterizer(info->cullMode, info->frontFace);
+    VkPipelineMultisampleStateCreateInfo multisampling =
+        createMultisampling(info->pass);
+    bool writable = false;
+    bool depth = getGraphDepth(info->pass, &writable);
+    VkPipelineDepthStencilStateCreateInfo depthStencil =
+        createDepthStencil(info->depthTest, writable);
+    VkPipelineColorBlendAttachmentState blendAttachment =
+        createBlendAttachment(info->blend);
+    VkPipelineColorBlendStateCreateInfo colorBlend =
+        createColorBlend(&blendAttachment);
+
+    // Every part gets the same layout and renderpass, which is what lets
+    // any combination of them be linked later.
+    VkGraphicsPipelineCreateInfo pipelineInfo = {0};
+    pipelineInfo.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
+    pipelineInfo.stageCount = stageCount;
+    pipelineInfo.pStages = stages;
+    if (input)
+    {
+        pipelineInfo.pVertexInputState = &vertexInput;
+        pipelineInfo.pInputAssemblyState = &assembly;
+    }
+    if (rasterization)
+    {
+        pipelineInfo.pViewportState = &viewport;
+        pipelineInfo.pRasterizationState = &rasterizer;
+    }
+    if (fragment || output) pipelineInfo.pMultisampleState = &multisampling;
+    if (fragment && depth) pipelineInfo.pDepthStencilState = &depthStencil;
+    if (output) pipelineInfo.pColorBlendState = &colorBlend;
+    pipelineInfo.pDynamicState = &dynamicState;
+    pipelineInfo.layout = pPipelineLayout;
+    pipelineInfo.renderPass = getGraphRenderpass(info->pass);
 
-    VkPipelineRasterizationStateCreateInfo rasterizer = createRasterizer();
-    VkPipelineMultisampleStateCreateInfo multisampling = createMultisampling();
-    VkPipelineColorBlendStateCreateInfo colorBlend = createColorBlend();
+    VkGraphicsPipelineLibraryCreateInfoEXT libraryInfo = {0};
+    libraryInfo.sType =
+        VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_LIBRARY_CREATE_INFO_EXT;
+    libraryInfo.flags = parts;
+    if (!whole)
+    {
+        // Keeping the link-time information around is what makes the
+        // optimized link possible afterwards.
+        pipelineInfo.pNext = &libraryInfo;
+        pipelineInfo.flags =
+            VK_PIPELINE_CREATE_LIBRARY_BIT_KHR |
+            VK_PIPELINE_CREATE_RETAIN_LINK_TIME_OPTIMIZATION_INFO_BIT_EXT;
+    }
 
-    createLayout(device);
-    createRenderpass(format, device);
+    VkResult result = vkCreateGraphicsPipelines(pDevice, nullptr, 1,
+                                                &pipelineInfo, gAllocator,
+                                                pipeline);
+    for (uint32_t i = 0; i < stageCount; i++)
+        vkDestroyShaderModule(pDevice, stages[i].module, gAllocator);
+    if (result != VK_SUCCESS)
+    {
+        primrose_log(ERROR, "Failed to create graphics pipeline. Code: %d.",
+                     result);
+        return false;
+    }
+    nameObject(VK_OBJECT_TYPE_PIPELINE, (uint64_t)*pipeline, "%s + %s%s",
+               info->vertex, info->fragment, whole ? "" : " (part)");
+    return true;
+}
+
+bool buildPipeline(const geranium_pipeline_info_t *info, VkPipeline *pipeline)
+{
+    return buildPipelinePart(info, 0, pipeline);
+}
+
+// Compute pipelines share the graphics layout, so they see the same heap
+// and push constants.
+bool buildComputePipeline(const char *shader, VkPipeline *pipeline)
+{
+    VkComputePipelineCreateInfo pipelineInfo = {0};
+    pipelineInfo.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+    if (!createShaderStage(shader, &pipelineInfo.stage, pDevice)) return false;
+    pipelineInfo.layout = pPipelineLayout;
+
+    VkResult result = vkCreateComputePipelines(pDevice, nullptr, 1,
+                                               &pipelineInfo, gAllocator,
+                                               pipeline);
+    vkDestroyShaderModule(pDevice, pipelineInfo.stage.module, gAllocator);
+    if (result != VK_SUCCESS)
+    {
+        primrose_log(ERROR, "Failed to create compute pipeline. Code: %d.",
+                     result);
+        return false;
+    }
+    nameObject(VK_OBJECT_TYPE_PIPELINE, (uint64_t)*pipeline, "%s", shader);
+    return true;
+}
+
+// Links one library of each part into a full pipeline. A fast link does
+// little more than stitch the parts together, while an optimized one is
+// about as slow as building the pipeline outright.
+bool linkPipeline(const VkPipeline *libraries, uint32_t count, bool optimize,
+                  VkPipeline *pipeline)
+{
+    VkPipelineLibraryCreateInfoKHR libraryInfo = {0};
+    libraryInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LIBRARY_CREATE_INFO_KHR;
+    libraryInfo.libraryCount = count;
+    libraryInfo.pLibraries = libraries;
 
     VkGraphicsPipelineCreateInfo pipelineInfo = {0};
     pipelineInfo.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
-    pipelineInfo.stageCount = 2;
-    pipelineInfo.pStages = stages;
-    pipelineInfo.pVertexInputState = &input;
-    pipelineInfo.pInputAssemblyState = &assembly;
-    pipelineInfo.pViewportState = &viewport;
-    pipelineInfo.pRasterizationState = &rasterizer;
-    pipelineInfo.pMultisampleState = &multisampling;
-    pipelineInfo.pColorBlendState = &colorBlend;
+    pipelineInfo.pNext = &libraryInfo;
+    if (optimize)
+        pipelineInfo.flags = VK_PIPELINE_CREATE_LINK_TIME_OPTIMIZATION_BIT_EXT;
     pipelineInfo.layout = pPipelineLayout;
-    pipelineInfo.renderPass = gRenderpass;
 
-    VkResult result = vkCreateGraphicsPipelines(
-        device, nullptr, 1, &pipelineInfo, nullptr, &pGraphicsPipeline);
+    VkResult result = vkCreateGraphicsPipelines(pDevice, nullptr, 1,
+                                                &pipelineInfo, gAllocator,
+                                                pipeline);
     if (result != VK_SUCCESS)
     {
-        primrose_log(ERROR, "Failed to create graphics pipeline. Code: %d.",
+        primrose_log(ERROR, "Failed to link graphics pipeline. Code: %d.",
                      result);
         return false;
     }
-    primrose_log(VERBOSE_OK, "Created graphics pipeline.");
+    return true;
+}
+
+bool createPipeline(const VkDevice device, VkFormat format)
+{
+    GERANIUM_TRACE_SCOPE(__func__);
+
+    pDevice = device;
 
-    vkDestroyShaderModule(device, stages[0].module, nullptr);
-    vkDestroyShaderModule(device, stages[1].module, nullptr);
+    if (!createLayout(device)) return false;
+    if (!createRenderpass(format, VK_IMAGE_LAYOUT_PRESENT_SRC_KHR,
+                          &gRenderpass, device) ||
+        !createRenderpass(format, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+                          &gOffscreenRenderpass, device))
+        return false;
+    nameObject(VK_OBJECT_TYPE_RENDER_PASS, (uint64_t)gRenderpass,
+               "main renderpass");
+    nameObject(VK_OBJECT_TYPE_RENDER_PASS, (uint64_t)gOffscreenRenderpass,
+               "offscreen renderpass");
+
+    geranium_pipeline_info_t info = {
+        .vertex = "default.vert",
+        .fragment = "default.frag",
+        .topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST,
+        .cullMode = VK_CULL_MODE_BACK_BIT,
+        .frontFace = VK_FRONT_FACE_CLOCKWISE,
+        .depthTest = true,
+    };
+    uint32_t pipeline = geranium_getPipeline(&info);
+    if (pipeline == GERANIUM_INVALID_PIPELINE) return false;
+    geranium_usePipeline(pipeline);
+
+    primrose_log(VERBOSE_OK, "Created graphics pipeline.");
     return true;
 }
 
-void beginRenderpass(VkFramebuffer framebuffer, VkCommandBuffer buffer,
-                     const VkExtent2D *const extent)
+// Pipelines themselves are owned by the cache.
+void destroyPipeline(void)
+{
+    if (pDevice == nullptr) return;
+
+    vkDestroyRenderPass(pDevice, gOffscreenRenderpass, gAllocator);
+    vkDestroyRenderPass(pDevice, gRenderpass, gAllocator);
+    vkDestroyPipelineLayout(pDevice, pPipelineLayout, gAllocator);
+    pDevice = nullptr;
+}
+
+static void releasePipeline(uint64_t pipeline)
+{
+    vkDestroyPipeline(pDevice, (VkPipeline)pipeline, gAllocator);
+}
+
+// For pipelines that were never bound.
+void discardPipeline(VkPipeline pipeline)
+{
+    vkDestroyPipeline(pDevice, pipeline, gAllocator);
+}
+
+// Only called between frames. The pipeline lives on until the frames that
+// bound it have finished.
+void retirePipeline(VkPipeline pipeline)
+{
+    if (!retireObject(releasePipeline, (uint64_t)pipeline))
+    {
+        vkDeviceWaitIdle(pDevice);
+        releasePipeline((uint64_t)pipeline);
+    }
+}
+
+void setViewport(VkCommandBuffer buffer, const VkExtent2D *const extent)
+{
+    VkViewport viewport = {0};
+    viewport.width = (float)extent->width;
+    viewport.height = (float)extent->height;
+    viewport.maxDepth = 1.0f;
+    vkCmdSetViewport(buffer, 0, 1, &viewport);
+
+    VkRect2D scissor = {0};
+    scissor.extent = *extent;
+    vkCmdSetScissor(buffer, 0, 1, &scissor);
+}
+
+void beginRenderpass(VkRenderPass renderpass, VkFramebuffer framebuffer,
+                     VkCommandBuffer buffer, const VkExtent2D *const extent)
 {
     VkRenderPassBeginInfo renderPassInfo = {0};
     renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
-    renderPassInfo.renderPass = gRenderpass;
+    renderPassInfo.renderPass = renderpass;
     renderPassInfo.framebuffer = framebuffer;
     renderPassInfo.renderArea.offset = (VkOffset2D){0, 0};
     renderPassInfo.renderArea.extent = *extent;
 
-    VkClearValue clearColor = {{{0.0f, 0.0f, 0.0f, 1.0f}}};
-    renderPassInfo.clearValueCount = 1;
-    renderPassInfo.pClearValues = &clearColor;
+    // The resolve attachment, if any, isn't cleared.
+    VkClearValue clearValues[2] = {
+        {.color = {{0.0f, 0.0f, 0.0f, 1.0f}}},
+        {.depthStencil = {1.0f, 0}},
+    };
+    renderPassInfo.clearValueCount = 2;
+    renderPassInfo.pClearValues = clearValues;
 
     vkCmdBeginRenderPass(buffer, &renderPassInfo, VK_SUBPASS_CONTENTS_INLINE);
     vkCmdBindPipeline(buffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
-                      pGraphicsPipeline);
+                      getActivePipeline());
+    setViewport(buffer, extent);
+}
+
+bool geranium_setConstants(const void *data, size_t size)
+{
+    if (size > GERANIUM_PUSH_CONSTANT_SIZE) return false;
+    memcpy(pConstants, data, size);
+    return true;
+}
+
+// The heap is bound once per frame rather than per draw, and stays bound
+// across every renderpass recorded after it.
+void bindDescriptors(VkCommandBuffer buffer)
+{
+    vkCmdBindDescriptorSets(buffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+                            pPipelineLayout, 0, 1, &gDescriptorSet, 0,
+                            nullptr);
+    vkCmdPushConstants(buffer, pPipelineLayout, VK_SHADER_STAGE_ALL, 0,
+                       GERANIUM_PUSH_CONSTANT_SIZE, pConstants);
+}
+
+void bindComputeDescriptors(VkCommandBuffer buffer)
+{
+    vkCmdBindDescriptorSets(buffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+                            pPipelineLayout, 0, 1, &gDescriptorSet, 0,
+                            nullptr);
+}
+
+// Push constants aren't tied to a bind point, so anything pushed here
+// replaces the caller's until bindDescriptors is next recorded.
+void pushComputeConstants(VkCommandBuffer buffer, const void *data,
+                          uint32_t size)
+{
+    vkCmdPushConstants(buffer, pPipelineLayout, VK_SHADER_STAGE_ALL, 0, size,
+                       data);
 }
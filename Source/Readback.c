@@ -0,0 +1,248 @@
+#include <Geranium.h>
+#include <Primrose.h>
+#include <vulkan/vulkan.h>
+
+// Contained in Memory.c.
+extern const VkAllocationCallbacks *gAllocator;
+
+// Contained in Geranium.c.
+extern bool allocateBuffer(VkDeviceSize size, VkBufferUsageFlags usage,
+                           VkMemoryPropertyFlags required,
+                           VkMemoryPropertyFlags preferred, VkBuffer *buffer,
+                           VkDeviceMemory *memory);
+
+// Contained in Debug.c.
+extern void nameObject(VkObjectType type, uint64_t handle, const char *format,
+                       ...);
+
+typedef enum readback_state
+{
+    READBACK_FREE,
+    READBACK_REQUESTED,
+    READBACK_PENDING
+} readback_state_t;
+
+typedef struct readback_slot
+{
+    VkBuffer buffer;
+    VkDeviceMemory memory;
+    void *mapped;
+    readback_state_t state;
+    uint32_t frame;
+    geranium_readback_t callback;
+    void *data;
+} readback_slot_t;
+
+static bool pRequested = false;
+static bool pCreated = false;
+static readback_slot_t pSlots[GERANIUM_READBACK_SLOTS];
+
+static VkExtent2D pExtent;
+static VkFormat pFormat;
+
+void geranium_enableReadback(bool enabled) { pRequested = enabled; }
+
+bool readbackRequested(void) { return pRequested; }
+
+bool geranium_requestReadback(geranium_readback_t callback, void *data)
+{
+    if (!pCreated || callback == nullptr) return false;
+
+    for (size_t i = 0; i < GERANIUM_READBACK_SLOTS; i++)
+    {
+        if (pSlots[i].state != READBACK_FREE) continue;
+
+        pSlots[i].state = READBACK_REQUESTED;
+        pSlots[i].callback = callback;
+        pSlots[i].data = data;
+        return true;
+    }
+    // Every slot is still in flight; the caller can just try again next
+    // frame rather than us stalling to free one up.
+    return false;
+}
+
+static uint32_t getTexelSize(VkFormat format)
+{
+    switch (format)
+    {
+        case VK_FORMAT_R5G6B5_UNORM_PACK16:
+        case VK_FORMAT_B5G6R5_UNORM_PACK16:  return 2;
+        case VK_FORMAT_R16G16B16A16_SFLOAT:  return 8;
+        default:                             return 4;
+    }
+}
+
+static void destroyBuffers(VkDevice device)
+{
+    for (size_t i = 0; i < GERANIUM_READBACK_SLOTS; i++)
+    {
+        vkUnmapMemory(device, pSlots[i].memory);
+        vkDestroyBuffer(device, pSlots[i].buffer, gAllocator);
+        vkFreeMemory(device, pSlots[i].memory, gAllocator);
+    }
+}
+
+static bool createBuffers(VkDevice device, const VkExtent2D *const extent)
+{
+    VkDeviceSize size =
+        (VkDeviceSize)extent->width * extent->height * getTexelSize(pFormat);
+
+    for (size_t i = 0; i < GERANIUM_READBACK_SLOTS; i++)
+    {
+        // Cached memory makes the CPU reads considerably faster; it's just
+        // not guaranteed to exist.
+        if (!allocateBuffer(size, VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                            VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT,
+                            VK_MEMORY_PROPERTY_HOST_CACHED_BIT,
+                            &pSlots[i].buffer, &pSlots[i].memory))
+            return false;
+
+        VkResult result = vkMapMemory(device, pSlots[i].memory, 0,
+                                      VK_WHOLE_SIZE, 0, &pSlots[i].mapped);
+        if (result != VK_SUCCESS)
+        {
+            primrose_log(ERROR, "Failed to map readback buffer. Code: %d.",
+                         result);
+            return false;
+        }
+        nameObject(VK_OBJECT_TYPE_BUFFER, (uint64_t)pSlots[i].buffer,
+                   "readback %zu", i);
+        nameObject(VK_OBJECT_TYPE_DEVICE_MEMORY, (uint64_t)pSlots[i].memory,
+                   "readback %zu memory", i);
+    }
+
+    pExtent = *extent;
+    primrose_log(VERBOSE_OK, "Created %d %ux%u readback buffers.",
+                 GERANIUM_READBACK_SLOTS, extent->width, extent->height);
+    return true;
+}
+
+bool createReadback(VkDevice device, const VkExtent2D *const extent,
+                    VkFormat format)
+{
+    GERANIUM_TRACE_SCOPE(__func__);
+
+    if (!pRequested) return true;
+
+    pFormat = format;
+    if (!createBuffers(device, extent)) return false;
+
+    pCreated = true;
+    return true;
+}
+
+// Hands off every readback recorded into the given frame slot, which the
+// caller must already know to have finished. UINT32_MAX hands off all of
+// them, for when the device is idle.
+void completeReadbacks(VkDevice device, uint32_t frame)
+{
+    if (!pCreated) return;
+
+    for (size_t i = 0; i < GERANIUM_READBACK_SLOTS; i++)
+    {
+        readback_slot_t *slot = &pSlots[i];
+        if (slot->state != READBACK_PENDING) continue;
+        if (frame != UINT32_MAX && slot->frame != frame) continue;
+
+        VkMappedMemoryRange range = {0};
+        range.sType = VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE;
+        range.memory = slot->memory;
+        range.size = VK_WHOLE_SIZE;
+        vkInvalidateMappedMemoryRanges(device, 1, &range);
+
+        geranium_frame_t result = {
+            .pixels = slot->mapped,
+            .width = pExtent.width,
+            .height = pExtent.height,
+            .format = (uint32_t)pFormat,
+        };
+        slot->state = READBACK_FREE;
+        slot->callback(&result, slot->data);
+    }
+}
+
+bool resizeReadback(VkDevice device, const VkExtent2D *const extent)
+{
+    if (!pCreated) return true;
+
+    completeReadbacks(device, UINT32_MAX);
+    destroyBuffers(device);
+    return createBuffers(device, extent);
+}
+
+void destroyReadback(VkDevice device)
+{
+    if (!pCreated) return;
+
+    completeReadbacks(device, UINT32_MAX);
+    destroyBuffers(device);
+    pCreated = false;
+}
+
+// Copies the finished swapchain image into the oldest requested slot, if
+// there is one. The image is expected, and left, in PRESENT_SRC.
+void recordReadback(VkCommandBuffer buffer, VkImage image, uint32_t frame)
+{
+    if (!pCreated) return;
+
+    readback_slot_t *slot = nullptr;
+    for (size_t i = 0; i < GERANIUM_READBACK_SLOTS; i++)
+        if (pSlots[i].state == READBACK_REQUESTED)
+        {
+            slot = &pSlots[i];
+            break;
+        }
+    if (slot == nullptr) return;
+
+    VkImageMemoryBarrier imageBarrier = {0};
+    imageBarrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+    imageBarrier.srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT |
+                                 VK_ACCESS_TRANSFER_WRITE_BIT;
+    imageBarrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+    imageBarrier.oldLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+    imageBarrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+    imageBarrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    imageBarrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    imageBarrier.image = image;
+    imageBarrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    imageBarrier.subresourceRange.levelCount = 1;
+    imageBarrier.subresourceRange.layerCount = 1;
+
+    vkCmdPipelineBarrier(buffer,
+                         VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT |
+                             VK_PIPELINE_STAGE_TRANSFER_BIT,
+                         VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0,
+                         nullptr, 1, &imageBarrier);
+
+    VkBufferImageCopy region = {0};
+    region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    region.imageSubresource.layerCount = 1;
+    region.imageExtent.width = pExtent.width;
+    region.imageExtent.height = pExtent.height;
+    region.imageExtent.depth = 1;
+    vkCmdCopyImageToBuffer(buffer, image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+                           slot->buffer, 1, &region);
+
+    imageBarrier.srcAccessMask = 0;
+    imageBarrier.dstAccessMask = 0;
+    imageBarrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+    imageBarrier.newLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+
+    VkBufferMemoryBarrier bufferBarrier = {0};
+    bufferBarrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+    bufferBarrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    bufferBarrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+    bufferBarrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    bufferBarrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    bufferBarrier.buffer = slot->buffer;
+    bufferBarrier.size = VK_WHOLE_SIZE;
+
+    vkCmdPipelineBarrier(buffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                         VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT |
+                             VK_PIPELINE_STAGE_HOST_BIT,
+                         0, 0, nullptr, 1, &bufferBarrier, 1, &imageBarrier);
+
+    slot->state = READBACK_PENDING;
+    slot->frame = frame;
+}
@@ -0,0 +1,117 @@
+#define _POSIX_C_SOURCE 200809L
+#include <Geranium.h>
+#include <Primrose.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+// Contained in Cache.c.
+extern void rebuildPipelines(void);
+
+// Contained in Memory.c.
+extern void setBackground(void);
+
+// How long the watcher blocks before checking whether it's been stopped.
+#define GERANIUM_WATCH_TIMEOUT 250
+
+static int pWatcher = -1;
+static pthread_t pThread;
+static atomic_bool pWatching = false;
+
+static bool isShaderSource(const char *name)
+{
+    static const char *const extensions[] = {".vert", ".frag", ".comp",
+                                             ".geom", ".tesc", ".tese"};
+    const char *extension = strrchr(name, '.');
+    if (extension == nullptr) return false;
+    for (size_t i = 0; i < sizeof(extensions) / sizeof(extensions[0]); i++)
+        if (strcmp(extension, extensions[i]) == 0) return true;
+    return false;
+}
+
+// Recompiles whatever changed and rebuilds the pipelines entirely on this
+// thread; the frame loop only ever picks up finished ones.
+static void *watch(void *)
+{
+    setBackground();
+
+    alignas(struct inotify_event) char events[4096];
+    struct pollfd descriptor = {.fd = pWatcher, .events = POLLIN};
+
+    while (atomic_load(&pWatching))
+    {
+        if (poll(&descriptor, 1, GERANIUM_WATCH_TIMEOUT) <= 0) continue;
+
+        ssize_t length = read(pWatcher, events, sizeof(events));
+        if (length <= 0) continue;
+
+        bool changed = false;
+        for (char *current = events; current < events + length;)
+        {
+            const struct inotify_event *event =
+                (const struct inotify_event *)current;
+            current += sizeof(struct inotify_event) + event->len;
+            if (event->len == 0 || !isShaderSource(event->name)) continue;
+
+            const char *name = event->name;
+            if (!geranium_compileShaders(&name, 1))
+            {
+                primrose_log(ERROR,
+                             "Failed to recompile '%s'; keeping the old "
+                             "pipelines.",
+                             name);
+                continue;
+            }
+            changed = true;
+        }
+        if (changed) rebuildPipelines();
+    }
+    return nullptr;
+}
+
+bool geranium_watchShaders(const char *directory)
+{
+    if (atomic_load(&pWatching)) return true;
+
+    pWatcher = inotify_init1(IN_CLOEXEC);
+    if (pWatcher < 0)
+    {
+        primrose_log(ERROR, "Failed to create shader watcher.");
+        return false;
+    }
+
+    // Editors that save through a temporary file show up as a move.
+    if (inotify_add_watch(pWatcher, directory, IN_CLOSE_WRITE | IN_MOVED_TO) <
+        0)
+    {
+        primrose_log(ERROR, "Failed to watch '%s'.", directory);
+        close(pWatcher);
+        pWatcher = -1;
+        return false;
+    }
+
+    atomic_store(&pWatching, true);
+    if (pthread_create(&pThread, nullptr, watch, nullptr) != 0)
+    {
+        primrose_log(ERROR, "Failed to start shader watcher thread.");
+        atomic_store(&pWatching, false);
+        close(pWatcher);
+        pWatcher = -1;
+        return false;
+    }
+
+    primrose_log(VERBOSE_OK, "Watching '%s' for shader changes.", directory);
+    return true;
+}
+
+void geranium_unwatchShaders(void)
+{
+    if (!atomic_exchange(&pWatching, false)) return;
+
+    pthread_join(pThread, nullptr);
+    close(pWatcher);
+    pWatcher = -1;
+}
@@ -0,0 +1,51 @@
+#include <Geranium.h>
+#include <Primrose.h>
+
+#define GERANIUM_MAX_RETIRED 256
+
+typedef void (*release_t)(uint64_t object);
+
+typedef struct retired
+{
+    release_t release;
+    uint64_t object;
+    uint64_t frame;
+} retired_t;
+
+static retired_t pRetired[GERANIUM_MAX_RETIRED];
+static size_t pRetiredCount = 0;
+static uint64_t pFrame = 0;
+
+// Queues an object to be released once every frame that could still be
+// using it has finished.
+bool retireObject(release_t release, uint64_t object)
+{
+    if (pRetiredCount == GERANIUM_MAX_RETIRED)
+    {
+        primrose_log(ERROR, "Too many objects awaiting release.");
+        return false;
+    }
+
+    pRetired[pRetiredCount++] = (retired_t){
+        .release = release,
+        .object = object,
+        .frame = pFrame + GERANIUM_CONCURRENT_FRAMES,
+    };
+    return true;
+}
+
+// Called once per recorded frame, after its fence has been waited on, or
+// with all set once the device is idle.
+void collectRetired(bool all)
+{
+    size_t kept = 0;
+    for (size_t i = 0; i < pRetiredCount; i++)
+    {
+        if (all || pFrame >= pRetired[i].frame)
+            pRetired[i].release(pRetired[i].object);
+        else pRetired[kept++] = pRetired[i];
+    }
+    pRetiredCount = kept;
+
+    if (!all) pFrame++;
+}
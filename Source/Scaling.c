@@ -0,0 +1,329 @@
+#include <Geranium.h>
+#include <Primrose.h>
+#include <math.h>
+#include <vulkan/vulkan.h>
+
+// Contained in Memory.c.
+extern const VkAllocationCallbacks *gAllocator;
+
+// Contained in Geranium.c.
+extern bool allocateImage(const VkImageCreateInfo *const info,
+                          VkMemoryPropertyFlags required,
+                          VkMemoryPropertyFlags preferred, VkImage *image,
+                          VkDeviceMemory *memory);
+
+// Contained in Pipeline.c.
+extern VkRenderPass gOffscreenRenderpass;
+
+// Contained in Attachments.c.
+extern uint32_t getMainAttachments(VkImageView target, VkImageView *views);
+
+// Contained in Debug.c.
+extern void nameObject(VkObjectType type, uint64_t handle, const char *format,
+                       ...);
+
+static float pTargetTime = 0.0f;
+static float pScale = 1.0f;
+static bool pEnabled = false;
+
+static VkQueryPool pQueryPool = nullptr;
+static float pTimestampPeriod = 0.0f;
+static uint64_t pTimestampMask = 0;
+static bool pQueried[GERANIUM_CONCURRENT_FRAMES];
+
+static VkFormat pTargetFormat;
+static VkFilter pFilter = VK_FILTER_LINEAR;
+static VkImage pTarget = nullptr;
+static VkDeviceMemory pTargetMemory = nullptr;
+static VkImageView pTargetView = nullptr;
+static VkFramebuffer pTargetFramebuffer = nullptr;
+
+void geranium_setDynamicResolution(float targetMilliseconds)
+{
+    pTargetTime = targetMilliseconds;
+    if (pTargetTime <= 0.0f) pScale = 1.0f;
+}
+
+float geranium_getRenderScale(void) { return pScale; }
+
+bool scalingRequested(void) { return pTargetTime > 0.0f; }
+
+bool scalingActive(void) { return pEnabled && pTargetTime > 0.0f; }
+
+// Whether the target exists, even if the scale is off for now.
+bool scalingCreated(void) { return pEnabled; }
+
+static void destroyTarget(VkDevice device)
+{
+    vkDestroyFramebuffer(device, pTargetFramebuffer, gAllocator);
+    vkDestroyImageView(device, pTargetView, gAllocator);
+    vkDestroyImage(device, pTarget, gAllocator);
+    vkFreeMemory(device, pTargetMemory, gAllocator);
+}
+
+// The target is always allocated at the full swapchain size and we only
+// render into a corner of it, so changing the scale never reallocates.
+static bool createTarget(VkDevice device, const VkExtent2D *const extent)
+{
+    VkImageCreateInfo imageInfo = {0};
+    imageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+    imageInfo.imageType = VK_IMAGE_TYPE_2D;
+    imageInfo.format = pTargetFormat;
+    imageInfo.extent.width = extent->width;
+    imageInfo.extent.height = extent->height;
+    imageInfo.extent.depth = 1;
+    imageInfo.mipLevels = 1;
+    imageInfo.arrayLayers = 1;
+    imageInfo.samples = VK_SAMPLE_COUNT_1_BIT;
+    imageInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
+    imageInfo.usage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT |
+                      VK_IMAGE_USAGE_TRANSFER_SRC_BIT;
+    imageInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    imageInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+
+    if (!allocateImage(&imageInfo, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, 0,
+                       &pTarget, &pTargetMemory))
+        return false;
+
+    VkImageViewCreateInfo viewInfo = {0};
+    viewInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+    viewInfo.image = pTarget;
+    viewInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
+    viewInfo.format = pTargetFormat;
+    viewInfo.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    viewInfo.subresourceRange.levelCount = 1;
+    viewInfo.subresourceRange.layerCount = 1;
+
+    VkResult result =
+        vkCreateImageView(device, &viewInfo, gAllocator, &pTargetView);
+    if (result != VK_SUCCESS)
+    {
+        primrose_log(ERROR, "Failed to create scaled target view. Code: %d.",
+                     result);
+        return false;
+    }
+
+    VkImageView attachments[3];
+    VkFramebufferCreateInfo framebufferInfo = {0};
+    framebufferInfo.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
+    framebufferInfo.renderPass = gOffscreenRenderpass;
+    framebufferInfo.attachmentCount =
+        getMainAttachments(pTargetView, attachments);
+    framebufferInfo.pAttachments = attachments;
+    framebufferInfo.width = extent->width;
+    framebufferInfo.height = extent->height;
+    framebufferInfo.layers = 1;
+
+    result = vkCreateFramebuffer(device, &framebufferInfo, gAllocator,
+                                 &pTargetFramebuffer);
+    if (result != VK_SUCCESS)
+    {
+        primrose_log(ERROR,
+                     "Failed to create scaled target framebuffer. Code: %d.",
+                     result);
+        return false;
+    }
+
+    nameObject(VK_OBJECT_TYPE_IMAGE, (uint64_t)pTarget, "scaled target");
+    nameObject(VK_OBJECT_TYPE_DEVICE_MEMORY, (uint64_t)pTargetMemory,
+               "scaled target memory");
+    nameObject(VK_OBJECT_TYPE_IMAGE_VIEW, (uint64_t)pTargetView,
+               "scaled target view");
+    nameObject(VK_OBJECT_TYPE_FRAMEBUFFER, (uint64_t)pTargetFramebuffer,
+               "scaled target framebuffer");
+    primrose_log(VERBOSE_OK, "Created %ux%u scaled render target.",
+                 extent->width, extent->height);
+    return true;
+}
+
+bool createScaling(VkPhysicalDevice physicalDevice, VkDevice device,
+                   const VkExtent2D *const extent, VkFormat format,
+                   uint32_t timestampBits)
+{
+    GERANIUM_TRACE_SCOPE(__func__);
+
+    if (!scalingRequested()) return true;
+
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+    if (timestampBits == 0 || !properties.limits.timestampComputeAndGraphics)
+    {
+        primrose_log(ERROR, "Device has no timestamp support; dynamic "
+                            "resolution disabled.");
+        return true;
+    }
+
+    VkFormatProperties formatProperties;
+    vkGetPhysicalDeviceFormatProperties(physicalDevice, format,
+                                        &formatProperties);
+    VkFormatFeatureFlags features = formatProperties.optimalTilingFeatures;
+    if (!(features & VK_FORMAT_FEATURE_BLIT_SRC_BIT) ||
+        !(features & VK_FORMAT_FEATURE_BLIT_DST_BIT))
+    {
+        primrose_log(ERROR, "Surface format cannot be blitted; dynamic "
+                            "resolution disabled.");
+        return true;
+    }
+    // Nearest is ugly but still beats a dropped frame.
+    if (!(features & VK_FORMAT_FEATURE_SAMPLED_IMAGE_FILTER_LINEAR_BIT))
+        pFilter = VK_FILTER_NEAREST;
+
+    pTimestampPeriod = properties.limits.timestampPeriod;
+    pTimestampMask =
+        timestampBits >= 64 ? UINT64_MAX : (1ull << timestampBits) - 1;
+
+    VkQueryPoolCreateInfo queryInfo = {0};
+    queryInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+    queryInfo.queryType = VK_QUERY_TYPE_TIMESTAMP;
+    queryInfo.queryCount = GERANIUM_CONCURRENT_FRAMES * 2;
+
+    VkResult result =
+        vkCreateQueryPool(device, &queryInfo, gAllocator, &pQueryPool);
+    if (result != VK_SUCCESS)
+    {
+        primrose_log(ERROR, "Failed to create timestamp query pool. Code: %d.",
+                     result);
+        return false;
+    }
+    nameObject(VK_OBJECT_TYPE_QUERY_POOL, (uint64_t)pQueryPool,
+               "scaling timestamps");
+
+    pTargetFormat = format;
+    if (!createTarget(device, extent)) return false;
+
+    pEnabled = true;
+    return true;
+}
+
+bool resizeScaling(VkDevice device, const VkExtent2D *const extent)
+{
+    if (!pEnabled) return true;
+
+    destroyTarget(device);
+    return createTarget(device, extent);
+}
+
+void destroyScaling(VkDevice device)
+{
+    if (!pEnabled) return;
+
+    destroyTarget(device);
+    vkDestroyQueryPool(device, pQueryPool, gAllocator);
+    pEnabled = false;
+}
+
+// Reads back the timings of the frame whose fence was just waited on and
+// nudges the scale towards whatever should hit the target time.
+void updateScaling(VkDevice device, uint32_t frame)
+{
+    if (!pEnabled || !pQueried[frame]) return;
+    pQueried[frame] = false;
+
+    uint64_t timestamps[2];
+    if (vkGetQueryPoolResults(device, pQueryPool, frame * 2, 2,
+                              sizeof(timestamps), timestamps, sizeof(uint64_t),
+                              VK_QUERY_RESULT_64_BIT) != VK_SUCCESS)
+        return;
+    if (pTargetTime <= 0.0f) return;
+
+    float milliseconds = (float)((timestamps[1] - timestamps[0]) &
+                                 pTimestampMask) *
+                         pTimestampPeriod / 1000000.0f;
+    if (milliseconds <= 0.0f) return;
+
+    // A bit of hysteresis so we aren't chasing noise every frame.
+    float ratio = pTargetTime / milliseconds;
+    if (ratio > 0.9f && ratio < 1.05f) return;
+
+    // Cost scales with pixel count, i.e. with the square of the scale. Drop
+    // quickly when over budget, but climb back slowly so we don't oscillate.
+    float desired = pScale * sqrtf(ratio);
+    pScale += (desired - pScale) * (desired < pScale ? 0.5f : 0.1f);
+
+    if (pScale < GERANIUM_MINIMUM_RENDER_SCALE)
+        pScale = GERANIUM_MINIMUM_RENDER_SCALE;
+    else if (pScale > 1.0f) pScale = 1.0f;
+}
+
+VkExtent2D getScaledExtent(const VkExtent2D *const extent)
+{
+    VkExtent2D scaled = {
+        .width = (uint32_t)((float)extent->width * pScale),
+        .height = (uint32_t)((float)extent->height * pScale),
+    };
+    if (scaled.width == 0) scaled.width = 1;
+    if (scaled.height == 0) scaled.height = 1;
+    return scaled;
+}
+
+VkFramebuffer getScaledFramebuffer(void) { return pTargetFramebuffer; }
+
+void beginScaledTiming(VkCommandBuffer buffer, uint32_t frame)
+{
+    vkCmdResetQueryPool(buffer, pQueryPool, frame * 2, 2);
+    vkCmdWriteTimestamp(buffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, pQueryPool,
+                        frame * 2);
+}
+
+void endScaledTiming(VkCommandBuffer buffer, uint32_t frame)
+{
+    vkCmdWriteTimestamp(buffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+                        pQueryPool, frame * 2 + 1);
+    pQueried[frame] = true;
+}
+
+// Upscales the rendered corner of the target into the whole swapchain image,
+// leaving the latter ready for presentation.
+void blitScaled(VkCommandBuffer buffer, VkImage image,
+                const VkExtent2D *const source,
+                const VkExtent2D *const destination)
+{
+    VkImageSubresourceRange range = {0};
+    range.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    range.levelCount = 1;
+    range.layerCount = 1;
+
+    // The renderpass already moved the target into TRANSFER_SRC, we just need
+    // its writes visible. The source stage chains onto the semaphore wait
+    // that guards the swapchain image.
+    VkMemoryBarrier targetBarrier = {0};
+    targetBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    targetBarrier.srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+    targetBarrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+
+    VkImageMemoryBarrier imageBarrier = {0};
+    imageBarrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+    imageBarrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    imageBarrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    imageBarrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+    imageBarrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    imageBarrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    imageBarrier.image = image;
+    imageBarrier.subresourceRange = range;
+
+    vkCmdPipelineBarrier(buffer, VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+                         VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 1, &targetBarrier,
+                         0, nullptr, 1, &imageBarrier);
+
+    VkImageBlit region = {0};
+    region.srcSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    region.srcSubresource.layerCount = 1;
+    region.srcOffsets[1] =
+        (VkOffset3D){(int32_t)source->width, (int32_t)source->height, 1};
+    region.dstSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    region.dstSubresource.layerCount = 1;
+    region.dstOffsets[1] = (VkOffset3D){(int32_t)destination->width,
+                                        (int32_t)destination->height, 1};
+
+    vkCmdBlitImage(buffer, pTarget, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+                   image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &region,
+                   pFilter);
+
+    imageBarrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    imageBarrier.dstAccessMask = 0;
+    imageBarrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+    imageBarrier.newLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+    vkCmdPipelineBarrier(buffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                         VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0, 0, nullptr,
+                         0, nullptr, 1, &imageBarrier);
+}
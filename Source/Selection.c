@@ -0,0 +1,102 @@
+#include <Geranium.h>
+#include <Primrose.h>
+#include <stdio.h>
+#include <string.h>
+#include <vulkan/vulkan.h>
+
+// "GRDV", to tell our files from whatever else got pointed at.
+#define GERANIUM_DEVICE_MAGIC 0x56445247
+#define GERANIUM_DEVICE_VERSION 1
+
+// What the last full selection settled on. The UUID alone could survive a
+// driver update that changes the queue layout, so the driver is kept too.
+typedef struct device_record
+{
+    uint32_t magic;
+    uint32_t version;
+    uint8_t uuid[VK_UUID_SIZE];
+    uint32_t vendorID;
+    uint32_t deviceID;
+    uint32_t driverVersion;
+    uint32_t familyCount;
+    uint32_t families[3];
+} device_record_t;
+
+static const char *pPath = nullptr;
+
+void geranium_setDeviceCache(const char *path) { pPath = path; }
+
+static void describeDevice(VkPhysicalDevice device, device_record_t *record)
+{
+    VkPhysicalDeviceIDProperties identifiers = {0};
+    identifiers.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_ID_PROPERTIES;
+    VkPhysicalDeviceProperties2 properties = {0};
+    properties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2;
+    properties.pNext = &identifiers;
+    vkGetPhysicalDeviceProperties2(device, &properties);
+
+    memset(record, 0, sizeof(device_record_t));
+    record->magic = GERANIUM_DEVICE_MAGIC;
+    record->version = GERANIUM_DEVICE_VERSION;
+    memcpy(record->uuid, identifiers.deviceUUID, VK_UUID_SIZE);
+    record->vendorID = properties.properties.vendorID;
+    record->deviceID = properties.properties.deviceID;
+    record->driverVersion = properties.properties.driverVersion;
+}
+
+// Finds the cached device among those enumerated. Only says where to look;
+// the caller still has to check the device can do what's needed of it.
+bool loadDeviceCache(const VkPhysicalDevice *devices, uint32_t count,
+                     uint32_t *chosen, uint32_t families[3],
+                     uint32_t *familyCount)
+{
+    if (pPath == nullptr) return false;
+
+    FILE *file = fopen(pPath, "rb");
+    if (file == nullptr) return false;
+    device_record_t cached;
+    size_t read = fread(&cached, sizeof(device_record_t), 1, file);
+    fclose(file);
+    if (read != 1 || cached.magic != GERANIUM_DEVICE_MAGIC ||
+        cached.version != GERANIUM_DEVICE_VERSION)
+    {
+        primrose_log(VERBOSE, "Ignoring device cache '%s'.", pPath);
+        return false;
+    }
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        device_record_t current;
+        describeDevice(devices[i], &current);
+        if (memcmp(current.uuid, cached.uuid, VK_UUID_SIZE) != 0 ||
+            current.vendorID != cached.vendorID ||
+            current.deviceID != cached.deviceID ||
+            current.driverVersion != cached.driverVersion)
+            continue;
+
+        *chosen = i;
+        memcpy(families, cached.families, sizeof(cached.families));
+        *familyCount = cached.familyCount;
+        return true;
+    }
+    primrose_log(VERBOSE, "Cached device is gone or its driver changed.");
+    return false;
+}
+
+void saveDeviceCache(VkPhysicalDevice device, const uint32_t families[3],
+                     uint32_t familyCount)
+{
+    if (pPath == nullptr) return;
+
+    device_record_t record;
+    describeDevice(device, &record);
+    memcpy(record.families, families, sizeof(record.families));
+    record.familyCount = familyCount;
+
+    // Failing here only costs the next launch a full selection.
+    FILE *file = fopen(pPath, "wb");
+    if (file == nullptr ||
+        fwrite(&record, sizeof(device_record_t), 1, file) != 1)
+        primrose_log(ERROR, "Failed to write device cache '%s'.", pPath);
+    if (file != nullptr) fclose(file);
+}
@@ -2,36 +2,156 @@
 #include <Ageratum.h>
 #include <Geranium.h>
 #include <Primrose.h>
+#include <spirv-tools/libspirv.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <vulkan/vulkan.h>
 
+// Contained in Memory.c.
+extern const VkAllocationCallbacks *gAllocator;
+
+// Contained in Debug.c.
+extern void nameObject(VkObjectType type, uint64_t handle, const char *format,
+                       ...);
+
+typedef struct shader_stage
+{
+    const char *extension;
+    ageratum_type_t source;
+    ageratum_type_t binary;
+    VkShaderStageFlagBits stage;
+} shader_stage_t;
+
+static const shader_stage_t pStages[] = {
+    {"vert", AGERATUM_GLSL_VERTEX, AGERATUM_SPIRV_VERTEX,
+     VK_SHADER_STAGE_VERTEX_BIT},
+    {"frag", AGERATUM_GLSL_FRAGMENT, AGERATUM_SPIRV_FRAGMENT,
+     VK_SHADER_STAGE_FRAGMENT_BIT},
+    {"comp", AGERATUM_GLSL_COMPUTE, AGERATUM_SPIRV_COMPUTE,
+     VK_SHADER_STAGE_COMPUTE_BIT},
+    {"geom", AGERATUM_GLSL_GEOMETRY, AGERATUM_SPIRV_GEOMETRY,
+     VK_SHADER_STAGE_GEOMETRY_BIT},
+    {"tesc", AGERATUM_GLSL_TESS_CONTROL, AGERATUM_SPIRV_TESS_CONTROL,
+     VK_SHADER_STAGE_TESSELLATION_CONTROL_BIT},
+    {"tese", AGERATUM_GLSL_TESS_EVALUATION, AGERATUM_SPIRV_TESS_EVALUATION,
+     VK_SHADER_STAGE_TESSELLATION_EVALUATION_BIT},
+};
+
+static geranium_shader_optimization_t pOptimization =
+    GERANIUM_SHADER_UNOPTIMIZED;
+
+void geranium_setShaderOptimization(geranium_shader_optimization_t level)
+{
+    pOptimization = level;
+}
+
+// Splits the name into the basename Ageratum wants and the stage its
+// extension names. Only the last extension counts, so "sky.night.frag" is
+// fine.
+static const shader_stage_t *findStage(const char *name, char *basename)
+{
+    const char *extension = strrchr(name, '.');
+    size_t length = extension == nullptr ? 0 : (size_t)(extension - name);
+    if (extension == nullptr || length == 0 ||
+        length >= AGERATUM_MAX_PATH_LENGTH)
+    {
+        primrose_log(ERROR, "Shader '%s' has no extension to take a stage "
+                            "from.",
+                     name);
+        return nullptr;
+    }
+    memcpy(basename, name, length);
+    basename[length] = '\0';
+
+    for (size_t i = 0; i < sizeof(pStages) / sizeof(pStages[0]); i++)
+        if (strcmp(extension + 1, pStages[i].extension) == 0)
+            return &pStages[i];
+    primrose_log(ERROR, "Shader '%s' has an unknown stage.", name);
+    return nullptr;
+}
+
+static void report(spv_message_level_t level, const char *,
+                   const spv_position_t *position, const char *message)
+{
+    if (level <= SPV_MSG_ERROR)
+        primrose_log(ERROR, "SPIR-V optimizer: %s (word %zu).", message,
+                     position->index);
+}
+
+// Rewrites the module glslang just wrote. Should anything here fail, the
+// unoptimized module is left in place, which is still perfectly usable.
+static void optimizeShader(ageratum_file_t *file)
+{
+    if (!ageratum_openFile(file, AGERATUM_READ) ||
+        !ageratum_getFileSize(file))
+        return;
+    uint32_t *code = malloc(file->size);
+    if (code == nullptr)
+    {
+        ageratum_closeFile(file);
+        return;
+    }
+    bool loaded = ageratum_loadFile(file, (char *)code);
+    ageratum_closeFile(file);
+    if (!loaded)
+    {
+        free(code);
+        return;
+    }
+
+    // The performance set covers inlining, constant folding and propagation
+    // and aggressive dead code elimination, among others.
+    spv_optimizer_t *optimizer = spvOptimizerCreate(SPV_ENV_VULKAN_1_2);
+    spvOptimizerSetMessageConsumer(optimizer, report);
+    spvOptimizerRegisterPerformancePasses(optimizer);
+    if (pOptimization == GERANIUM_SHADER_RELEASE)
+        spvOptimizerRegisterPassFromFlag(optimizer, "--strip-debug");
+
+    spv_optimizer_options options = spvOptimizerOptionsCreate();
+    spvOptimizerOptionsSetRunValidator(options, false);
+    spv_binary optimized = nullptr;
+    spv_result_t result =
+        spvOptimizerRun(optimizer, code, file->size / sizeof(uint32_t),
+                        &optimized, options);
+    spvOptimizerOptionsDestroy(options);
+    spvOptimizerDestroy(optimizer);
+
+    if (result == SPV_SUCCESS)
+    {
+        size_t before = file->size;
+        file->size = optimized->wordCount * sizeof(uint32_t);
+        if (!ageratum_openFile(file, AGERATUM_WRITE) ||
+            !ageratum_writeFile(file, (char *)optimized->code) ||
+            !ageratum_closeFile(file))
+            primrose_log(ERROR, "Failed to write optimized '%s'.",
+                         file->basename);
+        else
+            primrose_log(VERBOSE, "Optimized '%s' from %zu to %zu bytes.",
+                         file->basename, before, file->size);
+    }
+    else primrose_log(ERROR, "Failed to optimize '%s'.", file->basename);
+    spvBinaryDestroy(optimized);
+    free(code);
+}
+
 bool geranium_compileShaders(const char **names, size_t count)
 {
     for (size_t i = 0; i < count; i++)
     {
-        char *currentName = strdup(names[i]);
-
-        const char *const filename = strtok(currentName, ".");
-        if (filename == nullptr)
-        {
-            printf("File '%s' has no extension and therefore no stage can be "
-                   "assumed.\n",
-                   currentName);
-            free(currentName);
-            return false;
-        }
-        char *extension = strtok(nullptr, ".");
+        char basename[AGERATUM_MAX_PATH_LENGTH];
+        const shader_stage_t *stage = findStage(names[i], basename);
+        if (stage == nullptr) return false;
 
         ageratum_file_t file = {
-            .basename = (char *)filename,
-            .type = (strcmp(extension, "frag") == 0 ? AGERATUM_GLSL_FRAGMENT
-                                                    : AGERATUM_GLSL_VERTEX),
+            .basename = basename,
+            .type = stage->source,
         };
         if (!ageratum_glslToSPIRV(&file)) return false;
 
-        free(currentName);
+        if (pOptimization == GERANIUM_SHADER_UNOPTIMIZED) continue;
+        file.type = stage->binary;
+        optimizeShader(&file);
     }
     return true;
 }
@@ -40,20 +160,14 @@ bool createShaderStage(const char *name, VkPipelineShaderStageCreateInfo *stage,
                        VkDevice logicalDevice)
 {
     char filename[AGERATUM_MAX_PATH_LENGTH];
-    // We only need 4, that's the length of the only file extensions being sent.
-    char extension[5];
-    ageratum_splitStem(name, filename, extension);
-
-    ageratum_type_t type = strcmp(extension, "frag") == 0
-                               ? AGERATUM_SPIRV_FRAGMENT
-                               : AGERATUM_SPIRV_VERTEX;
+    const shader_stage_t *found = findStage(name, filename);
+    if (found == nullptr) return false;
 
     ageratum_file_t file = {
         .basename = filename,
-        .type = type,
+        .type = found->binary,
     };
-    if (!ageratum_fileExists(&file) &&
-        !geranium_compileShaders((const char **)&filename, 1))
+    if (!ageratum_fileExists(&file) && !geranium_compileShaders(&name, 1))
         return false;
 
     if (!ageratum_openFile(&file, AGERATUM_READ) ||
@@ -71,19 +185,18 @@ bool createShaderStage(const char *name, VkPipelineShaderStageCreateInfo *stage,
 
     VkShaderModule module;
     VkResult result = vkCreateShaderModule(logicalDevice, &moduleCreateInfo,
-                                           nullptr, &module);
+                                           gAllocator, &module);
     if (result != VK_SUCCESS)
     {
         primrose_log(ERROR, "Failed to create shader module. Code: %d.",
                      result);
         return false;
     }
+    nameObject(VK_OBJECT_TYPE_SHADER_MODULE, (uint64_t)module, "%s", name);
 
     *stage = (VkPipelineShaderStageCreateInfo){0};
     stage->sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
-    stage->stage =
-        (type == AGERATUM_SPIRV_VERTEX ? VK_SHADER_STAGE_VERTEX_BIT
-                                       : VK_SHADER_STAGE_FRAGMENT_BIT);
+    stage->stage = found->stage;
     stage->module = module;
     stage->pName = "main";
 
@@ -0,0 +1,740 @@
+#include <Geranium.h>
+#include <Primrose.h>
+#include <stdio.h>
+#include <string.h>
+#include <vulkan/vulkan.h>
+
+// Contained in Memory.c.
+extern const VkAllocationCallbacks *gAllocator;
+
+// Contained in Geranium.c.
+extern bool allocateImage(const VkImageCreateInfo *const info,
+                          VkMemoryPropertyFlags required,
+                          VkMemoryPropertyFlags preferred, VkImage *image,
+                          VkDeviceMemory *memory);
+extern bool allocateBuffer(VkDeviceSize size, VkBufferUsageFlags usage,
+                           VkMemoryPropertyFlags required,
+                           VkMemoryPropertyFlags preferred, VkBuffer *buffer,
+                           VkDeviceMemory *memory);
+
+// Contained in Descriptors.c.
+extern uint32_t acquireSlot(uint32_t binding);
+extern void releaseSlot(uint32_t binding, uint32_t slot);
+extern void writeTextureSlot(uint32_t slot, VkImageView view,
+                             VkSampler sampler);
+
+// Contained in Debug.c.
+extern void nameObject(VkObjectType type, uint64_t handle, const char *format,
+                       ...);
+
+#define GERANIUM_TEXTURE_FORMAT VK_FORMAT_R8G8B8A8_SRGB
+#define GERANIUM_SEGMENT_SIZE                                                  \
+    (GERANIUM_STAGING_SIZE / GERANIUM_STAGING_BATCHES)
+
+typedef struct texture
+{
+    bool used;
+    VkImage image;
+    VkDeviceMemory memory;
+    VkImageView view;
+    uint32_t width;
+    uint32_t height;
+    uint32_t levels;
+    uint32_t providedLevels;
+
+    // Only one of these is set, and only while there's data left to stream.
+    const uint8_t *pixels;
+    FILE *file;
+    bool streaming;
+    uint32_t uploadLevel;
+    uint32_t uploadRow;
+
+    // The finest level whose copies have all been recorded, and the timeline
+    // value at which they're done.
+    uint32_t recordedLevel;
+    uint64_t recordedValue;
+    uint64_t lastValue;
+    uint32_t completedLevel;
+    bool mipsReady;
+    uint32_t residentLevel;
+
+    uint64_t retireFrame;
+} texture_t;
+
+typedef struct staging_batch
+{
+    VkCommandBuffer buffer;
+    uint64_t value;
+} staging_batch_t;
+
+static VkDevice pDevice = nullptr;
+static VkQueue pTransferQueue = nullptr;
+static uint32_t pFamilies[2];
+static bool pBlittable = false;
+
+static VkSampler pSampler = nullptr;
+static texture_t pTextures[GERANIUM_MAX_TEXTURES];
+
+static VkCommandPool pTransferPool = nullptr;
+static VkSemaphore pTimeline = nullptr;
+static uint64_t pTimelineValue = 0;
+static uint64_t pCompletedValue = 0;
+
+static VkBuffer pStaging = nullptr;
+static VkDeviceMemory pStagingMemory = nullptr;
+static uint8_t *pStagingData = nullptr;
+static staging_batch_t pBatches[GERANIUM_STAGING_BATCHES];
+static uint32_t pNextBatch = 0;
+
+static uint64_t pFrame = 0;
+
+static uint32_t getLevelWidth(const texture_t *texture, uint32_t level)
+{
+    uint32_t width = texture->width >> level;
+    return width == 0 ? 1 : width;
+}
+
+static uint32_t getLevelHeight(const texture_t *texture, uint32_t level)
+{
+    uint32_t height = texture->height >> level;
+    return height == 0 ? 1 : height;
+}
+
+static size_t getLevelOffset(const texture_t *texture, uint32_t level)
+{
+    size_t offset = 0;
+    for (uint32_t i = 0; i < level; i++)
+        offset += (size_t)getLevelWidth(texture, i) *
+                  getLevelHeight(texture, i) * 4;
+    return offset;
+}
+
+bool createTextures(VkPhysicalDevice physicalDevice, VkDevice device,
+                    VkQueue transferQueue, uint32_t transferIndex,
+                    uint32_t graphicsIndex)
+{
+    GERANIUM_TRACE_SCOPE(__func__);
+
+    pDevice = device;
+    pTransferQueue = transferQueue;
+    pFamilies[0] = graphicsIndex;
+    pFamilies[1] = transferIndex;
+
+    VkFormatProperties formatProperties;
+    vkGetPhysicalDeviceFormatProperties(
+        physicalDevice, GERANIUM_TEXTURE_FORMAT, &formatProperties);
+    VkFormatFeatureFlags features = formatProperties.optimalTilingFeatures;
+    pBlittable = (features & VK_FORMAT_FEATURE_BLIT_SRC_BIT) &&
+                 (features & VK_FORMAT_FEATURE_BLIT_DST_BIT) &&
+                 (features & VK_FORMAT_FEATURE_SAMPLED_IMAGE_FILTER_LINEAR_BIT);
+    if (!pBlittable)
+        primrose_log(ERROR, "Texture format cannot be blitted; mips will not "
+                            "be generated.");
+
+    VkSamplerCreateInfo samplerInfo = {0};
+    samplerInfo.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
+    samplerInfo.magFilter = VK_FILTER_LINEAR;
+    samplerInfo.minFilter = VK_FILTER_LINEAR;
+    samplerInfo.mipmapMode = VK_SAMPLER_MIPMAP_MODE_LINEAR;
+    samplerInfo.addressModeU = VK_SAMPLER_ADDRESS_MODE_REPEAT;
+    samplerInfo.addressModeV = VK_SAMPLER_ADDRESS_MODE_REPEAT;
+    samplerInfo.addressModeW = VK_SAMPLER_ADDRESS_MODE_REPEAT;
+    samplerInfo.maxLod = VK_LOD_CLAMP_NONE;
+
+    VkResult result =
+        vkCreateSampler(device, &samplerInfo, gAllocator, &pSampler);
+    if (result != VK_SUCCESS)
+    {
+        primrose_log(ERROR, "Failed to create sampler. Code: %d.", result);
+        return false;
+    }
+
+    VkSemaphoreTypeCreateInfo timelineInfo = {0};
+    timelineInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO;
+    timelineInfo.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE;
+
+    VkSemaphoreCreateInfo semaphoreInfo = {0};
+    semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+    semaphoreInfo.pNext = &timelineInfo;
+
+    result = vkCreateSemaphore(device, &semaphoreInfo, gAllocator, &pTimeline);
+    if (result != VK_SUCCESS)
+    {
+        primrose_log(ERROR, "Failed to create transfer timeline. Code: %d.",
+                     result);
+        return false;
+    }
+
+    VkCommandPoolCreateInfo poolInfo = {0};
+    poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+    poolInfo.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+    poolInfo.queueFamilyIndex = transferIndex;
+
+    result = vkCreateCommandPool(device, &poolInfo, gAllocator, &pTransferPool);
+    if (result != VK_SUCCESS)
+    {
+        primrose_log(ERROR, "Failed to create transfer command pool. Code: %d.",
+                     result);
+        return false;
+    }
+
+    VkCommandBuffer buffers[GERANIUM_STAGING_BATCHES];
+    VkCommandBufferAllocateInfo allocInfo = {0};
+    allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+    allocInfo.commandPool = pTransferPool;
+    allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+    allocInfo.commandBufferCount = GERANIUM_STAGING_BATCHES;
+
+    result = vkAllocateCommandBuffers(device, &allocInfo, buffers);
+    if (result != VK_SUCCESS)
+    {
+        primrose_log(ERROR,
+                     "Failed to allocate transfer command buffers. Code: %d.",
+                     result);
+        return false;
+    }
+    for (size_t i = 0; i < GERANIUM_STAGING_BATCHES; i++)
+        pBatches[i] = (staging_batch_t){.buffer = buffers[i], .value = 0};
+
+    if (!allocateBuffer(GERANIUM_STAGING_SIZE, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+                        VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                            VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                        0, &pStaging, &pStagingMemory))
+        return false;
+
+    result = vkMapMemory(device, pStagingMemory, 0, VK_WHOLE_SIZE, 0,
+                         (void **)&pStagingData);
+    if (result != VK_SUCCESS)
+    {
+        primrose_log(ERROR, "Failed to map staging buffer. Code: %d.", result);
+        return false;
+    }
+
+    nameObject(VK_OBJECT_TYPE_SAMPLER, (uint64_t)pSampler, "texture sampler");
+    nameObject(VK_OBJECT_TYPE_SEMAPHORE, (uint64_t)pTimeline,
+               "transfer timeline");
+    nameObject(VK_OBJECT_TYPE_COMMAND_POOL, (uint64_t)pTransferPool,
+               "transfer command pool");
+    for (size_t i = 0; i < GERANIUM_STAGING_BATCHES; i++)
+        nameObject(VK_OBJECT_TYPE_COMMAND_BUFFER, (uint64_t)buffers[i],
+                   "transfer batch %zu", i);
+    nameObject(VK_OBJECT_TYPE_BUFFER, (uint64_t)pStaging, "staging buffer");
+    nameObject(VK_OBJECT_TYPE_DEVICE_MEMORY, (uint64_t)pStagingMemory,
+               "staging memory");
+    primrose_log(VERBOSE_OK, "Created texture streaming resources.");
+    return true;
+}
+
+static void releaseTexture(texture_t *texture)
+{
+    if (texture->file != nullptr) fclose(texture->file);
+    vkDestroyImageView(pDevice, texture->view, gAllocator);
+    vkDestroyImage(pDevice, texture->image, gAllocator);
+    vkFreeMemory(pDevice, texture->memory, gAllocator);
+    *texture = (texture_t){0};
+    releaseSlot(GERANIUM_TEXTURE_BINDING, (uint32_t)(texture - pTextures));
+}
+
+void destroyTextures(void)
+{
+    if (pDevice == nullptr) return;
+
+    for (size_t i = 0; i < GERANIUM_MAX_TEXTURES; i++)
+        if (pTextures[i].used) releaseTexture(&pTextures[i]);
+
+    vkUnmapMemory(pDevice, pStagingMemory);
+    vkDestroyBuffer(pDevice, pStaging, gAllocator);
+    vkFreeMemory(pDevice, pStagingMemory, gAllocator);
+    vkDestroyCommandPool(pDevice, pTransferPool, gAllocator);
+    vkDestroySemaphore(pDevice, pTimeline, gAllocator);
+    vkDestroySampler(pDevice, pSampler, gAllocator);
+    pDevice = nullptr;
+}
+
+static uint32_t createTexture(const geranium_texture_info_t *info)
+{
+    if (pDevice == nullptr || info->width == 0 || info->height == 0 ||
+        info->levels == 0)
+        return GERANIUM_INVALID_TEXTURE;
+
+    // Handles double as indices into the descriptor heap's texture array.
+    uint32_t index = acquireSlot(GERANIUM_TEXTURE_BINDING);
+    if (index == UINT32_MAX)
+    {
+        primrose_log(ERROR, "Ran out of texture slots.");
+        return GERANIUM_INVALID_TEXTURE;
+    }
+
+    texture_t *texture = &pTextures[index];
+    *texture = (texture_t){0};
+    texture->width = info->width;
+    texture->height = info->height;
+
+    uint32_t fullLevels = 1;
+    for (uint32_t size = info->width > info->height ? info->width
+                                                    : info->height;
+         size > 1; size >>= 1)
+        fullLevels++;
+    texture->providedLevels =
+        info->levels > fullLevels ? fullLevels : info->levels;
+    texture->levels = pBlittable ? fullLevels : texture->providedLevels;
+
+    VkImageCreateInfo imageInfo = {0};
+    imageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+    imageInfo.imageType = VK_IMAGE_TYPE_2D;
+    imageInfo.format = GERANIUM_TEXTURE_FORMAT;
+    imageInfo.extent.width = info->width;
+    imageInfo.extent.height = info->height;
+    imageInfo.extent.depth = 1;
+    imageInfo.mipLevels = texture->levels;
+    imageInfo.arrayLayers = 1;
+    imageInfo.samples = VK_SAMPLE_COUNT_1_BIT;
+    imageInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
+    imageInfo.usage = VK_IMAGE_USAGE_TRANSFER_SRC_BIT |
+                      VK_IMAGE_USAGE_TRANSFER_DST_BIT |
+                      VK_IMAGE_USAGE_SAMPLED_BIT;
+    imageInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    // Sharing between the two queues is cheaper than bouncing ownership
+    // back and forth for every level.
+    if (pFamilies[0] != pFamilies[1])
+    {
+        imageInfo.sharingMode = VK_SHARING_MODE_CONCURRENT;
+        imageInfo.queueFamilyIndexCount = 2;
+        imageInfo.pQueueFamilyIndices = pFamilies;
+    }
+    else imageInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+
+    if (!allocateImage(&imageInfo, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, 0,
+                       &texture->image, &texture->memory))
+    {
+        releaseSlot(GERANIUM_TEXTURE_BINDING, index);
+        return GERANIUM_INVALID_TEXTURE;
+    }
+
+    VkImageViewCreateInfo viewInfo = {0};
+    viewInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+    viewInfo.image = texture->image;
+    viewInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
+    viewInfo.format = GERANIUM_TEXTURE_FORMAT;
+    viewInfo.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    viewInfo.subresourceRange.levelCount = texture->levels;
+    viewInfo.subresourceRange.layerCount = 1;
+
+    VkResult result =
+        vkCreateImageView(pDevice, &viewInfo, gAllocator, &texture->view);
+    if (result != VK_SUCCESS)
+    {
+        primrose_log(ERROR, "Failed to create texture view. Code: %d.",
+                     result);
+        vkDestroyImage(pDevice, texture->image, gAllocator);
+        vkFreeMemory(pDevice, texture->memory, gAllocator);
+        releaseSlot(GERANIUM_TEXTURE_BINDING, index);
+        return GERANIUM_INVALID_TEXTURE;
+    }
+    // Nothing reads the slot until the texture reports a resident level.
+    writeTextureSlot(index, texture->view, pSampler);
+    nameObject(VK_OBJECT_TYPE_IMAGE, (uint64_t)texture->image, "texture %u",
+               index);
+    nameObject(VK_OBJECT_TYPE_IMAGE_VIEW, (uint64_t)texture->view,
+               "texture %u view", index);
+    nameObject(VK_OBJECT_TYPE_DEVICE_MEMORY, (uint64_t)texture->memory,
+               "texture %u memory", index);
+
+    texture->used = true;
+    texture->streaming = true;
+    texture->uploadLevel = texture->providedLevels - 1;
+    texture->recordedLevel = UINT32_MAX;
+    texture->completedLevel = UINT32_MAX;
+    texture->residentLevel = UINT32_MAX;
+    texture->mipsReady = texture->levels == texture->providedLevels;
+    return index;
+}
+
+uint32_t geranium_createTexture(const geranium_texture_info_t *info,
+                                const void *pixels)
+{
+    uint32_t index = createTexture(info);
+    if (index != GERANIUM_INVALID_TEXTURE) pTextures[index].pixels = pixels;
+    return index;
+}
+
+uint32_t geranium_loadTexture(const geranium_texture_info_t *info,
+                              const char *path)
+{
+    FILE *file = fopen(path, "rb");
+    if (file == nullptr)
+    {
+        primrose_log(ERROR, "Failed to open texture '%s'.", path);
+        return GERANIUM_INVALID_TEXTURE;
+    }
+
+    uint32_t index = createTexture(info);
+    if (index == GERANIUM_INVALID_TEXTURE) fclose(file);
+    else pTextures[index].file = file;
+    return index;
+}
+
+uint32_t geranium_getTextureLevel(uint32_t texture)
+{
+    if (texture >= GERANIUM_MAX_TEXTURES || !pTextures[texture].used)
+        return UINT32_MAX;
+    return pTextures[texture].residentLevel;
+}
+
+void geranium_destroyTexture(uint32_t texture)
+{
+    if (texture >= GERANIUM_MAX_TEXTURES || !pTextures[texture].used ||
+        pTextures[texture].retireFrame != 0)
+        return;
+
+    // Frames in flight may still be sampling it, and copies into it may
+    // still be running, so the actual release waits on both.
+    texture_t *current = &pTextures[texture];
+    current->streaming = false;
+    current->residentLevel = UINT32_MAX;
+    current->retireFrame = pFrame + GERANIUM_CONCURRENT_FRAMES;
+}
+
+VkSampler getTextureSampler(void) { return pSampler; }
+
+VkSemaphore getTransferSemaphore(void) { return pTimeline; }
+
+uint64_t getTransferValue(void) { return pCompletedValue; }
+
+static void transitionLevel(VkCommandBuffer buffer, VkImage image,
+                            uint32_t level, VkImageLayout oldLayout,
+                            VkImageLayout newLayout)
+{
+    VkImageMemoryBarrier barrier = {0};
+    barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+    barrier.oldLayout = oldLayout;
+    barrier.newLayout = newLayout;
+    barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.image = image;
+    barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    barrier.subresourceRange.baseMipLevel = level;
+    barrier.subresourceRange.levelCount = 1;
+    barrier.subresourceRange.layerCount = 1;
+
+    VkPipelineStageFlags srcStage, dstStage;
+    if (oldLayout == VK_IMAGE_LAYOUT_UNDEFINED)
+    {
+        barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        srcStage = VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT;
+        dstStage = VK_PIPELINE_STAGE_TRANSFER_BIT;
+    }
+    else
+    {
+        // Visibility to the graphics queue comes from the timeline wait.
+        barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        srcStage = VK_PIPELINE_STAGE_TRANSFER_BIT;
+        dstStage = VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT;
+    }
+
+    vkCmdPipelineBarrier(buffer, srcStage, dstStage, 0, 0, nullptr, 0,
+                         nullptr, 1, &barrier);
+}
+
+// Finds the texture with the smallest pending level, so every texture gets
+// its coarse levels in before anyone's fine ones.
+static texture_t *getNextUpload(void)
+{
+    texture_t *chosen = nullptr;
+    size_t chosenSize = SIZE_MAX;
+    for (size_t i = 0; i < GERANIUM_MAX_TEXTURES; i++)
+    {
+        texture_t *texture = &pTextures[i];
+        if (!texture->streaming) continue;
+
+        size_t size = (size_t)getLevelWidth(texture, texture->uploadLevel) *
+                      getLevelHeight(texture, texture->uploadLevel);
+        if (size < chosenSize)
+        {
+            chosen = texture;
+            chosenSize = size;
+        }
+    }
+    return chosen;
+}
+
+static void finishStreaming(texture_t *texture)
+{
+    texture->streaming = false;
+    texture->pixels = nullptr;
+    if (texture->file != nullptr) fclose(texture->file);
+    texture->file = nullptr;
+}
+
+static bool readRows(texture_t *texture, size_t offset, size_t size,
+                     uint8_t *destination)
+{
+    if (texture->pixels != nullptr)
+    {
+        memcpy(destination, texture->pixels + offset, size);
+        return true;
+    }
+
+    if (fseek(texture->file, (long)offset, SEEK_SET) != 0 ||
+        fread(destination, 1, size, texture->file) != size)
+    {
+        primrose_log(ERROR, "Failed to read texture data.");
+        return false;
+    }
+    return true;
+}
+
+// Records as many rows as fit into the batch's slice of the staging buffer
+// and submits them. Returns false only on a Vulkan failure.
+static bool fillBatch(staging_batch_t *batch, size_t base)
+{
+    size_t used = 0;
+    bool recording = false;
+
+    texture_t *texture;
+    while (used < GERANIUM_SEGMENT_SIZE &&
+           (texture = getNextUpload()) != nullptr)
+    {
+        uint32_t level = texture->uploadLevel;
+        uint32_t width = getLevelWidth(texture, level);
+        uint32_t height = getLevelHeight(texture, level);
+        size_t rowSize = (size_t)width * 4;
+
+        size_t rows = (GERANIUM_SEGMENT_SIZE - used) / rowSize;
+        if (rows > height - texture->uploadRow)
+            rows = height - texture->uploadRow;
+        if (rows == 0) break;
+
+        if (!recording)
+        {
+            VkCommandBufferBeginInfo beginInfo = {0};
+            beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+            beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+            vkResetCommandBuffer(batch->buffer, 0);
+            if (vkBeginCommandBuffer(batch->buffer, &beginInfo) != VK_SUCCESS)
+            {
+                primrose_log(ERROR, "Failed to begin transfer commands.");
+                return false;
+            }
+            recording = true;
+        }
+
+        size_t size = rows * rowSize;
+        size_t offset =
+            getLevelOffset(texture, level) + texture->uploadRow * rowSize;
+        if (!readRows(texture, offset, size, pStagingData + base + used))
+        {
+            // Whatever landed so far stays usable. A level cut off halfway
+            // never gets published, but still has to leave the transfer
+            // layout like the rest.
+            if (texture->uploadRow > 0)
+                transitionLevel(batch->buffer, texture->image, level,
+                                VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                                VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
+            finishStreaming(texture);
+            continue;
+        }
+
+        if (texture->uploadRow == 0)
+            transitionLevel(batch->buffer, texture->image, level,
+                            VK_IMAGE_LAYOUT_UNDEFINED,
+                            VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
+
+        VkBufferImageCopy region = {0};
+        region.bufferOffset = base + used;
+        region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+        region.imageSubresource.mipLevel = level;
+        region.imageSubresource.layerCount = 1;
+        region.imageOffset.y = (int32_t)texture->uploadRow;
+        region.imageExtent.width = width;
+        region.imageExtent.height = (uint32_t)rows;
+        region.imageExtent.depth = 1;
+        vkCmdCopyBufferToImage(batch->buffer, pStaging, texture->image,
+                               VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1,
+                               &region);
+
+        used += (size + 15) & ~(size_t)15;
+        texture->uploadRow += (uint32_t)rows;
+        texture->lastValue = pTimelineValue + 1;
+        if (texture->uploadRow < height) continue;
+
+        transitionLevel(batch->buffer, texture->image, level,
+                        VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                        VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
+        texture->recordedLevel = level;
+        texture->recordedValue = pTimelineValue + 1;
+        texture->uploadRow = 0;
+        if (level == 0) finishStreaming(texture);
+        else texture->uploadLevel--;
+    }
+    if (!recording) return true;
+
+    if (vkEndCommandBuffer(batch->buffer) != VK_SUCCESS)
+    {
+        primrose_log(ERROR, "Failed to end transfer commands.");
+        return false;
+    }
+
+    pTimelineValue++;
+    VkTimelineSemaphoreSubmitInfo timelineInfo = {0};
+    timelineInfo.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
+    timelineInfo.signalSemaphoreValueCount = 1;
+    timelineInfo.pSignalSemaphoreValues = &pTimelineValue;
+
+    VkSubmitInfo submitInfo = {0};
+    submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    submitInfo.pNext = &timelineInfo;
+    submitInfo.commandBufferCount = 1;
+    submitInfo.pCommandBuffers = &batch->buffer;
+    submitInfo.signalSemaphoreCount = 1;
+    submitInfo.pSignalSemaphores = &pTimeline;
+
+    VkResult result = vkQueueSubmit(pTransferQueue, 1, &submitInfo, nullptr);
+    if (result != VK_SUCCESS)
+    {
+        primrose_log(ERROR, "Failed to submit texture uploads. Code: %d.",
+                     result);
+        return false;
+    }
+    batch->value = pTimelineValue;
+    return true;
+}
+
+// Called every geranium_render, whether or not a frame ends up drawn.
+// Publishes whatever uploads finished and keeps the staging ring busy.
+bool pumpTextures(void)
+{
+    if (pDevice == nullptr) return true;
+
+    vkGetSemaphoreCounterValue(pDevice, pTimeline, &pCompletedValue);
+
+    bool changed = false;
+    for (size_t i = 0; i < GERANIUM_MAX_TEXTURES; i++)
+    {
+        texture_t *texture = &pTextures[i];
+        if (!texture->used || texture->retireFrame != 0) continue;
+        if (texture->recordedLevel == texture->completedLevel ||
+            pCompletedValue < texture->recordedValue)
+            continue;
+
+        texture->completedLevel = texture->recordedLevel;
+        // Until the generated tail exists, sampling even the coarsest
+        // provided level could reach into garbage. Either way a frame needs
+        // drawing, be it to show the level or to generate the tail.
+        if (texture->mipsReady)
+            texture->residentLevel = texture->completedLevel;
+        changed = true;
+    }
+    if (changed) geranium_markDirty();
+
+    staging_batch_t *batch = &pBatches[pNextBatch];
+    if (pCompletedValue < batch->value) return true;
+    if (!fillBatch(batch, pNextBatch * GERANIUM_SEGMENT_SIZE)) return false;
+    pNextBatch = (pNextBatch + 1) % GERANIUM_STAGING_BATCHES;
+    return true;
+}
+
+static void generateMips(VkCommandBuffer buffer, texture_t *texture)
+{
+    uint32_t base = texture->providedLevels - 1;
+
+    VkImageMemoryBarrier barriers[2] = {{0}, {0}};
+    for (size_t i = 0; i < 2; i++)
+    {
+        barriers[i].sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+        barriers[i].srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        barriers[i].dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        barriers[i].image = texture->image;
+        barriers[i].subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+        barriers[i].subresourceRange.layerCount = 1;
+    }
+
+    // The source stage chains onto the frame's wait on the transfer timeline.
+    barriers[0].dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+    barriers[0].oldLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+    barriers[0].newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+    barriers[0].subresourceRange.baseMipLevel = base;
+    barriers[0].subresourceRange.levelCount = 1;
+
+    barriers[1].dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barriers[1].oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    barriers[1].newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+    barriers[1].subresourceRange.baseMipLevel = base + 1;
+    barriers[1].subresourceRange.levelCount = texture->levels - base - 1;
+
+    vkCmdPipelineBarrier(buffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                         VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0,
+                         nullptr, 2, barriers);
+
+    for (uint32_t level = base + 1; level < texture->levels; level++)
+    {
+        VkImageBlit region = {0};
+        region.srcSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+        region.srcSubresource.mipLevel = level - 1;
+        region.srcSubresource.layerCount = 1;
+        region.srcOffsets[1] =
+            (VkOffset3D){(int32_t)getLevelWidth(texture, level - 1),
+                         (int32_t)getLevelHeight(texture, level - 1), 1};
+        region.dstSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+        region.dstSubresource.mipLevel = level;
+        region.dstSubresource.layerCount = 1;
+        region.dstOffsets[1] =
+            (VkOffset3D){(int32_t)getLevelWidth(texture, level),
+                         (int32_t)getLevelHeight(texture, level), 1};
+
+        vkCmdBlitImage(buffer, texture->image,
+                       VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, texture->image,
+                       VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &region,
+                       VK_FILTER_LINEAR);
+
+        barriers[0].srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        barriers[0].dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+        barriers[0].oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+        barriers[0].newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+        barriers[0].subresourceRange.baseMipLevel = level;
+        vkCmdPipelineBarrier(buffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                             VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0,
+                             nullptr, 1, &barriers[0]);
+    }
+
+    barriers[0].srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barriers[0].dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+    barriers[0].oldLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+    barriers[0].newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+    barriers[0].subresourceRange.baseMipLevel = base;
+    barriers[0].subresourceRange.levelCount = texture->levels - base;
+    vkCmdPipelineBarrier(buffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                         VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0, 0, nullptr,
+                         0, nullptr, 1, &barriers[0]);
+}
+
+// Records the graphics-queue half of streaming into the frame, and releases
+// textures nothing can be using anymore.
+void recordTextureWork(VkCommandBuffer buffer)
+{
+    if (pDevice == nullptr) return;
+
+    for (size_t i = 0; i < GERANIUM_MAX_TEXTURES; i++)
+    {
+        texture_t *texture = &pTextures[i];
+        if (!texture->used) continue;
+
+        if (texture->retireFrame != 0)
+        {
+            if (pFrame >= texture->retireFrame &&
+                pCompletedValue >= texture->lastValue)
+                releaseTexture(texture);
+            continue;
+        }
+
+        // The coarsest provided level is always the first one to complete.
+        if (texture->mipsReady || texture->completedLevel == UINT32_MAX)
+            continue;
+
+        generateMips(buffer, texture);
+        texture->mipsReady = true;
+        texture->residentLevel = texture->completedLevel;
+    }
+
+    pFrame++;
+}
@@ -0,0 +1,342 @@
+#define _POSIX_C_SOURCE 200809L
+#include <Geranium.h>
+
+// Without GERANIUM_TRACE defined there's nothing here at all, and the scope
+// macros expand to nothing.
+#ifdef GERANIUM_TRACE
+
+#include <Primrose.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <time.h>
+#include <vulkan/vulkan.h>
+
+// Contained in Memory.c.
+extern const VkAllocationCallbacks *gAllocator;
+
+// Contained in Debug.c.
+extern void nameObject(VkObjectType type, uint64_t handle, const char *format,
+                       ...);
+
+// Per ring, so the oldest events are overwritten once a thread's fills up.
+#define GERANIUM_TRACE_EVENTS 4096
+#define GERANIUM_TRACE_THREADS 8
+// Timestamp pairs per frame in flight.
+#define GERANIUM_TRACE_GPU_SCOPES 16
+
+typedef struct trace_event
+{
+    const char *name;
+    uint64_t start;
+    uint64_t duration;
+} trace_event_t;
+
+// Only its owning thread ever writes a ring, so publishing an event is a
+// single release store of the head. A ring goes back to the pool when its
+// thread exits, keeping its events for the next owner to write after.
+typedef struct trace_ring
+{
+    trace_event_t events[GERANIUM_TRACE_EVENTS];
+    atomic_uint_fast64_t head;
+    atomic_bool owned;
+} trace_ring_t;
+
+static trace_ring_t pRings[GERANIUM_TRACE_THREADS];
+static thread_local trace_ring_t *pRing = nullptr;
+static pthread_once_t pKeyOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t pKey;
+// Filled by the frame loop as timestamps come back.
+static trace_ring_t pGpuRing;
+
+typedef struct gpu_frame
+{
+    const char *names[GERANIUM_TRACE_GPU_SCOPES];
+    uint32_t count;
+    uint32_t stack[GERANIUM_TRACE_GPU_SCOPES];
+    uint32_t depth;
+    // Scopes begun past the limit, which their ends have to skip.
+    uint32_t overflow;
+    bool recorded;
+} gpu_frame_t;
+
+static VkDevice pDevice = nullptr;
+static VkQueryPool pQueryPool = nullptr;
+static float pTimestampPeriod = 0.0f;
+static uint64_t pTimestampMask = 0;
+static PFN_vkGetCalibratedTimestampsEXT pCalibrate = nullptr;
+static gpu_frame_t pFrames[GERANIUM_CONCURRENT_FRAMES];
+static uint32_t pFrame = 0;
+
+uint64_t geranium_traceNow(void)
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (uint64_t)time.tv_sec * 1000000000ull + (uint64_t)time.tv_nsec;
+}
+
+static void push(trace_ring_t *ring, const trace_event_t *event)
+{
+    uint_fast64_t head = atomic_load_explicit(&ring->head,
+                                              memory_order_relaxed);
+    ring->events[head % GERANIUM_TRACE_EVENTS] = *event;
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+static void releaseRing(void *ring)
+{
+    atomic_store(&((trace_ring_t *)ring)->owned, false);
+}
+
+static void createKey(void) { pthread_key_create(&pKey, releaseRing); }
+
+// Threads past the limit drop their events until some other thread exits.
+static trace_ring_t *claimRing(void)
+{
+    pthread_once(&pKeyOnce, createKey);
+    for (size_t i = 0; i < GERANIUM_TRACE_THREADS; i++)
+    {
+        bool expected = false;
+        if (!atomic_compare_exchange_strong(&pRings[i].owned, &expected,
+                                            true))
+            continue;
+
+        pthread_setspecific(pKey, &pRings[i]);
+        return &pRings[i];
+    }
+    return nullptr;
+}
+
+void geranium_traceEnd(geranium_trace_scope_t *scope)
+{
+    if (pRing == nullptr) pRing = claimRing();
+    if (pRing == nullptr) return;
+
+    trace_event_t event = {
+        .name = scope->name,
+        .start = scope->start,
+        .duration = geranium_traceNow() - scope->start,
+    };
+    push(pRing, &event);
+}
+
+bool createTrace(VkInstance instance, VkPhysicalDevice physicalDevice,
+                 VkDevice device, uint32_t timestampBits, bool calibrated)
+{
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+    if (!calibrated || timestampBits == 0 ||
+        !properties.limits.timestampComputeAndGraphics)
+    {
+        primrose_log(VERBOSE, "No calibrated timestamps; tracing the CPU "
+                              "only.");
+        return true;
+    }
+
+    // The device clock has to be comparable to the one CPU events use.
+    PFN_vkGetPhysicalDeviceCalibrateableTimeDomainsEXT getDomains =
+        (PFN_vkGetPhysicalDeviceCalibrateableTimeDomainsEXT)
+            vkGetInstanceProcAddr(
+                instance, "vkGetPhysicalDeviceCalibrateableTimeDomainsEXT");
+    uint32_t domainCount = 0;
+    VkTimeDomainEXT domains[8];
+    if (getDomains != nullptr)
+    {
+        domainCount = 8;
+        getDomains(physicalDevice, &domainCount, domains);
+    }
+    bool deviceDomain = false, monotonicDomain = false;
+    for (uint32_t i = 0; i < domainCount; i++)
+    {
+        deviceDomain |= domains[i] == VK_TIME_DOMAIN_DEVICE_EXT;
+        monotonicDomain |= domains[i] == VK_TIME_DOMAIN_CLOCK_MONOTONIC_EXT;
+    }
+    pCalibrate = (PFN_vkGetCalibratedTimestampsEXT)vkGetDeviceProcAddr(
+        device, "vkGetCalibratedTimestampsEXT");
+    if (!deviceDomain || !monotonicDomain || pCalibrate == nullptr)
+    {
+        primrose_log(VERBOSE, "Device clock can't be calibrated; tracing the "
+                              "CPU only.");
+        return true;
+    }
+
+    VkQueryPoolCreateInfo queryInfo = {0};
+    queryInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+    queryInfo.queryType = VK_QUERY_TYPE_TIMESTAMP;
+    queryInfo.queryCount =
+        GERANIUM_CONCURRENT_FRAMES * GERANIUM_TRACE_GPU_SCOPES * 2;
+
+    VkResult result =
+        vkCreateQueryPool(device, &queryInfo, gAllocator, &pQueryPool);
+    if (result != VK_SUCCESS)
+    {
+        primrose_log(ERROR, "Failed to create trace query pool. Code: %d.",
+                     result);
+        return false;
+    }
+    nameObject(VK_OBJECT_TYPE_QUERY_POOL, (uint64_t)pQueryPool,
+               "trace timestamps");
+
+    pDevice = device;
+    pTimestampPeriod = properties.limits.timestampPeriod;
+    pTimestampMask =
+        timestampBits >= 64 ? UINT64_MAX : (1ull << timestampBits) - 1;
+    primrose_log(VERBOSE_OK, "Tracing GPU timestamps.");
+    return true;
+}
+
+void destroyTrace(void)
+{
+    if (pDevice == nullptr) return;
+
+    vkDestroyQueryPool(pDevice, pQueryPool, gAllocator);
+    pQueryPool = nullptr;
+    pDevice = nullptr;
+}
+
+void beginGpuTrace(VkCommandBuffer buffer, uint32_t frame)
+{
+    if (pDevice == nullptr) return;
+
+    pFrame = frame;
+    pFrames[frame] = (gpu_frame_t){.recorded = true};
+    vkCmdResetQueryPool(buffer, pQueryPool,
+                        frame * GERANIUM_TRACE_GPU_SCOPES * 2,
+                        GERANIUM_TRACE_GPU_SCOPES * 2);
+}
+
+// Scopes have to nest.
+void beginGpuScope(VkCommandBuffer buffer, const char *name)
+{
+    if (pDevice == nullptr) return;
+
+    gpu_frame_t *frame = &pFrames[pFrame];
+    if (frame->count == GERANIUM_TRACE_GPU_SCOPES)
+    {
+        frame->overflow++;
+        return;
+    }
+
+    uint32_t index = frame->count++;
+    frame->names[index] = name;
+    frame->stack[frame->depth++] = index;
+    vkCmdWriteTimestamp(buffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, pQueryPool,
+                        (pFrame * GERANIUM_TRACE_GPU_SCOPES + index) * 2);
+}
+
+void endGpuScope(VkCommandBuffer buffer)
+{
+    if (pDevice == nullptr) return;
+
+    gpu_frame_t *frame = &pFrames[pFrame];
+    if (frame->overflow > 0)
+    {
+        frame->overflow--;
+        return;
+    }
+    if (frame->depth == 0) return;
+
+    uint32_t index = frame->stack[--frame->depth];
+    vkCmdWriteTimestamp(buffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+                        pQueryPool,
+                        (pFrame * GERANIUM_TRACE_GPU_SCOPES + index) * 2 + 1);
+}
+
+// Called once the frame's fence has been waited on. Ticks are placed on the
+// CPU timeline relative to a fresh calibration, so drift never builds up.
+void collectGpuTrace(uint32_t frame)
+{
+    if (pDevice == nullptr || !pFrames[frame].recorded) return;
+    pFrames[frame].recorded = false;
+
+    uint32_t count = pFrames[frame].count;
+    if (count == 0) return;
+
+    uint64_t timestamps[GERANIUM_TRACE_GPU_SCOPES * 2];
+    if (vkGetQueryPoolResults(pDevice, pQueryPool,
+                              frame * GERANIUM_TRACE_GPU_SCOPES * 2, count * 2,
+                              sizeof(timestamps), timestamps, sizeof(uint64_t),
+                              VK_QUERY_RESULT_64_BIT) != VK_SUCCESS)
+        return;
+
+    VkCalibratedTimestampInfoEXT infos[2] = {0};
+    infos[0].sType = VK_STRUCTURE_TYPE_CALIBRATED_TIMESTAMP_INFO_EXT;
+    infos[0].timeDomain = VK_TIME_DOMAIN_DEVICE_EXT;
+    infos[1].sType = VK_STRUCTURE_TYPE_CALIBRATED_TIMESTAMP_INFO_EXT;
+    infos[1].timeDomain = VK_TIME_DOMAIN_CLOCK_MONOTONIC_EXT;
+    uint64_t now[2], deviation;
+    if (pCalibrate(pDevice, 2, infos, now, &deviation) != VK_SUCCESS) return;
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        uint64_t start = (now[0] - timestamps[i * 2]) & pTimestampMask;
+        uint64_t end = (timestamps[i * 2 + 1] - timestamps[i * 2]) &
+                       pTimestampMask;
+        trace_event_t event = {
+            .name = pFrames[frame].names[i],
+            .start = now[1] - (uint64_t)((double)start * pTimestampPeriod),
+            .duration = (uint64_t)((double)end * pTimestampPeriod),
+        };
+        push(&pGpuRing, &event);
+    }
+}
+
+static void writeEvents(FILE *file, trace_ring_t *ring, uint32_t thread,
+                        bool *first)
+{
+    uint_fast64_t head = atomic_load_explicit(&ring->head,
+                                              memory_order_acquire);
+    uint_fast64_t start =
+        head > GERANIUM_TRACE_EVENTS ? head - GERANIUM_TRACE_EVENTS : 0;
+
+    for (uint_fast64_t i = start; i < head; i++)
+    {
+        trace_event_t event = ring->events[i % GERANIUM_TRACE_EVENTS];
+
+        // The owner may have lapped us while we were reading, in which case
+        // the slot holds something newer than we think.
+        uint_fast64_t current = atomic_load_explicit(&ring->head,
+                                                     memory_order_acquire);
+        if (current >= GERANIUM_TRACE_EVENTS &&
+            i <= current - GERANIUM_TRACE_EVENTS)
+            continue;
+
+        fprintf(file,
+                "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":0,\"tid\":%u,"
+                "\"ts\":%.3f,\"dur\":%.3f}",
+                *first ? "" : ",", event.name, thread,
+                (double)event.start / 1000.0,
+                (double)event.duration / 1000.0);
+        *first = false;
+    }
+}
+
+// Event names are written as they are, so they shouldn't need escaping.
+bool geranium_writeTrace(const char *path)
+{
+    FILE *file = fopen(path, "w");
+    if (file == nullptr)
+    {
+        primrose_log(ERROR, "Failed to open trace file '%s'.", path);
+        return false;
+    }
+
+    bool first = true;
+    fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[", file);
+
+    for (uint32_t i = 0; i < GERANIUM_TRACE_THREADS; i++)
+        writeEvents(file, &pRings[i], i, &first);
+    writeEvents(file, &pGpuRing, GERANIUM_TRACE_THREADS, &first);
+
+    fprintf(file,
+            "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,"
+            "\"tid\":%u,\"args\":{\"name\":\"GPU\"}}\n]}\n",
+            first ? "" : ",", GERANIUM_TRACE_THREADS);
+
+    bool written = !ferror(file);
+    if (fclose(file) != 0) written = false;
+    if (!written) primrose_log(ERROR, "Failed to write trace file '%s'.", path);
+    return written;
+}
+
+#endif
@@ -5,6 +5,9 @@
 #include <vulkan/vulkan.h>
 #include <vulkan/vulkan_wayland.h>
 
+// Contained in Memory.c.
+extern const VkAllocationCallbacks *gAllocator;
+
 VkSurfaceKHR createSurface(VkInstance instance, void **data)
 {
     VkWaylandSurfaceCreateInfoKHR createInfo = {0};
@@ -13,7 +16,7 @@ VkSurfaceKHR createSurface(VkInstance instance, void **data)
     createInfo.surface = data[1];
 
     VkSurfaceKHR createdSurface;
-    VkResult code = vkCreateWaylandSurfaceKHR(instance, &createInfo, nullptr,
+    VkResult code = vkCreateWaylandSurfaceKHR(instance, &createInfo, gAllocator,
                                               &createdSurface);
     if (code != VK_SUCCESS)
     {